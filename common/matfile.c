@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+
+#include "matfile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#define MATFILE_VERSION 1
+#define HUGETLBFS_MAGIC 0x958458f6
+// Transparent huge pages and the pages asked of hugetlb with huge_alloc
+#define HUGE_PAGE ((size_t)2 << 20)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+// Page size of the file system of fd: huge on hugetlbfs, 0 elsewhere
+static size_t hugetlbfs_page(int fd) {
+    struct statfs fs;
+    if (fstatfs(fd, &fs) == 0 && (unsigned long)fs.f_type == HUGETLBFS_MAGIC)
+        return (size_t)fs.f_bsize;
+    return 0;
+}
+
+static float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16, exp = (h >> 10) & 0x1f, man = h & 0x3ff, bits;
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (man << 13);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (man << 13);
+    } else if (man == 0) {
+        bits = sign;
+    } else {
+        // Subnormal: shift the leading one up to the implicit bit
+        exp = 113;
+        while (!(man & 0x400)) {
+            man <<= 1;
+            --exp;
+        }
+        bits = sign | (exp << 23) | ((man & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+void *huge_alloc(size_t bytes) {
+    size_t len = round_up(bytes > 0 ? bytes : 1, HUGE_PAGE);
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+    if (p != MAP_FAILED)
+        return p;
+
+    // No reserved huge pages: map with room to align to a huge page, which
+    // transparent huge pages need, and trim the rest
+    char *raw = (char*)mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    char *aligned = (char*)round_up((size_t)raw, HUGE_PAGE);
+    if (aligned > raw)
+        munmap(raw, aligned - raw);
+    munmap(aligned + len, raw + HUGE_PAGE - aligned);
+    madvise(aligned, len, MADV_HUGEPAGE);
+    return aligned;
+}
+
+void huge_free(void *p, size_t bytes) {
+    if (p != NULL)
+        munmap(p, round_up(bytes > 0 ? bytes : 1, HUGE_PAGE));
+}
+
+// Read and check the header of the matrix file fd; returns its size, or -1
+static off_t read_header(int fd, const char *path, struct matfile_header *h) {
+    struct stat st;
+    if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) || memcmp(h->magic, "MATF", 4) != 0
+            || h->version != MATFILE_VERSION) {
+        fprintf(stderr, "%s: not a matrix file\n", path);
+        return -1;
+    }
+    size_t elem = h->dtype == MATFILE_FLOAT ? sizeof(float) : sizeof(uint16_t);
+    if ((h->dtype != MATFILE_FLOAT && h->dtype != MATFILE_HALF) || h->ld < h->cols
+            || h->offset % sysconf(_SC_PAGESIZE) != 0 || fstat(fd, &st) != 0
+            || (h->rows > 0 && (uint64_t)st.st_size < h->offset + ((h->rows - 1) * h->ld + h->cols) * elem)) {
+        fprintf(stderr, "%s: bad header or truncated\n", path);
+        return -1;
+    }
+    return st.st_size;
+}
+
+// Header of a new rows x cols float matrix
+static void new_header(struct matfile_header *h, size_t rows, size_t cols) {
+    memcpy(h->magic, "MATF", 4);
+    h->version = MATFILE_VERSION;
+    h->dtype = MATFILE_FLOAT;
+    h->rows = rows;
+    h->cols = cols;
+    h->ld = cols;
+    h->offset = sysconf(_SC_PAGESIZE);
+}
+
+float *matfile_open(struct matfile *m, const char *path) {
+    memset(m, 0, sizeof(struct matfile));
+    m->fd = -1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    struct matfile_header *h = &m->header;
+    off_t size = read_header(fd, path, h);
+    if (size < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t huge = hugetlbfs_page(fd);
+    m->map_len = huge > 0 ? round_up(size, huge) : (size_t)size;
+    m->map = mmap(NULL, m->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m->map == MAP_FAILED) {
+        perror(path);
+        m->map = NULL;
+        return NULL;
+    }
+    if (huge == 0)
+        madvise(m->map, m->map_len, MADV_HUGEPAGE);
+    m->data = (float*)((char*)m->map + h->offset);
+    if (h->dtype == MATFILE_FLOAT)
+        return m->data;
+
+    // Half is widened without the padding of its rows
+    const uint16_t *in = (const uint16_t*)m->data;
+    m->data_len = sizeof(float) * h->rows * h->cols;
+    m->data = (float*)huge_alloc(m->data_len);
+    if (m->data == NULL) {
+        perror(path);
+        matfile_close(m);
+        return NULL;
+    }
+    for (size_t i = 0; i < h->rows; ++i)
+        for (size_t j = 0; j < h->cols; ++j)
+            m->data[i * h->cols + j] = half_to_float(in[i * h->ld + j]);
+    munmap(m->map, m->map_len);
+    m->map = NULL;
+    h->dtype = MATFILE_FLOAT;
+    h->ld = h->cols;
+    return m->data;
+}
+
+float *matfile_create(struct matfile *m, const char *path, size_t rows, size_t cols) {
+    memset(m, 0, sizeof(struct matfile));
+    m->fd = -1;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    // hugetlbfs takes no write(), so the header goes through the mapping too
+    struct matfile_header *h = &m->header;
+    new_header(h, rows, cols);
+    size_t huge = hugetlbfs_page(fd);
+    m->map_len = h->offset + sizeof(float) * rows * cols;
+    if (huge > 0)
+        m->map_len = round_up(m->map_len, huge);
+    if (ftruncate(fd, m->map_len) != 0
+            || (m->map = mmap(NULL, m->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror(path);
+        m->map = NULL;
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    if (huge == 0)
+        madvise(m->map, m->map_len, MADV_HUGEPAGE);
+    memcpy(m->map, h, sizeof(*h));
+    m->writable = 1;
+    m->data = (float*)((char*)m->map + h->offset);
+    return m->data;
+}
+
+int matfile_open_stream(struct matfile *m, const char *path) {
+    memset(m, 0, sizeof(struct matfile));
+    m->fd = open(path, O_RDONLY);
+    if (m->fd < 0) {
+        perror(path);
+        return 0;
+    }
+    if (read_header(m->fd, path, &m->header) < 0) {
+        matfile_close(m);
+        return 0;
+    }
+    return 1;
+}
+
+int matfile_create_stream(struct matfile *m, const char *path, size_t rows, size_t cols) {
+    memset(m, 0, sizeof(struct matfile));
+    m->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m->fd < 0) {
+        perror(path);
+        return 0;
+    }
+    new_header(&m->header, rows, cols);
+    if (ftruncate(m->fd, m->header.offset + sizeof(float) * rows * cols) != 0
+            || pwrite(m->fd, &m->header, sizeof(m->header), 0) != sizeof(m->header)) {
+        perror(path);
+        matfile_close(m);
+        return 0;
+    }
+    m->writable = 1;
+    return 1;
+}
+
+// pread and pwrite, which may move less than asked for at a time
+static int pread_full(int fd, void *buf, size_t bytes, off_t offset) {
+    for (char *p = (char*)buf; bytes > 0; ) {
+        ssize_t n = pread(fd, p, bytes, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        offset += n;
+        bytes -= n;
+    }
+    return 1;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t bytes, off_t offset) {
+    for (const char *p = (const char*)buf; bytes > 0; ) {
+        ssize_t n = pwrite(fd, p, bytes, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        offset += n;
+        bytes -= n;
+    }
+    return 1;
+}
+
+int matfile_read(struct matfile *m, size_t row, size_t col, size_t rows, size_t cols,
+    float *out, size_t ld) {
+    const struct matfile_header *h = &m->header;
+    if (h->dtype == MATFILE_FLOAT) {
+        // Whole rows that are contiguous on both sides go in one read
+        if (cols == h->ld && ld == cols)
+            return pread_full(m->fd, out, sizeof(float) * rows * cols,
+                h->offset + sizeof(float) * row * h->ld);
+        for (size_t i = 0; i < rows; ++i) {
+            if (!pread_full(m->fd, out + i * ld, sizeof(float) * cols,
+                    h->offset + sizeof(float) * ((row + i) * h->ld + col)))
+                return 0;
+        }
+        return 1;
+    }
+
+    uint16_t *half = (uint16_t*)malloc(sizeof(uint16_t) * (cols > 0 ? cols : 1));
+    int ok = 1;
+    for (size_t i = 0; i < rows && ok; ++i) {
+        ok = pread_full(m->fd, half, sizeof(uint16_t) * cols,
+            h->offset + sizeof(uint16_t) * ((row + i) * h->ld + col));
+        for (size_t j = 0; j < cols && ok; ++j)
+            out[i * ld + j] = half_to_float(half[j]);
+    }
+    free(half);
+    return ok;
+}
+
+int matfile_write(struct matfile *m, size_t row, size_t col, size_t rows, size_t cols,
+    const float *in, size_t ld) {
+    const struct matfile_header *h = &m->header;
+    if (cols == h->ld && ld == cols)
+        return pwrite_full(m->fd, in, sizeof(float) * rows * cols,
+            h->offset + sizeof(float) * row * h->ld);
+    for (size_t i = 0; i < rows; ++i) {
+        if (!pwrite_full(m->fd, in + i * ld, sizeof(float) * cols,
+                h->offset + sizeof(float) * ((row + i) * h->ld + col)))
+            return 0;
+    }
+    return 1;
+}
+
+void matfile_close(struct matfile *m) {
+    if (m->fd >= 0) {
+        if (m->writable && fsync(m->fd) != 0)
+            perror("fsync");
+        close(m->fd);
+    } else if (m->map != NULL) {
+        if (m->writable && msync(m->map, m->map_len, MS_SYNC) != 0)
+            perror("msync");
+        munmap(m->map, m->map_len);
+    } else if (m->data_len > 0) {
+        huge_free(m->data, m->data_len);
+    }
+    memset(m, 0, sizeof(struct matfile));
+    m->fd = -1;
+}
@@ -0,0 +1,86 @@
+#ifndef __MATFILE_H__
+#define __MATFILE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  Binary matrix files
+
+  A file starts with a header and holds a row-major matrix of rows x cols
+  elements, ld apart from row to row, from byte offset on:
+
+    magic "MATF", version, dtype, rows, cols, ld, offset
+
+  The fields are little-endian, as on the machines this runs on; version
+  and dtype are 32-bit and the rest 64-bit. Elements are float (dtype 0) or
+  IEEE half (dtype 1), and offset is a multiple of the page size.
+
+  Files are mapped instead of read, so the pipeline copies blocks straight
+  out of the page cache and writes C in place. Mappings ask for transparent
+  huge pages; on hugetlbfs the file itself is backed by them, and sizes are
+  rounded up to its page size. Half files are widened to float in an
+  anonymous mapping on load.
+
+  Matrices larger than memory are opened as streams instead, and read and
+  written a block at a time.
+*/
+
+#define MATFILE_FLOAT 0
+#define MATFILE_HALF 1
+
+struct matfile_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t reserved;
+    uint64_t rows, cols, ld;
+    uint64_t offset;
+};
+
+struct matfile {
+    struct matfile_header header;
+    void *map;              // the whole file
+    size_t map_len;
+    float *data;            // first element, in the file or widened from half
+    size_t data_len;        // bytes of data when it does not live in the file
+    int writable;
+    int fd;                 // open as a stream, or -1
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Map the matrix in path read-only; returns its elements, or NULL on error
+float *matfile_open(struct matfile *m, const char *path);
+
+// Create path for a rows x cols float matrix and map it for writing;
+// returns its elements, or NULL on error
+float *matfile_create(struct matfile *m, const char *path, size_t rows, size_t cols);
+
+// Open the matrix in path, or create path for a rows x cols float matrix,
+// for block reads and writes; return 1 on success
+int matfile_open_stream(struct matfile *m, const char *path);
+int matfile_create_stream(struct matfile *m, const char *path, size_t rows, size_t cols);
+
+// Read the rows x cols block at (row, col) of a stream into out, or write
+// it from in, with rows ld elements apart in memory; return 1 on success
+int matfile_read(struct matfile *m, size_t row, size_t col, size_t rows, size_t cols,
+    float *out, size_t ld);
+int matfile_write(struct matfile *m, size_t row, size_t col, size_t rows, size_t cols,
+    const float *in, size_t ld);
+
+// Flush a created matrix to the file and unmap or close it
+void matfile_close(struct matfile *m);
+
+// Zeroed anonymous memory on huge pages where the system has them to spare,
+// and with transparent huge pages asked for otherwise
+void *huge_alloc(size_t bytes);
+void huge_free(void *p, size_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__MATFILE_H__
@@ -0,0 +1,224 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "ooc.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "prof.h"
+
+// Tile sides above this are rounded down to a multiple of it
+#define TILE_ROUND 256
+
+struct ooc {
+    gemm_fn gemm;
+    struct matfile *A, *B, *C;
+    size_t m, n, k;
+    size_t tm, tn, tk;          // C tile and K step
+    size_t tiles_m, tiles_n, steps_k;
+    float *a[2], *b[2], *c[2];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t loaded, consumed;    // steps whose blocks were read, and multiplied
+    size_t computed, written;   // tiles multiplied, and written back
+    int failed;
+    double stall;               // seconds the multiplies waited on the threads
+};
+
+// Tile of C and K block of step s
+static void step_range(const struct ooc *o, size_t s, size_t *i, size_t *j, size_t *l,
+    size_t *rows, size_t *cols, size_t *depth) {
+    size_t t = s / o->steps_k;
+    *i = t / o->tiles_n * o->tm;
+    *j = t % o->tiles_n * o->tn;
+    *l = s % o->steps_k * o->tk;
+    *rows = o->m - *i < o->tm ? o->m - *i : o->tm;
+    *cols = o->n - *j < o->tn ? o->n - *j : o->tn;
+    *depth = o->k - *l < o->tk ? o->k - *l : o->tk;
+}
+
+static void *run_loader(void *arg) {
+    struct ooc *o = (struct ooc*)arg;
+    size_t step_n = o->tiles_m * o->tiles_n * o->steps_k;
+
+    for (size_t s = 0; s < step_n; ++s) {
+        // Both buffers of a pair hold steps not yet multiplied
+        pthread_mutex_lock(&o->lock);
+        while (!o->failed && s >= o->consumed + 2)
+            pthread_cond_wait(&o->cond, &o->lock);
+        int failed = o->failed;
+        pthread_mutex_unlock(&o->lock);
+        if (failed)
+            break;
+
+        size_t i, j, l, rows, cols, depth;
+        step_range(o, s, &i, &j, &l, &rows, &cols, &depth);
+        prof_begin("read");
+        int ok = matfile_read(o->A, i, l, rows, depth, o->a[s & 1], depth)
+            && matfile_read(o->B, l, j, depth, cols, o->b[s & 1], cols);
+        prof_end();
+        if (!ok)
+            perror("Out-of-core read");
+
+        pthread_mutex_lock(&o->lock);
+        if (ok)
+            o->loaded = s + 1;
+        else
+            o->failed = 1;
+        pthread_cond_broadcast(&o->cond);
+        pthread_mutex_unlock(&o->lock);
+        if (!ok)
+            break;
+    }
+    return NULL;
+}
+
+static void *run_writer(void *arg) {
+    struct ooc *o = (struct ooc*)arg;
+    size_t tile_n = o->tiles_m * o->tiles_n;
+
+    for (size_t t = 0; t < tile_n; ++t) {
+        pthread_mutex_lock(&o->lock);
+        while (!o->failed && t >= o->computed)
+            pthread_cond_wait(&o->cond, &o->lock);
+        int ready = t < o->computed;
+        pthread_mutex_unlock(&o->lock);
+        if (!ready)
+            break;
+
+        size_t i, j, l, rows, cols, depth;
+        step_range(o, t * o->steps_k, &i, &j, &l, &rows, &cols, &depth);
+        prof_begin("write");
+        int ok = matfile_write(o->C, i, j, rows, cols, o->c[t & 1], cols);
+        prof_end();
+        if (!ok)
+            perror("Out-of-core write");
+
+        pthread_mutex_lock(&o->lock);
+        if (ok)
+            o->written = t + 1;
+        else
+            o->failed = 1;
+        pthread_cond_broadcast(&o->cond);
+        pthread_mutex_unlock(&o->lock);
+        if (!ok)
+            break;
+    }
+    return NULL;
+}
+
+size_t ooc_default_budget() {
+    return (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+}
+
+// Square tiles of side T with K steps of T take 24 T^2 bytes for two of each
+// buffer. Each step moves the tile in and out of a device, so a deep step
+// keeps that from outweighing A and B. A dimension smaller than T leaves
+// room to widen the other.
+static void pick_tiles(struct ooc *o, size_t budget) {
+    size_t t = (size_t)sqrt(budget / 24.0);
+    if (t > TILE_ROUND)
+        t -= t % TILE_ROUND;
+    o->tm = o->m < t ? o->m : t;
+    o->tn = o->n < t ? o->n : t;
+    o->tk = o->k < t ? o->k : t;
+
+    size_t room = budget / (2 * sizeof(float));
+    if (o->tm < t && room > o->tm * o->tk) {
+        size_t tn = (room - o->tm * o->tk) / (o->tm + o->tk);
+        o->tn = o->n < tn ? o->n : tn;
+    } else if (o->tn < t && room > o->tn * o->tk) {
+        size_t tm = (room - o->tn * o->tk) / (o->tn + o->tk);
+        o->tm = o->m < tm ? o->m : tm;
+    }
+}
+
+int gemm_out_of_core(gemm_fn gemm, struct matfile *A, struct matfile *B, struct matfile *C,
+    size_t budget) {
+    struct ooc o = { gemm, A, B, C, A->header.rows, B->header.cols, A->header.cols };
+
+    // A new C file is all zeros already
+    if (o.m == 0 || o.n == 0 || o.k == 0)
+        return 1;
+    pick_tiles(&o, budget);
+    if (o.tm == 0 || o.tn == 0 || o.tk == 0) {
+        fprintf(stderr, "Out-of-core : a budget of %zu bytes is too small\n", budget);
+        return 0;
+    }
+    o.tiles_m = (o.m + o.tm - 1) / o.tm;
+    o.tiles_n = (o.n + o.tn - 1) / o.tn;
+    o.steps_k = (o.k + o.tk - 1) / o.tk;
+
+    int ok = 1;
+    for (int s = 0; s < 2; ++s) {
+        o.a[s] = (float*)huge_alloc(sizeof(float) * o.tm * o.tk);
+        o.b[s] = (float*)huge_alloc(sizeof(float) * o.tk * o.tn);
+        o.c[s] = (float*)huge_alloc(sizeof(float) * o.tm * o.tn);
+        if (o.a[s] == NULL || o.b[s] == NULL || o.c[s] == NULL)
+            ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Out-of-core : out of memory for %zu x %zu tiles\n", o.tm, o.tn);
+    } else {
+        pthread_t loader, writer;
+        pthread_mutex_init(&o.lock, NULL);
+        pthread_cond_init(&o.cond, NULL);
+        pthread_create(&loader, NULL, run_loader, &o);
+        pthread_create(&writer, NULL, run_writer, &o);
+
+        uint64_t start = prof_now();
+        size_t step_n = o.tiles_m * o.tiles_n * o.steps_k;
+        for (size_t s = 0; s < step_n; ++s) {
+            size_t i, j, l, rows, cols, depth;
+            size_t t = s / o.steps_k;
+            step_range(&o, s, &i, &j, &l, &rows, &cols, &depth);
+
+            // A tile starts once the tile two back is written out
+            pthread_mutex_lock(&o.lock);
+            uint64_t wait_start = prof_now();
+            while (!o.failed && (s >= o.loaded || (l == 0 && t >= o.written + 2)))
+                pthread_cond_wait(&o.cond, &o.lock);
+            o.stall += (prof_now() - wait_start) * 1e-9;
+            int failed = o.failed;
+            pthread_mutex_unlock(&o.lock);
+            if (failed)
+                break;
+
+            prof_begin("gemm");
+            gemm(rows, cols, depth, o.a[s & 1], depth, o.b[s & 1], cols,
+                l == 0 ? 0.0f : 1.0f, o.c[t & 1], cols);
+            prof_end();
+
+            pthread_mutex_lock(&o.lock);
+            o.consumed = s + 1;
+            if (l + depth == o.k)
+                o.computed = t + 1;
+            pthread_cond_broadcast(&o.cond);
+            pthread_mutex_unlock(&o.lock);
+        }
+        pthread_join(loader, NULL);
+        pthread_join(writer, NULL);
+        double sec = (prof_now() - start) * 1e-9;
+        ok = !o.failed;
+
+        // A is read once per column of tiles and B once per row
+        size_t elem_a = A->header.dtype == MATFILE_HALF ? 2 : sizeof(float);
+        size_t elem_b = B->header.dtype == MATFILE_HALF ? 2 : sizeof(float);
+        double read = (double)elem_a * o.m * o.k * o.tiles_n + (double)elem_b * o.k * o.n * o.tiles_m;
+        printf("Out-of-core : %zu x %zu tiles of %zu x %zu, K in %zu steps of %zu\n",
+            o.tiles_m, o.tiles_n, o.tm, o.tn, o.steps_k, o.tk);
+        printf("Out-of-core : %lf sec, %.1lf GFLOPS, %.2lf GB read, %.2lf GB written, "
+            "multiplies waited %lf sec\n", sec, 2.0 * o.m * o.n * o.k / sec * 1e-9,
+            read * 1e-9, sizeof(float) * (double)o.m * o.n * 1e-9, o.stall);
+        pthread_mutex_destroy(&o.lock);
+        pthread_cond_destroy(&o.cond);
+    }
+
+    for (int s = 0; s < 2; ++s) {
+        huge_free(o.a[s], sizeof(float) * o.tm * o.tk);
+        huge_free(o.b[s], sizeof(float) * o.tk * o.tn);
+        huge_free(o.c[s], sizeof(float) * o.tm * o.tn);
+    }
+    return ok;
+}
@@ -0,0 +1,37 @@
+#ifndef __OOC_H__
+#define __OOC_H__
+
+#include <stddef.h>
+#include "matfile.h"
+#include "strassen.h"
+
+/*
+  Out-of-core GEMM
+
+  C = A * B for matrices in files, of any size, through a fixed amount of
+  host memory. C is computed in square tiles, each accumulated over blocks
+  of K: gemm multiplies a block of A and one of B into the tile with
+  beta = 1 after the first. A loader thread reads the blocks of the next
+  step while the current one is multiplied, and a writer thread writes
+  finished tiles back while the next ones are computed, so two of each
+  buffer are held. Tiles are made as large as the budget allows, since A
+  is read once per column of tiles and B once per row.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Multiply streams A and B into the stream C with gemm, holding at most
+// budget bytes of blocks. Returns 1 on success.
+int gemm_out_of_core(gemm_fn gemm, struct matfile *A, struct matfile *B, struct matfile *C,
+    size_t budget);
+
+// Half of the physical memory, the budget when none is given
+size_t ooc_default_budget();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__OOC_H__
@@ -0,0 +1,175 @@
+#include "pipeline.h"
+
+#include <stdlib.h>
+#include "prof.h"
+
+struct run {
+    struct pipeline *p;
+    size_t item_n;
+    int depth, group_depth;
+    size_t group_len;
+    int group_end;                  // stage with PIPE_GROUP_END, or -1
+    size_t next[PIPE_MAX_STAGES];   // next item of each stage
+    cl_event *events;               // of each stage, for the item of each slot
+    cl_event *group_done;           // group end of the group of each group slot
+};
+
+void pipeline_stage(struct pipeline *p, enum pipe_kind kind, int flags, pipe_fn run) {
+    struct pipe_stage *s = &p->stages[p->stage_n++];
+    s->kind = kind;
+    s->flags = flags;
+    s->run = run;
+}
+
+static cl_event *event_of(struct run *r, size_t item, int stage) {
+    return &r->events[(item % r->depth) * r->p->stage_n + stage];
+}
+
+// Whether every stage item waits for at stage k has been issued
+static int ready(const struct run *r, int k, size_t item) {
+    const struct pipe_stage *s = &r->p->stages[k];
+
+    if (item >= r->item_n)
+        return 0;
+    if (k > 0 && r->next[k - 1] <= item)
+        return 0;
+    if (k + 1 < r->p->stage_n && item >= (size_t)r->depth && r->next[k + 1] <= item - r->depth)
+        return 0;
+    size_t group = item / r->group_len;
+    if ((s->flags & PIPE_GROUP_USE) && r->group_end >= 0 && item % r->group_len == 0
+            && group >= (size_t)r->group_depth
+            && r->next[r->group_end] < (group - r->group_depth + 1) * r->group_len)
+        return 0;
+    return 1;
+}
+
+static cl_command_queue pick_queue(const struct pipeline *p, enum pipe_kind kind, size_t item) {
+    if (kind == PIPE_DOWNLOAD && p->download_n > 0)
+        return p->download[item % p->download_n];
+    if (kind == PIPE_UPLOAD ? p->upload_n > 0 : p->compute_n == 0)
+        return p->upload[item % p->upload_n];
+    return p->compute[item % p->compute_n];
+}
+
+// Run or enqueue the next item of stage k
+static cl_int issue(struct run *r, int k) {
+    const struct pipe_stage *s = &r->p->stages[k];
+    size_t item = r->next[k]++;
+    size_t group = item / r->group_len;
+    cl_event wait[4], event = NULL;
+    cl_uint wait_n = 0;
+    cl_int err = CL_SUCCESS;
+
+    // A group end stage has nothing to do before the last item of a group
+    int last = (item + 1) % r->group_len == 0 || item + 1 == r->item_n;
+    if (!(s->flags & PIPE_GROUP_END) || last) {
+        if (k > 0 && *event_of(r, item, k - 1) != NULL)
+            wait[wait_n++] = *event_of(r, item, k - 1);
+        // Still the item depth back, as this item has not reached k + 1
+        if (k + 1 < r->p->stage_n && item >= (size_t)r->depth && *event_of(r, item, k + 1) != NULL)
+            wait[wait_n++] = *event_of(r, item, k + 1);
+        if ((s->flags & PIPE_ORDERED) && item > 0 && *event_of(r, item - 1, k) != NULL)
+            wait[wait_n++] = *event_of(r, item - 1, k);
+        int group_slot = group % r->group_depth;
+        if ((s->flags & PIPE_GROUP_USE) && item % r->group_len == 0 && r->group_done[group_slot] != NULL)
+            wait[wait_n++] = r->group_done[group_slot];
+
+        struct pipe_call call = { item, group, (int)(item % r->depth), group_slot,
+            NULL, wait_n, wait };
+        uint64_t start = prof_now();
+        if (s->kind == PIPE_HOST) {
+            if (wait_n > 0)
+                err = clWaitForEvents(wait_n, wait);
+            uint64_t waited = prof_now();
+            r->p->wait_time += (waited - start) * 1e-9;
+            start = waited;
+            call.wait_n = 0;
+            if (err == CL_SUCCESS)
+                err = s->run(r->p->arg, &call, NULL);
+        } else {
+            call.queue = pick_queue(r->p, s->kind, item);
+            err = s->run(r->p->arg, &call, &event);
+            if (err == CL_SUCCESS)
+                err = clFlush(call.queue);
+        }
+        r->p->host_time += (prof_now() - start) * 1e-9;
+
+        if (err == CL_SUCCESS && (s->flags & PIPE_GROUP_END)) {
+            if (r->group_done[group_slot] != NULL)
+                clReleaseEvent(r->group_done[group_slot]);
+            if (event != NULL)
+                clRetainEvent(event);
+            r->group_done[group_slot] = event;
+        }
+    }
+
+    cl_event *slot = event_of(r, item, k);
+    if (*slot != NULL)
+        clReleaseEvent(*slot);
+    *slot = event;
+    return err;
+}
+
+static void finish(const struct pipeline *p) {
+    for (int q = 0; q < p->upload_n; ++q)
+        clFinish(p->upload[q]);
+    for (int q = 0; q < p->compute_n; ++q)
+        clFinish(p->compute[q]);
+    for (int q = 0; q < p->download_n; ++q)
+        clFinish(p->download[q]);
+}
+
+cl_int pipeline_run(struct pipeline *p, size_t item_n) {
+    struct run r;
+    cl_int err = CL_SUCCESS;
+
+    r.p = p;
+    r.item_n = item_n;
+    r.depth = p->depth > 0 ? p->depth : 1;
+    r.group_len = p->group_len > 0 ? p->group_len : 1;
+    r.group_depth = p->group_depth > 0 ? p->group_depth : 1;
+    r.group_end = -1;
+    for (int k = 0; k < p->stage_n; ++k) {
+        r.next[k] = 0;
+        if (p->stages[k].flags & PIPE_GROUP_END)
+            r.group_end = k;
+    }
+    r.events = (cl_event*)calloc(r.depth * p->stage_n, sizeof(cl_event));
+    r.group_done = (cl_event*)calloc(r.group_depth, sizeof(cl_event));
+
+    while (err == CL_SUCCESS) {
+        // Device stages first, as far ahead as they go
+        int issued = 0;
+        for (int k = 0; k < p->stage_n && err == CL_SUCCESS; ++k) {
+            while (err == CL_SUCCESS && p->stages[k].kind != PIPE_HOST && ready(&r, k, r.next[k])) {
+                err = issue(&r, k);
+                issued = 1;
+            }
+        }
+        if (issued)
+            continue;
+
+        int host = -1;
+        for (int k = 0; k < p->stage_n; ++k) {
+            if (p->stages[k].kind == PIPE_HOST && ready(&r, k, r.next[k])
+                    && (host < 0 || r.next[k] < r.next[host]))
+                host = k;
+        }
+        if (host < 0)
+            break;
+        err = issue(&r, host);
+    }
+
+    finish(p);
+    for (int e = 0; e < r.depth * p->stage_n; ++e) {
+        if (r.events[e] != NULL)
+            clReleaseEvent(r.events[e]);
+    }
+    for (int g = 0; g < r.group_depth; ++g) {
+        if (r.group_done[g] != NULL)
+            clReleaseEvent(r.group_done[g]);
+    }
+    free(r.events);
+    free(r.group_done);
+    return err;
+}
@@ -0,0 +1,99 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <stddef.h>
+#include <CL/cl.h>
+
+/*
+  Pipelined command graph
+
+  Items 0 .. n - 1 each go through the same stages in order: uploads,
+  kernels and downloads enqueued on OpenCL queues, and host stages run on
+  the calling thread. Item i uses the buffers of slot i % depth, so up to
+  depth items are in flight. Stage k of an item waits for stage k - 1 of
+  the same item, whose output it takes, and for stage k + 1 of the item
+  depth back, which was the last to read the slot it is about to overwrite.
+
+  Consecutive runs of group_len items may accumulate into the buffers of a
+  group slot, g % group_depth for group g. A PIPE_GROUP_END stage runs only
+  on the last item of a group and frees its group slot; a PIPE_GROUP_USE
+  stage waits for that on the first item of a group. A PIPE_ORDERED stage
+  runs in item order, after the same stage of the item before.
+
+  Every dependency is an event, so the queues may be in order or out of
+  order and any number of them: each kind of device stage goes to its own
+  queues, item i to queue i % n of them. Downloads without queues of their
+  own go behind the kernels they read from, on the compute queues, so that
+  on in-order queues they do not hold up the uploads of later items, and
+  the compute and upload queues stand in for each other. Device stages are
+  enqueued as far ahead as the slots allow, since they do not block; the
+  host then runs the oldest host stage whose item is ready, waiting for
+  its events. No device stage ever waits for a host stage that has not run.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PIPE_MAX_STAGES 8
+#define PIPE_MAX_QUEUES 8
+
+enum pipe_kind {
+    PIPE_UPLOAD,
+    PIPE_KERNEL,
+    PIPE_DOWNLOAD,
+    PIPE_HOST,
+};
+
+#define PIPE_ORDERED    1
+#define PIPE_GROUP_USE  2
+#define PIPE_GROUP_END  4
+
+// What a stage is run for. A host stage gets no queue and no events, as
+// those it depends on are done.
+struct pipe_call {
+    size_t item, group;
+    int slot, group_slot;
+    cl_command_queue queue;
+    cl_uint wait_n;
+    const cl_event *wait;
+};
+
+// Enqueue the stage of call->item after the events of call->wait and set
+// *event to its last command, or leave it NULL if it enqueued nothing. A
+// stage of several commands chains them through events, so that the last
+// one covers the rest on an out-of-order queue too. Returns CL_SUCCESS or
+// an error, which stops the pipeline.
+typedef cl_int (*pipe_fn)(void *arg, const struct pipe_call *call, cl_event *event);
+
+struct pipe_stage {
+    enum pipe_kind kind;
+    int flags;
+    pipe_fn run;
+};
+
+struct pipeline {
+    int stage_n;
+    struct pipe_stage stages[PIPE_MAX_STAGES];
+    int depth;                  // slots, and items in flight (default 1)
+    size_t group_len;           // items of a group (default 1)
+    int group_depth;            // group slots (default 1)
+    int upload_n, compute_n, download_n;
+    cl_command_queue upload[PIPE_MAX_QUEUES], compute[PIPE_MAX_QUEUES], download[PIPE_MAX_QUEUES];
+    void *arg;                  // passed to every stage
+    double host_time;           // seconds in stages, added up over runs
+    double wait_time;           // seconds host stages waited for events
+};
+
+// Add a stage after the last one
+void pipeline_stage(struct pipeline *p, enum pipe_kind kind, int flags, pipe_fn run);
+
+// Run item_n items through p and wait for all of them. Returns CL_SUCCESS
+// or the first error of a stage, after what was enqueued has finished.
+cl_int pipeline_run(struct pipeline *p, size_t item_n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__PIPELINE_H__
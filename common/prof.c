@@ -0,0 +1,332 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "prof.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define PROF_TSC
+#endif
+
+// Regions open at once in a thread, and distinct paths a thread can have
+#define MAX_DEPTH 64
+#define MAX_NODES 256
+// Durations are counted in a histogram with SUB_BUCKETS buckets to each
+// power of two of nanoseconds, so percentiles are within 1/SUB_BUCKETS
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+// How long the TSC is measured against CLOCK_MONOTONIC
+#define CALIBRATION_NS 10000000
+
+// Statistics of the finished regions of a path
+struct stats {
+    uint64_t count, total, min, max;
+    uint64_t buckets[BUCKETS];
+};
+
+// A path of a thread: name under the node parent, -1 at the top
+struct node {
+    const char *name;
+    int parent;
+    struct stats *stats;
+};
+
+// Only the owning thread writes its nodes and statistics. The node count
+// is published with a release store and the statistics with relaxed ones,
+// so the report can read them while the thread is still running; it may
+// then miss part of a region that finishes meanwhile.
+struct prof_thread {
+    struct prof_thread *next;
+    struct node nodes[MAX_NODES];
+    int node_n;
+    int depth;                      // may exceed MAX_DEPTH; those go unrecorded
+    int stack[MAX_DEPTH];
+    uint64_t start[MAX_DEPTH];
+};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static struct prof_thread *threads = NULL;
+static __thread struct prof_thread *self = NULL;
+static int use_tsc = 0;
+static uint64_t tsc0, mono0;
+static double ns_per_tick;
+
+static uint64_t mono_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void report_at_exit() {
+    const char *env = getenv("PROF");
+    if (env != NULL && strcmp(env, "off") == 0)
+        return;
+    prof_report(stderr, env != NULL && strcmp(env, "json") == 0);
+}
+
+static void init() {
+#ifdef PROF_TSC
+    unsigned a, b, c, d;
+    const char *env = getenv("PROF_CLOCK");
+    if ((env == NULL || strcmp(env, "monotonic") != 0)
+            && __get_cpuid(0x80000000, &a, &b, &c, &d) && a >= 0x80000007
+            && __get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1u << 8))) {
+        uint64_t m0 = mono_ns(), t0 = __rdtsc(), m1, t1;
+        do {
+            m1 = mono_ns();
+        } while (m1 - m0 < CALIBRATION_NS);
+        t1 = __rdtsc();
+        ns_per_tick = (double)(m1 - m0) / (t1 - t0);
+        tsc0 = t0;
+        mono0 = m0;
+        use_tsc = 1;
+    }
+#endif
+    atexit(report_at_exit);
+}
+
+uint64_t prof_now(void) {
+    pthread_once(&once, init);
+#ifdef PROF_TSC
+    if (use_tsc)
+        return mono0 + (uint64_t)((__rdtsc() - tsc0) * ns_per_tick);
+#endif
+    return mono_ns();
+}
+
+// The buffers of this thread, registered on first use
+static struct prof_thread *this_thread() {
+    if (self != NULL)
+        return self;
+    self = (struct prof_thread*)calloc(1, sizeof(struct prof_thread));
+    struct prof_thread *head = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+    do {
+        self->next = head;
+    } while (!__atomic_compare_exchange_n(&threads, &head, self, 0,
+        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    return self;
+}
+
+// Node of name under parent, added if new; -1 if there is no room
+static int find_node(struct prof_thread *t, int parent, const char *name) {
+    for (int i = 0; i < t->node_n; ++i) {
+        if (t->nodes[i].parent == parent
+                && (t->nodes[i].name == name || strcmp(t->nodes[i].name, name) == 0))
+            return i;
+    }
+    if (t->node_n == MAX_NODES)
+        return -1;
+    struct stats *st = (struct stats*)calloc(1, sizeof(struct stats));
+    if (st == NULL)
+        return -1;
+    st->min = UINT64_MAX;
+    t->nodes[t->node_n].name = name;
+    t->nodes[t->node_n].parent = parent;
+    t->nodes[t->node_n].stats = st;
+    __atomic_store_n(&t->node_n, t->node_n + 1, __ATOMIC_RELEASE);
+    return t->node_n - 1;
+}
+
+void prof_begin(const char *name) {
+    struct prof_thread *t = this_thread();
+    int depth = t->depth++;
+    if (depth >= MAX_DEPTH)
+        return;
+    int parent = depth > 0 ? t->stack[depth - 1] : -1;
+    // Below a region that got no node, nothing is recorded either
+    t->stack[depth] = depth > 0 && parent < 0 ? -1 : find_node(t, parent, name);
+    t->start[depth] = prof_now();
+}
+
+// Histogram bucket of ns: exact below SUB_BUCKETS, then SUB_BUCKETS to
+// each power of two
+static int bucket_of(uint64_t ns) {
+    if (ns < SUB_BUCKETS)
+        return (int)ns;
+    int shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int)(ns >> shift) - SUB_BUCKETS;
+}
+
+// Middle of bucket b
+static uint64_t bucket_value(int b) {
+    if (b < SUB_BUCKETS)
+        return (uint64_t)b;
+    int shift = b / SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(b % SUB_BUCKETS + SUB_BUCKETS) << shift;
+    return low + ((uint64_t)1 << shift) / 2;
+}
+
+// Add v to a value only this thread writes
+static void add(uint64_t *x, uint64_t v) {
+    __atomic_store_n(x, *x + v, __ATOMIC_RELAXED);
+}
+
+double prof_end(void) {
+    uint64_t end = prof_now();
+    struct prof_thread *t = this_thread();
+    if (t->depth == 0)
+        return 0.0;
+    int depth = --t->depth;
+    if (depth >= MAX_DEPTH)
+        return 0.0;
+    uint64_t ns = end - t->start[depth];
+    if (t->stack[depth] < 0)
+        return ns * 1e-9;
+
+    struct stats *st = t->nodes[t->stack[depth]].stats;
+    add(&st->buckets[bucket_of(ns)], 1);
+    add(&st->total, ns);
+    if (ns < st->min)
+        __atomic_store_n(&st->min, ns, __ATOMIC_RELAXED);
+    if (ns > st->max)
+        __atomic_store_n(&st->max, ns, __ATOMIC_RELAXED);
+    add(&st->count, 1);
+    return ns * 1e-9;
+}
+
+// Statistics of one path over all threads
+struct summary {
+    char *path;
+    int depth;
+    const char *name;
+    struct stats stats;
+};
+
+// Parents sort before their children, and children right after them
+static int path_cmp(const void *x, const void *y) {
+    const unsigned char *a = (const unsigned char*)((const struct summary*)x)->path;
+    const unsigned char *b = (const unsigned char*)((const struct summary*)y)->path;
+    for (; *a != '\0' && *a == *b; ++a, ++b);
+    if (*a == *b)
+        return 0;
+    if (*a == '\0' || *b == '\0')
+        return *a == '\0' ? -1 : 1;
+    if (*a == '/' || *b == '/')
+        return *a == '/' ? -1 : 1;
+    return *a < *b ? -1 : 1;
+}
+
+// Nearest-rank percentile of st, to the middle of its bucket and within
+// the range seen
+static uint64_t percentile(const struct stats *st, int p) {
+    uint64_t rank = (st->count * p + 99) / 100, seen = 0;
+    int b = 0;
+    if (st->count == 0)
+        return 0;
+    for (; b < BUCKETS - 1; ++b) {
+        seen += st->buckets[b];
+        if (seen >= rank)
+            break;
+    }
+    uint64_t v = bucket_value(b);
+    return v < st->min ? st->min : v > st->max ? st->max : v;
+}
+
+static void print_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s != '\0'; ++s) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', out);
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+void prof_report(FILE *out, int json) {
+    struct summary *stats = NULL;
+    size_t stat_n = 0, stat_cap = 0;
+
+    pthread_once(&once, init);
+    for (struct prof_thread *t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        int node_n = __atomic_load_n(&t->node_n, __ATOMIC_ACQUIRE);
+        int map[MAX_NODES];
+
+        // Nodes come after their parents, so paths are built front to back
+        char (*paths)[1024] = (char (*)[1024])malloc(sizeof(*paths) * (node_n > 0 ? node_n : 1));
+        for (int i = 0; i < node_n; ++i) {
+            int parent = t->nodes[i].parent, depth = 0;
+            if (parent >= 0)
+                snprintf(paths[i], sizeof(paths[i]), "%s/%s", paths[parent], t->nodes[i].name);
+            else
+                snprintf(paths[i], sizeof(paths[i]), "%s", t->nodes[i].name);
+            for (; parent >= 0; parent = t->nodes[parent].parent)
+                ++depth;
+
+            size_t s;
+            for (s = 0; s < stat_n && strcmp(stats[s].path, paths[i]) != 0; ++s);
+            if (s == stat_n) {
+                if (stat_n == stat_cap) {
+                    stat_cap = stat_cap > 0 ? stat_cap * 2 : 16;
+                    stats = (struct summary*)realloc(stats, sizeof(struct summary) * stat_cap);
+                }
+                memset(&stats[s], 0, sizeof(struct summary));
+                stats[s].stats.min = UINT64_MAX;
+                stats[s].path = strdup(paths[i]);
+                stats[s].depth = depth;
+                stats[s].name = t->nodes[i].name;
+                ++stat_n;
+            }
+            map[i] = (int)s;
+        }
+        free(paths);
+
+        for (int i = 0; i < node_n; ++i) {
+            const struct stats *from = t->nodes[i].stats;
+            struct stats *to = &stats[map[i]].stats;
+            uint64_t min = __atomic_load_n(&from->min, __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+            to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+            to->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+            to->min = min < to->min ? min : to->min;
+            to->max = max > to->max ? max : to->max;
+            for (int b = 0; b < BUCKETS; ++b)
+                to->buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+    if (stats != NULL)
+        qsort(stats, stat_n, sizeof(struct summary), path_cmp);
+
+    if (json) {
+        fprintf(out, "{\"clock\": \"%s\", \"regions\": [", use_tsc ? "tsc" : "monotonic");
+    } else {
+        if (use_tsc)
+            fprintf(out, "Profile (TSC at %.3lf GHz), times in ms\n", 1.0 / ns_per_tick);
+        else
+            fprintf(out, "Profile (CLOCK_MONOTONIC), times in ms\n");
+        fprintf(out, "%-32s %8s %12s %10s %10s %10s %10s %10s %10s\n", "region", "count",
+            "total", "mean", "min", "p50", "p90", "p99", "max");
+    }
+
+    for (size_t s = 0; s < stat_n; ++s) {
+        const struct stats *st = &stats[s].stats;
+        uint64_t total = st->total;
+        uint64_t min = st->count > 0 ? st->min : 0, max = st->max;
+        uint64_t p50 = percentile(st, 50), p90 = percentile(st, 90), p99 = percentile(st, 99);
+        double mean = st->count > 0 ? (double)total / st->count : 0.0;
+
+        if (json) {
+            fprintf(out, "%s\n  {\"path\": ", s > 0 ? "," : "");
+            print_json_string(out, stats[s].path);
+            fprintf(out, ", \"count\": %zu, \"total_ns\": %llu, \"mean_ns\": %.0lf, \"min_ns\": %llu, "
+                "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}",
+                (size_t)st->count, (unsigned long long)total, mean, (unsigned long long)min,
+                (unsigned long long)p50, (unsigned long long)p90, (unsigned long long)p99,
+                (unsigned long long)max);
+        } else {
+            fprintf(out, "%*s%-*s %8zu %12.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf\n",
+                2 * stats[s].depth, "", 32 - 2 * stats[s].depth > 0 ? 32 - 2 * stats[s].depth : 0,
+                stats[s].name, (size_t)st->count, total * 1e-6, mean * 1e-6, min * 1e-6,
+                p50 * 1e-6, p90 * 1e-6, p99 * 1e-6, max * 1e-6);
+        }
+        free(stats[s].path);
+    }
+    if (json)
+        fprintf(out, "\n]}\n");
+    free(stats);
+}
@@ -0,0 +1,50 @@
+#ifndef __PROF_H__
+#define __PROF_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+  Region profiler
+
+  prof_begin(name) and prof_end() bracket a region of the calling thread.
+  Regions nest, and a region is told apart by its path from the outermost
+  one, so the same name under two parents is counted twice. Every thread
+  keeps statistics of its own without taking a lock: count, total, min, max
+  and a histogram with 16 buckets to each power of two, so memory stays the
+  same however many regions run. Names are kept by pointer and must live
+  until exit, as string literals do.
+
+  Times are in nanoseconds from the TSC, calibrated against CLOCK_MONOTONIC,
+  on x86 processors where it is invariant, and from CLOCK_MONOTONIC
+  elsewhere or with PROF_CLOCK=monotonic.
+
+  At exit, count, total, mean, min, median, 90th and 99th percentile and max
+  of every region go to stderr, as text, or as JSON with PROF=json; PROF=off
+  leaves the report out. Percentiles are to the middle of their histogram
+  bucket, within 1/32 of the true value. prof_report() gives the same at any
+  time, for processes that do not exit.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Nanoseconds on a monotonic clock
+uint64_t prof_now(void);
+
+// Open region name inside the innermost open region of this thread
+void prof_begin(const char *name);
+
+// Close the innermost open region of this thread; returns its seconds
+double prof_end(void);
+
+// Statistics of every region of every thread so far, including those still
+// running in other threads up to what they have finished
+void prof_report(FILE *out, int json);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__PROF_H__
@@ -0,0 +1,362 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "sgemm.h"
+
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Cache blocking: a KC x NC panel of B is shared through L3, every thread
+// keeps an MC x KC block of A in L2, and the micro-kernel streams an
+// MR x KC sliver of A against a KC x NR sliver of B from L1. MC and NC are
+// multiples of every MR and NR below.
+#define KC 256
+#define MC 240
+#define NC 4096
+
+// Largest MR x NR of the micro-kernels
+#define MAX_TILE (12 * 32)
+
+typedef void (*micro_kernel_t)(size_t kc, const float *a, const float *b,
+    float *c, size_t ldc, float beta);
+
+struct isa {
+    const char *name;
+    int mr, nr;             // C tile of the micro-kernel
+    micro_kernel_t kernel;
+    int flops_per_cycle;    // per core, with two FMA units
+};
+
+
+// The micro-kernels compute the MR x NR tile c = a * b + beta * c, where a
+// is an MR x kc sliver stored column by column and b a kc x NR sliver
+// stored row by row
+
+#define AVX512_ROWS(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11)
+
+__attribute__((target("avx512f")))
+static void kernel_avx512(size_t kc, const float *a, const float *b, float *c, size_t ldc, float beta) {
+#define ZERO(r) __m512 c##r##0 = _mm512_setzero_ps(), c##r##1 = _mm512_setzero_ps();
+    AVX512_ROWS(ZERO)
+#undef ZERO
+    for (size_t p = 0; p < kc; ++p) {
+        __m512 b0 = _mm512_loadu_ps(b), b1 = _mm512_loadu_ps(b + 16);
+#define FMA(r) { \
+            __m512 a_ = _mm512_set1_ps(a[r]); \
+            c##r##0 = _mm512_fmadd_ps(a_, b0, c##r##0); \
+            c##r##1 = _mm512_fmadd_ps(a_, b1, c##r##1); \
+        }
+        AVX512_ROWS(FMA)
+#undef FMA
+        a += 12;
+        b += 32;
+    }
+    if (beta == 0.0f) {
+#define STORE(r) \
+        _mm512_storeu_ps(c + r * ldc, c##r##0); \
+        _mm512_storeu_ps(c + r * ldc + 16, c##r##1);
+        AVX512_ROWS(STORE)
+#undef STORE
+    } else {
+        __m512 beta_ = _mm512_set1_ps(beta);
+#define UPDATE(r) \
+        _mm512_storeu_ps(c + r * ldc, _mm512_fmadd_ps(beta_, _mm512_loadu_ps(c + r * ldc), c##r##0)); \
+        _mm512_storeu_ps(c + r * ldc + 16, _mm512_fmadd_ps(beta_, _mm512_loadu_ps(c + r * ldc + 16), c##r##1));
+        AVX512_ROWS(UPDATE)
+#undef UPDATE
+    }
+}
+
+#define AVX2_ROWS(X) X(0) X(1) X(2) X(3) X(4) X(5)
+
+__attribute__((target("avx2,fma")))
+static void kernel_avx2(size_t kc, const float *a, const float *b, float *c, size_t ldc, float beta) {
+#define ZERO(r) __m256 c##r##0 = _mm256_setzero_ps(), c##r##1 = _mm256_setzero_ps();
+    AVX2_ROWS(ZERO)
+#undef ZERO
+    for (size_t p = 0; p < kc; ++p) {
+        __m256 b0 = _mm256_loadu_ps(b), b1 = _mm256_loadu_ps(b + 8);
+#define FMA(r) { \
+            __m256 a_ = _mm256_broadcast_ss(&a[r]); \
+            c##r##0 = _mm256_fmadd_ps(a_, b0, c##r##0); \
+            c##r##1 = _mm256_fmadd_ps(a_, b1, c##r##1); \
+        }
+        AVX2_ROWS(FMA)
+#undef FMA
+        a += 6;
+        b += 16;
+    }
+    if (beta == 0.0f) {
+#define STORE(r) \
+        _mm256_storeu_ps(c + r * ldc, c##r##0); \
+        _mm256_storeu_ps(c + r * ldc + 8, c##r##1);
+        AVX2_ROWS(STORE)
+#undef STORE
+    } else {
+        __m256 beta_ = _mm256_set1_ps(beta);
+#define UPDATE(r) \
+        _mm256_storeu_ps(c + r * ldc, _mm256_fmadd_ps(beta_, _mm256_loadu_ps(c + r * ldc), c##r##0)); \
+        _mm256_storeu_ps(c + r * ldc + 8, _mm256_fmadd_ps(beta_, _mm256_loadu_ps(c + r * ldc + 8), c##r##1));
+        AVX2_ROWS(UPDATE)
+#undef UPDATE
+    }
+}
+
+static void kernel_generic(size_t kc, const float *a, const float *b, float *c, size_t ldc, float beta) {
+    float acc[4][16] = { { 0.0f } };
+    for (size_t p = 0; p < kc; ++p) {
+        for (int r = 0; r < 4; ++r)
+            for (int j = 0; j < 16; ++j)
+                acc[r][j] += a[r] * b[j];
+        a += 4;
+        b += 16;
+    }
+    for (int r = 0; r < 4; ++r)
+        for (int j = 0; j < 16; ++j)
+            c[r * ldc + j] = beta == 0.0f ? acc[r][j] : beta * c[r * ldc + j] + acc[r][j];
+}
+
+static const struct isa isas[] = {
+    { "avx512", 12, 32, kernel_avx512, 64 },
+    { "avx2", 6, 16, kernel_avx2, 32 },
+    { "generic", 4, 16, kernel_generic, 8 },
+};
+
+static const struct isa *pick_isa() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return &isas[0];
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return &isas[1];
+    return &isas[2];
+}
+
+
+// Pack the mc x kc block of A into slivers of mr rows, each stored column by
+// column; rows past mc are zero
+static void pack_a(size_t mc, size_t kc, const float *A, size_t lda, int mr, float *buf) {
+    for (size_t i = 0; i < mc; i += mr) {
+        size_t rows = mc - i < (size_t)mr ? mc - i : (size_t)mr;
+        for (size_t p = 0; p < kc; ++p) {
+            for (size_t r = 0; r < rows; ++r)
+                buf[r] = A[(i + r) * lda + p];
+            for (size_t r = rows; r < (size_t)mr; ++r)
+                buf[r] = 0.0f;
+            buf += mr;
+        }
+    }
+}
+
+// Pack slivers first..last of nr columns of the kc x nc panel of B, each
+// stored row by row; columns past nc are zero
+static void pack_b(size_t kc, size_t nc, const float *B, size_t ldb, int nr,
+    size_t first, size_t last, float *buf) {
+    for (size_t q = first; q < last; ++q) {
+        size_t j = q * nr;
+        size_t cols = nc - j < (size_t)nr ? nc - j : (size_t)nr;
+        float *out = buf + q * nr * kc;
+        for (size_t p = 0; p < kc; ++p) {
+            memcpy(out, &B[p * ldb + j], sizeof(float) * cols);
+            for (size_t c = cols; c < (size_t)nr; ++c)
+                out[c] = 0.0f;
+            out += nr;
+        }
+    }
+}
+
+// C (mc x nc) = packed A * packed B + beta * C, one micro-tile at a time.
+// Partial tiles at the edges go through a scratch tile.
+static void macro_kernel(const struct isa *isa, size_t mc, size_t nc, size_t kc,
+    const float *pa, const float *pb, float beta, float *C, size_t ldc) {
+    float tile[MAX_TILE];
+    int mr = isa->mr, nr = isa->nr;
+
+    for (size_t j = 0; j < nc; j += nr) {
+        size_t cols = nc - j < (size_t)nr ? nc - j : (size_t)nr;
+        for (size_t i = 0; i < mc; i += mr) {
+            size_t rows = mc - i < (size_t)mr ? mc - i : (size_t)mr;
+            const float *a = pa + i * kc, *b = pb + j * kc;
+            float *c = C + i * ldc + j;
+            if (rows == (size_t)mr && cols == (size_t)nr) {
+                isa->kernel(kc, a, b, c, ldc, beta);
+                continue;
+            }
+            isa->kernel(kc, a, b, tile, nr, 0.0f);
+            for (size_t r = 0; r < rows; ++r) {
+                for (size_t x = 0; x < cols; ++x) {
+                    float *y = &c[r * ldc + x];
+                    *y = beta == 0.0f ? tile[r * nr + x] : beta * *y + tile[r * nr + x];
+                }
+            }
+        }
+    }
+}
+
+
+// Arguments shared by the threads of one sgemm_cpu() call
+struct job {
+    const struct isa *isa;
+    size_t m, n, k, lda, ldb, ldc, mc;
+    const float *A, *B;
+    float *C;
+    float beta;
+    float *pb;              // packed panel of B, shared
+    int thread_n;
+    pthread_barrier_t barrier;
+    pthread_mutex_t start;  // held until thread_n is settled
+};
+
+struct worker {
+    struct job *job;
+    int id;
+    float *pa;              // packed block of A, its own
+};
+
+static void *run_worker(void *arg) {
+    struct worker *w = (struct worker*)arg;
+    struct job *job = w->job;
+    const struct isa *isa = job->isa;
+
+    pthread_mutex_lock(&job->start);
+    pthread_mutex_unlock(&job->start);
+    float *pa = w->pa;
+
+    for (size_t jc = 0; jc < job->n; jc += NC) {
+        size_t nc = job->n - jc < NC ? job->n - jc : NC;
+        size_t sliver_n = (nc + isa->nr - 1) / isa->nr;
+        for (size_t pc = 0; pc < job->k; pc += KC) {
+            size_t kc = job->k - pc < KC ? job->k - pc : KC;
+
+            // Every thread packs its share of the B panel
+            size_t first = sliver_n * w->id / job->thread_n;
+            size_t last = sliver_n * (w->id + 1) / job->thread_n;
+            pack_b(kc, nc, job->B + pc * job->ldb + jc, job->ldb, isa->nr, first, last, job->pb);
+            pthread_barrier_wait(&job->barrier);
+
+            // then multiplies its own blocks of rows against it
+            float beta = pc == 0 ? job->beta : 1.0f;
+            for (size_t ic = w->id * job->mc; ic < job->m; ic += job->thread_n * job->mc) {
+                size_t mc = job->m - ic < job->mc ? job->m - ic : job->mc;
+                pack_a(mc, kc, job->A + ic * job->lda + pc, job->lda, isa->mr, pa);
+                macro_kernel(isa, mc, nc, kc, pa, job->pb, beta, job->C + ic * job->ldc + jc, job->ldc);
+            }
+            pthread_barrier_wait(&job->barrier);
+        }
+    }
+    return NULL;
+}
+
+int sgemm_cpu_threads() {
+    const char *env = getenv("SGEMM_THREADS");
+    int n = env != NULL ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+const char *sgemm_cpu_isa() {
+    return pick_isa()->name;
+}
+
+double sgemm_cpu_peak() {
+    double ghz = 0.0;
+    long khz;
+    char line[256];
+
+    // Maximum clock if the kernel reports it, otherwise the current one
+    FILE *f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &khz) == 1)
+            ghz = khz * 1e-6;
+        fclose(f);
+    }
+    if (ghz == 0.0 && (f = fopen("/proc/cpuinfo", "r")) != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "cpu MHz : %lf", &ghz) == 1) {
+                ghz *= 1e-3;
+                break;
+            }
+        }
+        fclose(f);
+    }
+    return sgemm_cpu_threads() * ghz * pick_isa()->flops_per_cycle;
+}
+
+void sgemm_cpu(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, float beta, float *C, size_t ldc) {
+    struct job job;
+
+    if (m == 0 || n == 0)
+        return;
+    if (k == 0) {
+        for (size_t i = 0; i < m; ++i)
+            for (size_t j = 0; j < n; ++j)
+                C[i * ldc + j] = beta == 0.0f ? 0.0f : beta * C[i * ldc + j];
+        return;
+    }
+
+    job.isa = pick_isa();
+    job.m = m;
+    job.n = n;
+    job.k = k;
+    job.A = A;
+    job.lda = lda;
+    job.B = B;
+    job.ldb = ldb;
+    job.C = C;
+    job.ldc = ldc;
+    job.beta = beta;
+    job.thread_n = sgemm_cpu_threads();
+
+    struct worker *workers = (struct worker*)malloc(sizeof(struct worker) * job.thread_n);
+    pthread_t *threads = (pthread_t*)malloc(sizeof(pthread_t) * job.thread_n);
+    if (workers == NULL || threads == NULL) {
+        fprintf(stderr, "sgemm_cpu: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The threads wait for start until they are all created; if one cannot
+    // be, the product goes on with those that were
+    pthread_mutex_init(&job.start, NULL);
+    pthread_mutex_lock(&job.start);
+    for (int t = 0; t < job.thread_n; ++t) {
+        workers[t].job = &job;
+        workers[t].id = t;
+        if (t > 0 && pthread_create(&threads[t], NULL, run_worker, &workers[t]) != 0) {
+            fprintf(stderr, "sgemm_cpu: cannot create thread %d, using %d\n", t, t);
+            job.thread_n = t;
+        }
+    }
+
+    // Smaller row blocks when there are too few to keep every thread busy
+    size_t share = (m + job.thread_n - 1) / job.thread_n;
+    share = (share + job.isa->mr - 1) / job.isa->mr * job.isa->mr;
+    job.mc = share < MC ? share : MC;
+
+    size_t panel = (size_t)(NC + job.isa->nr) * KC;
+    if (posix_memalign((void**)&job.pb, 64, sizeof(float) * panel) != 0) {
+        fprintf(stderr, "sgemm_cpu: cannot allocate the B panel\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < job.thread_n; ++t) {
+        if (posix_memalign((void**)&workers[t].pa, 64, sizeof(float) * job.mc * KC) != 0) {
+            fprintf(stderr, "sgemm_cpu: cannot allocate the A block of thread %d\n", t);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_init(&job.barrier, NULL, job.thread_n);
+    pthread_mutex_unlock(&job.start);
+
+    run_worker(&workers[0]);
+    for (int t = 1; t < job.thread_n; ++t)
+        pthread_join(threads[t], NULL);
+
+    pthread_barrier_destroy(&job.barrier);
+    pthread_mutex_destroy(&job.start);
+    for (int t = 0; t < job.thread_n; ++t)
+        free(workers[t].pa);
+    free(workers);
+    free(threads);
+    free(job.pb);
+}
@@ -0,0 +1,36 @@
+#ifndef __SGEMM_H__
+#define __SGEMM_H__
+
+#include <stddef.h>
+
+/*
+  CPU SGEMM
+
+  Panels of B and blocks of A are packed into contiguous slivers and fed to
+  an FMA micro-kernel picked at run time (AVX-512, AVX2 or plain C). The
+  loops are blocked for L1, L2 and L3, and the rows of C are split across
+  threads: $SGEMM_THREADS, or one per online CPU.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// C = A * B + beta * C for row-major A (m x k), B (k x n) and C (m x n)
+// with leading dimensions lda, ldb and ldc. With beta = 0, C is not read.
+void sgemm_cpu(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, float beta, float *C, size_t ldc);
+
+// Instruction set of the micro-kernel and number of threads in use
+const char *sgemm_cpu_isa();
+int sgemm_cpu_threads();
+
+// Theoretical peak GFLOPS of those threads, assuming each has a core with
+// two FMA units to itself
+double sgemm_cpu_peak();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__SGEMM_H__
@@ -0,0 +1,170 @@
+#include "stage_pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prof.h"
+
+// Largest transfer timed by stage_pool_report
+#define PROBE_BYTES ((size_t)64 << 20)
+#define PROBE_REPS 3
+
+struct stage_buffer {
+    cl_mem mem;
+    void *host;
+    size_t size;
+    int taken;
+};
+
+struct stage_pool {
+    cl_context context;
+    cl_command_queue queue;
+    pthread_mutex_t lock;
+    struct stage_buffer *buffers;
+    int buffer_n, buffer_cap;
+    size_t get_n, reuse_n;
+};
+
+struct stage_pool *stage_pool_create(cl_context context, cl_command_queue queue) {
+    struct stage_pool *pool = (struct stage_pool*)calloc(1, sizeof(struct stage_pool));
+    pool->context = context;
+    pool->queue = queue;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void stage_pool_release(struct stage_pool *pool) {
+    if (pool == NULL)
+        return;
+    for (int b = 0; b < pool->buffer_n; ++b)
+        clEnqueueUnmapMemObject(pool->queue, pool->buffers[b].mem, pool->buffers[b].host, 0, NULL, NULL);
+    clFinish(pool->queue);
+    for (int b = 0; b < pool->buffer_n; ++b)
+        clReleaseMemObject(pool->buffers[b].mem);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->buffers);
+    free(pool);
+}
+
+void *stage_get(struct stage_pool *pool, size_t bytes) {
+    cl_int err;
+    void *host = NULL;
+
+    if (bytes == 0)
+        bytes = 1;
+    pthread_mutex_lock(&pool->lock);
+    ++pool->get_n;
+
+    // The smallest free buffer that is large enough
+    int best = -1;
+    for (int b = 0; b < pool->buffer_n; ++b) {
+        struct stage_buffer *s = &pool->buffers[b];
+        if (!s->taken && s->size >= bytes && (best < 0 || s->size < pool->buffers[best].size))
+            best = b;
+    }
+    if (best >= 0) {
+        pool->buffers[best].taken = 1;
+        ++pool->reuse_n;
+        host = pool->buffers[best].host;
+        pthread_mutex_unlock(&pool->lock);
+        return host;
+    }
+
+    if (pool->buffer_n == pool->buffer_cap) {
+        pool->buffer_cap = pool->buffer_cap > 0 ? 2 * pool->buffer_cap : 8;
+        pool->buffers = (struct stage_buffer*)realloc(pool->buffers,
+            sizeof(struct stage_buffer) * pool->buffer_cap);
+    }
+    struct stage_buffer *s = &pool->buffers[pool->buffer_n];
+    s->mem = clCreateBuffer(pool->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+        bytes, NULL, &err);
+    if (err == CL_SUCCESS) {
+        host = clEnqueueMapBuffer(pool->queue, s->mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+            0, bytes, 0, NULL, NULL, &err);
+        if (err != CL_SUCCESS)
+            clReleaseMemObject(s->mem);
+    }
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Staging : no pinned buffer of %zu bytes, OpenCL error %d\n", bytes, err);
+        host = NULL;
+    } else {
+        s->host = host;
+        s->size = bytes;
+        s->taken = 1;
+        ++pool->buffer_n;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return host;
+}
+
+void stage_put(struct stage_pool *pool, void *host) {
+    if (host == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    for (int b = 0; b < pool->buffer_n; ++b) {
+        if (pool->buffers[b].host == host)
+            pool->buffers[b].taken = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Best seconds of PROBE_REPS blocking transfers of bytes between host and
+// mem, after a warm-up
+static double time_transfer(struct stage_pool *pool, cl_mem mem, void *host, size_t bytes, int upload) {
+    double best = 0.0;
+
+    for (int r = 0; r <= PROBE_REPS; ++r) {
+        uint64_t start = prof_now();
+        cl_int err = upload
+            ? clEnqueueWriteBuffer(pool->queue, mem, CL_TRUE, 0, bytes, host, 0, NULL, NULL)
+            : clEnqueueReadBuffer(pool->queue, mem, CL_TRUE, 0, bytes, host, 0, NULL, NULL);
+        if (err != CL_SUCCESS)
+            return 0.0;
+        double sec = (prof_now() - start) * 1e-9;
+        if (r == 1 || (r > 1 && sec < best))
+            best = sec;
+    }
+    return best;
+}
+
+void stage_pool_report(struct stage_pool *pool, const char *name) {
+    cl_int err;
+    size_t total = 0, largest = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    int buffer_n = pool->buffer_n;
+    size_t get_n = pool->get_n, reuse_n = pool->reuse_n;
+    for (int b = 0; b < pool->buffer_n; ++b) {
+        total += pool->buffers[b].size;
+        if (pool->buffers[b].size > largest)
+            largest = pool->buffers[b].size;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    printf("Staging (%s) : %d pinned buffers, %.2lf MB, %zu of %zu requests reused\n",
+        name, buffer_n, total / 1048576.0, reuse_n, get_n);
+
+    // At the size of the transfers the pool serves, up to PROBE_BYTES
+    size_t bytes = largest > 0 && largest < PROBE_BYTES ? largest : PROBE_BYTES;
+    cl_mem mem = clCreateBuffer(pool->context, CL_MEM_READ_WRITE, bytes, NULL, &err);
+    if (err != CL_SUCCESS)
+        return;
+    void *pinned = stage_get(pool, bytes);
+    void *pageable = malloc(bytes);
+    if (pinned != NULL && pageable != NULL) {
+        memset(pinned, 0, bytes);
+        memset(pageable, 0, bytes);
+        double up_pinned = time_transfer(pool, mem, pinned, bytes, 1);
+        double up_pageable = time_transfer(pool, mem, pageable, bytes, 1);
+        double down_pinned = time_transfer(pool, mem, pinned, bytes, 0);
+        double down_pageable = time_transfer(pool, mem, pageable, bytes, 0);
+        if (up_pinned > 0 && up_pageable > 0 && down_pinned > 0 && down_pageable > 0)
+            printf("Staging (%s) : %.2lf MB upload %.2lf GB/s pinned vs %.2lf GB/s pageable, "
+                "download %.2lf vs %.2lf GB/s\n", name, bytes / 1048576.0,
+                bytes / up_pinned * 1e-9, bytes / up_pageable * 1e-9,
+                bytes / down_pinned * 1e-9, bytes / down_pageable * 1e-9);
+    }
+    free(pageable);
+    stage_put(pool, pinned);
+    clReleaseMemObject(mem);
+}
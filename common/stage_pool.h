@@ -0,0 +1,47 @@
+#ifndef __STAGE_POOL_H__
+#define __STAGE_POOL_H__
+
+#include <stddef.h>
+#include <CL/cl.h>
+
+/*
+  Pinned staging pool
+
+  Host buffers for transfers, allocated by the driver with
+  CL_MEM_ALLOC_HOST_PTR and mapped once for their whole life, so that they
+  are page-locked. Transfers from and to them go straight to DMA and run
+  asynchronously, where pageable memory is first copied through a bounce
+  buffer of the driver while the host thread waits. A buffer given back
+  with stage_put is handed out again to the next request it is large enough
+  for, so loops and repeated calls pin their memory once.
+
+  A pool belongs to one context and maps with its queue, which must outlive
+  it. Buffers may be taken and given back from any thread.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct stage_pool;
+
+struct stage_pool *stage_pool_create(cl_context context, cl_command_queue queue);
+
+// Unmap and free every buffer, given back or not
+void stage_pool_release(struct stage_pool *pool);
+
+// Host pointer to a pinned buffer of at least bytes, or NULL on failure
+void *stage_get(struct stage_pool *pool, size_t bytes);
+
+// Give back a buffer of stage_get; NULL is ignored
+void stage_put(struct stage_pool *pool, void *host);
+
+// Print the buffers and reuse of the pool, and the upload and download
+// rates measured from one of its buffers against malloc'd memory
+void stage_pool_report(struct stage_pool *pool, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__STAGE_POOL_H__
@@ -0,0 +1,186 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "strassen.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Rows compared by gemm_sample_error()
+#define SAMPLE_ROWS 8
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int splits(size_t m, size_t n, size_t k, size_t crossover) {
+    return crossover > 0 && m % 2 == 0 && n % 2 == 0 && k % 2 == 0
+        && m >= crossover && n >= crossover && k >= crossover;
+}
+
+int strassen_levels(size_t m, size_t n, size_t k, size_t crossover) {
+    int levels = 0;
+    for (; splits(m, n, k, crossover); m /= 2, n /= 2, k /= 2)
+        ++levels;
+    return levels;
+}
+
+// X is m/2 x max(k/2, n/2), Y is k/2 x n/2, and the next level reuses
+// what follows them
+size_t strassen_workspace(size_t m, size_t n, size_t k, size_t crossover) {
+    size_t floats = 0;
+    for (; splits(m, n, k, crossover); m /= 2, n /= 2, k /= 2)
+        floats += m / 2 * (k > n ? k / 2 : n / 2) + k / 2 * (n / 2);
+    return floats;
+}
+
+// Z = X + sign * Y; Z may be X or Y
+static void add(size_t rows, size_t cols, const float *X, size_t ldx,
+    const float *Y, size_t ldy, float sign, float *Z, size_t ldz) {
+    for (size_t i = 0; i < rows; ++i)
+        for (size_t j = 0; j < cols; ++j)
+            Z[i * ldz + j] = X[i * ldx + j] + sign * Y[i * ldy + j];
+}
+
+// The schedule of Boyer, Dumas, Pernet and Zhou, "Memory efficient
+// scheduling of Strassen-Winograd's matrix multiplication algorithm"
+// (ISSAC 2009), with S, T, P and U as in that paper
+void strassen(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, float *C, size_t ldc,
+    size_t crossover, gemm_fn gemm, float *work) {
+    if (!splits(m, n, k, crossover)) {
+        gemm(m, n, k, A, lda, B, ldb, 0.0f, C, ldc);
+        return;
+    }
+
+    size_t m2 = m / 2, n2 = n / 2, k2 = k / 2;
+    const float *A11 = A, *A12 = A + k2, *A21 = A + m2 * lda, *A22 = A21 + k2;
+    const float *B11 = B, *B12 = B + n2, *B21 = B + k2 * ldb, *B22 = B21 + n2;
+    float *C11 = C, *C12 = C + n2, *C21 = C + m2 * ldc, *C22 = C21 + n2;
+    size_t ldx = k2 > n2 ? k2 : n2, ldy = n2;
+    float *X = work, *Y = X + m2 * ldx, *next = Y + k2 * ldy;
+
+    add(m2, k2, A11, lda, A21, lda, -1.0f, X, ldx);                 // S3
+    add(k2, n2, B22, ldb, B12, ldb, -1.0f, Y, ldy);                 // T3
+    strassen(m2, n2, k2, X, ldx, Y, ldy, C21, ldc, crossover, gemm, next);   // P7
+    add(m2, k2, A21, lda, A22, lda, 1.0f, X, ldx);                  // S1
+    add(k2, n2, B12, ldb, B11, ldb, -1.0f, Y, ldy);                 // T1
+    strassen(m2, n2, k2, X, ldx, Y, ldy, C22, ldc, crossover, gemm, next);   // P5
+    add(m2, k2, X, ldx, A11, lda, -1.0f, X, ldx);                   // S2
+    add(k2, n2, B22, ldb, Y, ldy, -1.0f, Y, ldy);                   // T2
+    strassen(m2, n2, k2, X, ldx, Y, ldy, C12, ldc, crossover, gemm, next);   // P6
+    add(m2, k2, A12, lda, X, ldx, -1.0f, X, ldx);                   // S4
+    strassen(m2, n2, k2, X, ldx, B22, ldb, C11, ldc, crossover, gemm, next); // P3
+    strassen(m2, n2, k2, A11, lda, B11, ldb, X, ldx, crossover, gemm, next); // P1
+    add(m2, n2, X, ldx, C12, ldc, 1.0f, C12, ldc);                  // U2
+    add(m2, n2, C12, ldc, C21, ldc, 1.0f, C21, ldc);                // U3
+    add(m2, n2, C12, ldc, C22, ldc, 1.0f, C12, ldc);                // U4
+    add(m2, n2, C21, ldc, C22, ldc, 1.0f, C22, ldc);                // U7
+    add(m2, n2, C12, ldc, C11, ldc, 1.0f, C12, ldc);                // U5
+    add(k2, n2, Y, ldy, B21, ldb, -1.0f, Y, ldy);                   // T4
+    strassen(m2, n2, k2, A22, lda, Y, ldy, C11, ldc, crossover, gemm, next); // P4
+    add(m2, n2, C21, ldc, C11, ldc, -1.0f, C21, ldc);               // U6
+    strassen(m2, n2, k2, A12, lda, B21, ldb, C11, ldc, crossover, gemm, next); // P2
+    add(m2, n2, X, ldx, C11, ldc, 1.0f, C11, ldc);                  // U1
+}
+
+double gemm_sample_error(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, const float *C, size_t ldc, double *normwise) {
+    double *ref = (double*)malloc(sizeof(double) * n);
+    double *mag = (double*)malloc(sizeof(double) * n);
+    size_t rows = m < SAMPLE_ROWS ? m : SAMPLE_ROWS;
+    double worst = 0.0, largest = 0.0, largest_error = 0.0;
+
+    for (size_t r = 0; r < rows; ++r) {
+        size_t i = rows > 1 ? r * (m - 1) / (rows - 1) : 0;
+        for (size_t j = 0; j < n; ++j)
+            ref[j] = mag[j] = 0.0;
+        for (size_t p = 0; p < k; ++p) {
+            double a = A[i * lda + p];
+            for (size_t j = 0; j < n; ++j) {
+                ref[j] += a * B[p * ldb + j];
+                mag[j] += fabs(a * B[p * ldb + j]);
+            }
+        }
+        for (size_t j = 0; j < n; ++j) {
+            double error = fabs(C[i * ldc + j] - ref[j]);
+            if (mag[j] > 0.0 && error / mag[j] > worst)
+                worst = error / mag[j];
+            if (error > largest_error)
+                largest_error = error;
+            if (fabs(ref[j]) > largest)
+                largest = fabs(ref[j]);
+        }
+    }
+
+    free(ref);
+    free(mag);
+    *normwise = largest > 0.0 ? largest_error / largest : 0.0;
+    return worst;
+}
+
+void strassen_mul(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, float *C, size_t ldc,
+    size_t crossover, gemm_fn gemm, int compare) {
+    float *work = (float*)malloc(sizeof(float) * (strassen_workspace(m, n, k, crossover) + 1));
+
+    double t = now();
+    strassen(m, n, k, A, lda, B, ldb, C, ldc, crossover, gemm, work);
+    t = now() - t;
+    free(work);
+
+    double norm;
+    double err = gemm_sample_error(m, n, k, A, lda, B, ldb, C, ldc, &norm);
+    printf("Strassen-Winograd : %d levels, crossover %zu, %lf sec, max relative error %.3e (normwise %.3e)\n",
+        strassen_levels(m, n, k, crossover), crossover, t, err, norm);
+    if (!compare)
+        return;
+
+    float *D = (float*)malloc(sizeof(float) * m * n);
+    double t_gemm = now();
+    gemm(m, n, k, A, lda, B, ldb, 0.0f, D, n);
+    t_gemm = now() - t_gemm;
+    double norm_gemm;
+    double err_gemm = gemm_sample_error(m, n, k, A, lda, B, ldb, D, n, &norm_gemm);
+    free(D);
+
+    printf("Conventional : %lf sec, max relative error %.3e (normwise %.3e)\n",
+        t_gemm, err_gemm, norm_gemm);
+    printf("Strassen-Winograd is %.2lfx faster", t_gemm / t);
+    if (err_gemm > 0.0 && norm_gemm > 0.0)
+        printf(" with %.1lfx the error (%.1lfx normwise)", err / err_gemm, norm / norm_gemm);
+    printf("\n");
+}
+
+size_t strassen_tune(gemm_fn gemm, size_t max_n) {
+    for (size_t n = 256; n <= max_n; n *= 2) {
+        float *A = (float*)malloc(sizeof(float) * n * n);
+        float *B = (float*)malloc(sizeof(float) * n * n);
+        float *C = (float*)malloc(sizeof(float) * n * n);
+        float *work = (float*)malloc(sizeof(float) * strassen_workspace(n, n, n, n));
+        for (size_t i = 0; i < n * n; ++i) {
+            A[i] = (float)rand() / RAND_MAX - 0.5f;
+            B[i] = (float)rand() / RAND_MAX - 0.5f;
+        }
+
+        gemm(n, n, n, A, n, B, n, 0.0f, C, n);
+        double t_gemm = now();
+        gemm(n, n, n, A, n, B, n, 0.0f, C, n);
+        t_gemm = now() - t_gemm;
+        double t = now();
+        strassen(n, n, n, A, n, B, n, C, n, n, gemm, work);
+        t = now() - t;
+        printf("Strassen-Winograd %zu : %lf sec, conventional %lf sec\n", n, t, t_gemm);
+
+        free(A);
+        free(B);
+        free(C);
+        free(work);
+        if (t < t_gemm)
+            return n;
+    }
+    return 0;
+}
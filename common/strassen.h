@@ -0,0 +1,57 @@
+#ifndef __STRASSEN_H__
+#define __STRASSEN_H__
+
+#include <stddef.h>
+
+/*
+  Strassen-Winograd
+
+  A product is split in 2 x 2 quadrants, multiplied with 7 half-size
+  products and 15 additions, while m, n and k are all even and at least the
+  crossover. Smaller products are leaves, multiplied by a conventional gemm:
+  sgemm_cpu() or the OpenCL kernel. The quadrants of C double as temporaries,
+  so one level needs two more quadrant-size buffers, all taken from a
+  workspace allocated up front.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// C = A * B + beta * C for row-major matrices, like sgemm_cpu()
+typedef void (*gemm_fn)(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, float beta, float *C, size_t ldc);
+
+// Levels of recursion and floats of workspace strassen() needs
+int strassen_levels(size_t m, size_t n, size_t k, size_t crossover);
+size_t strassen_workspace(size_t m, size_t n, size_t k, size_t crossover);
+
+// C = A * B, with leaves multiplied by gemm. A crossover of 0 never splits.
+void strassen(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, float *C, size_t ldc,
+    size_t crossover, gemm_fn gemm, float *work);
+
+// Largest error of C over a few rows against a double precision product,
+// relative to sum |a||b| of each entry. *normwise gets the largest error
+// relative to the largest entry instead, the measure Strassen-Winograd
+// keeps close to the conventional product; entries much smaller than their
+// neighbours lose more.
+double gemm_sample_error(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, const float *C, size_t ldc, double *normwise);
+
+// C = A * B with strassen() and a workspace of its own, reporting the time
+// and error. With compare set, the product is also timed with gemm alone
+// for the speedup and error growth.
+void strassen_mul(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, float *C, size_t ldc,
+    size_t crossover, gemm_fn gemm, int compare);
+
+// Smallest power of two, up to max_n, at which one level beats gemm on a
+// square product; 0 if none does
+size_t strassen_tune(gemm_fn gemm, size_t max_n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__STRASSEN_H__
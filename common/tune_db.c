@@ -0,0 +1,74 @@
+#include "tune_db.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TUNE_LINE 1024
+
+static const char *db_path() {
+    const char *path = getenv("TUNE_DB");
+    return path != NULL && path[0] != '\0' ? path : "tune.db";
+}
+
+// Key of an entry: everything up to the parameters, tab included
+static void entry_key(cl_device_id device, const char *program, char *key, size_t len) {
+    char name[256], driver[256];
+
+    if (clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL) != CL_SUCCESS)
+        name[0] = '\0';
+    if (clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL) != CL_SUCCESS)
+        driver[0] = '\0';
+    snprintf(key, len, "%s\t%s\t%s\t", name, driver, program);
+}
+
+int tune_lookup(cl_device_id device, const char *program, char *params, size_t len) {
+    char key[TUNE_LINE], line[TUNE_LINE];
+    int found = 0;
+
+    FILE *file = fopen(db_path(), "r");
+    if (file == NULL)
+        return 0;
+
+    entry_key(device, program, key, sizeof(key));
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, key, strlen(key)) != 0)
+            continue;
+        snprintf(params, len, "%s", line + strlen(key));
+        params[strcspn(params, "\n")] = '\0';
+        found = 1;
+    }
+
+    fclose(file);
+    return found;
+}
+
+int tune_store(cl_device_id device, const char *program, const char *params) {
+    char key[TUNE_LINE], line[TUNE_LINE], tmp_path[TUNE_LINE];
+    const char *path = db_path();
+
+    // Copy the other entries to a new file and swap it in
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        perror(tmp_path);
+        return 0;
+    }
+
+    entry_key(device, program, key, sizeof(key));
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (strncmp(line, key, strlen(key)) != 0)
+                fputs(line, out);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s%s\n", key, params);
+
+    if (fclose(out) != 0 || rename(tmp_path, path) != 0) {
+        perror(path);
+        return 0;
+    }
+    return 1;
+}
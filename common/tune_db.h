@@ -0,0 +1,34 @@
+#ifndef __TUNE_DB_H__
+#define __TUNE_DB_H__
+
+#include <stddef.h>
+#include <CL/cl.h>
+
+/*
+  Tuning database
+
+  Launch parameters found by the tuners are kept in a text file, $TUNE_DB or
+  tune.db in the working directory, with one line per device, driver version
+  and program:
+
+    <device name>\t<driver version>\t<program>\t<parameters>\n
+
+  The parameter string belongs to the program that wrote it. A driver update
+  invalidates the entries of the old version.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Copy the parameters of program on device into params; returns 1 if found
+int tune_lookup(cl_device_id device, const char *program, char *params, size_t len);
+
+// Add or replace the parameters of program on device; returns 1 on success
+int tune_store(cl_device_id device, const char *program, const char *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__TUNE_DB_H__
@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "verify.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Failing rows or entries printed before the rest are only counted
+#define MAX_REPORTED 10
+
+// y = M x and, if ya is not NULL, ya = |M| xa for rows [first, last) of M
+struct matvec {
+    size_t first, last, cols, ld;
+    const float *M;
+    const double *x, *xa;
+    double *y, *ya;
+};
+
+static void *run_matvec(void *arg) {
+    struct matvec *job = (struct matvec*)arg;
+    for (size_t i = job->first; i < job->last; ++i) {
+        const float *row = job->M + i * job->ld;
+        double s = 0.0, sa = 0.0;
+        for (size_t j = 0; j < job->cols; ++j)
+            s += row[j] * job->x[j];
+        if (job->ya != NULL) {
+            for (size_t j = 0; j < job->cols; ++j)
+                sa += fabs(row[j]) * job->xa[j];
+            job->ya[i] = sa;
+        }
+        job->y[i] = s;
+    }
+    return NULL;
+}
+
+static int verify_threads() {
+    const char *env = getenv("VERIFY_THREADS");
+    int n = env != NULL ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+static void matvec(size_t rows, size_t cols, const float *M, size_t ld,
+    const double *x, const double *xa, double *y, double *ya) {
+    int thread_n = verify_threads();
+    struct matvec *jobs = (struct matvec*)malloc(sizeof(struct matvec) * thread_n);
+    pthread_t *threads = (pthread_t*)malloc(sizeof(pthread_t) * thread_n);
+
+    for (int t = 0; t < thread_n; ++t) {
+        jobs[t].first = rows * t / thread_n;
+        jobs[t].last = rows * (t + 1) / thread_n;
+        jobs[t].cols = cols;
+        jobs[t].ld = ld;
+        jobs[t].M = M;
+        jobs[t].x = x;
+        jobs[t].xa = xa;
+        jobs[t].y = y;
+        jobs[t].ya = ya;
+        if (t > 0)
+            pthread_create(&threads[t], NULL, run_matvec, &jobs[t]);
+    }
+    run_matvec(&jobs[0]);
+    for (int t = 1; t < thread_n; ++t)
+        pthread_join(threads[t], NULL);
+
+    free(jobs);
+    free(threads);
+}
+
+int verify_freivalds(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, const float *C, size_t ldc, int rounds, double tol) {
+    if (rounds < 1) {
+        fprintf(stderr, "Freivalds : %d rounds check nothing\n", rounds);
+        return 0;
+    }
+
+    double *x = (double*)malloc(sizeof(double) * n);
+    double *xa = (double*)malloc(sizeof(double) * n);
+    double *y = (double*)malloc(sizeof(double) * k);
+    double *ya = (double*)malloc(sizeof(double) * k);
+    double *z = (double*)malloc(sizeof(double) * m);
+    double *za = (double*)malloc(sizeof(double) * m);
+    double *w = (double*)malloc(sizeof(double) * m);
+    unsigned seed = (unsigned)time(NULL);
+    double worst = 0.0;
+    size_t failed = 0;
+
+    for (int r = 0; r < rounds; ++r) {
+        // Entries of x are at least 1/2 in magnitude, so no column of C
+        // is left out of a round
+        for (size_t j = 0; j < n; ++j) {
+            x[j] = (0.5 + 0.5 * rand_r(&seed) / RAND_MAX) * (rand_r(&seed) & 1 ? 1 : -1);
+            xa[j] = fabs(x[j]);
+        }
+
+        matvec(k, n, B, ldb, x, xa, y, ya);
+        matvec(m, k, A, lda, y, ya, z, za);
+        matvec(m, n, C, ldc, x, NULL, w, NULL);
+
+        for (size_t i = 0; i < m; ++i) {
+            // Relative to the average entry of the row, not its sum
+            double diff = fabs(w[i] - z[i]);
+            double rel = za[i] > 0.0 ? diff * n / za[i] : diff;
+            if (rel > worst)
+                worst = rel;
+            if (!(rel <= tol)) {
+                if (failed < MAX_REPORTED)
+                    printf("Row %zu differs by %.3e of its magnitude in round %d\n", i, rel, r);
+                ++failed;
+            }
+        }
+    }
+
+    printf("Freivalds : %d rounds, worst relative difference %.3e, tolerance %.3e, %zu failures\n",
+        rounds, worst, tol, failed);
+
+    free(x);
+    free(xa);
+    free(y);
+    free(ya);
+    free(z);
+    free(za);
+    free(w);
+    return failed == 0;
+}
+
+int verify_sampled(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, const float *C, size_t ldc, size_t samples, double tol) {
+    unsigned seed = (unsigned)time(NULL);
+    double worst = 0.0;
+    size_t failed = 0;
+
+    for (size_t s = 0; s < samples; ++s) {
+        size_t i = (size_t)rand_r(&seed) % m, j = (size_t)rand_r(&seed) % n;
+        double ref = 0.0, mag = 0.0;
+        for (size_t p = 0; p < k; ++p) {
+            double ab = (double)A[i * lda + p] * B[p * ldb + j];
+            ref += ab;
+            mag += fabs(ab);
+        }
+        double diff = fabs(C[i * ldc + j] - ref);
+        double rel = mag > 0.0 ? diff / mag : diff;
+        if (rel > worst)
+            worst = rel;
+        if (!(rel <= tol)) {
+            if (failed < MAX_REPORTED)
+                printf("c[%zu][%zu] is %f, expected %f\n", i, j, C[i * ldc + j], ref);
+            ++failed;
+        }
+    }
+
+    printf("Spot-check : %zu entries, worst relative difference %.3e, tolerance %.3e, %zu failures\n",
+        samples, worst, tol, failed);
+    return failed == 0;
+}
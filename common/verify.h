@@ -0,0 +1,40 @@
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+#include <stddef.h>
+
+/*
+  Checks of C = A * B that do not recompute the product
+
+  Freivalds' check compares C x with A (B x) for random vectors x, which is
+  O(N^2) per round; the three matrix-vector products are split by rows
+  across threads ($VERIFY_THREADS, or one per online CPU). The spot-check
+  recomputes a sample of entries instead.
+
+  An entry is accepted within tol times the magnitude |A| |B| it came from,
+  since that is what float rounding scales with. Freivalds' check sums a
+  row of C with random signs, so it cannot tell one entry off by tol from
+  n entries off by tol / n. A row of C x is accepted within tol times the
+  average magnitude |A| |B| |x| of its entries: a single entry a few times
+  tol off fails, and so does a row whose rounding adds up beyond one
+  entry's tolerance. Float products stay far below that; results from
+  rounded inputs (such as half) need a tol of about their input rounding.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Freivalds' check over rounds (at least 1) random vectors. Returns 1 if C passes.
+int verify_freivalds(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, const float *C, size_t ldc, int rounds, double tol);
+
+// Recompute samples random entries of C in double. Returns 1 if C passes.
+int verify_sampled(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, const float *C, size_t ldc, size_t samples, double tol);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__VERIFY_H__
@@ -10,6 +10,16 @@ import sys
 DIM = 2
 DATA_MIN = 0
 DATA_MAX = 100
+# Counts that do not fit in 32 bits are written as this mark and a 64-bit count
+LARGE_SIZE_MARK = 0xffffffff
+
+
+def write_size(n_data, output_f):
+    if n_data < LARGE_SIZE_MARK:
+        output_f.write(struct.pack('I', n_data))
+    else:
+        output_f.write(struct.pack('=IQ', LARGE_SIZE_MARK, n_data))
+
 
 
 def gen_data_uniform(n_data, output_f):
@@ -70,7 +80,7 @@ if __name__ == '__main__':
 
     n_data = int(sys.argv[2])
     output_f = open(sys.argv[3], 'wb')
-    output_f.write(struct.pack('I', n_data))
+    write_size(n_data, output_f)
 
     mode = sys.argv[1]
     if mode == 'centroid':
@@ -1,14 +1,196 @@
-__kernel void classify(__global float2 *D, __global float2 *C, __global uchar *E,
-    uchar cn) {
-    int i = get_global_id(0);
+// Data points are stored as float2 by default. With -DPOINT_HALF they are
+// stored as half2, and with -DPOINT_FIXED as 16-bit fixed point relative to
+// the bounding box (origin + q * scale). Distances are always computed in fp32.
+#if defined(POINT_HALF)
+typedef half point_t;
+#define LOAD_POINT(D, i) vload_half2(i, D)
+#elif defined(POINT_FIXED)
+typedef ushort2 point_t;
+#define LOAD_POINT(D, i) (origin + convert_float2(D[i]) * scale)
+#else
+typedef float2 point_t;
+#define LOAD_POINT(D, i) D[i]
+#endif
+
+// Reserve room in M for the points of this work-group that moved, and append
+// (index in chunk, new label) for each of them
+#define APPEND_MOVED(moved, slot, label) \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    if (get_local_id(0) == 0 && l_n > 0) l_base = atomic_add(M_n, l_n); \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    if (moved) M[l_base + slot] = (uint2)((uint)i, (uint)(label))
+
+// Classify the count points starting at D[base]. L holds the labels of this
+// chunk from the previous launch (-1 before the first one); every point whose
+// label changes is appended to M as (index in chunk, new label), and M_n counts
+// the entries so the host only touches the points that moved.
+__kernel void classify(__global point_t *D, __global float2 *C, __global int *L,
+    __global uint2 *M, __global uint *M_n, int cn, float2 origin, float2 scale,
+    ulong base, uint count) {
+    __local uint l_n, l_base;
+    size_t i = get_global_id(0);
+    uint slot = 0;
+    int mj = 0;
+    int moved = 0;
+
+    if (get_local_id(0) == 0) l_n = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (i < count) {
+        float2 d = LOAD_POINT(D, base + i);
+        float m = INFINITY;
+        for (int j = 0; j < cn; ++j) {
+            float2 t = d - C[j];
+            float s = dot(t, t);
+            if (m > s) {
+                m = s;
+                mj = j;
+            }
+        }
+        if (L[i] != mj) {
+            L[i] = mj;
+            slot = atomic_inc(&l_n);
+            moved = 1;
+        }
+    }
+
+    // One global atomic per work-group
+    APPEND_MOVED(moved, slot, mj);
+}
+
+// Bounds are compared with this much relative slack, so that rounding in the
+// distances and drifts never prunes a centroid brute force would pick
+#define YINYANG_SLACK 1.0001f
+
+// Find the nearest of the centroids in slots C[first..last). Ties go to the
+// lowest original index CI, as in classify.
+#define SCAN_GROUP(first, last, m1, j1, m2) \
+    m1 = INFINITY; m2 = INFINITY; j1 = -1; \
+    for (int q = first; q < last; ++q) { \
+        float2 t = d - C[q]; \
+        float s = dot(t, t); \
+        if (s < m1 || (s == m1 && CI[q] < CI[j1])) { \
+            m2 = m1; m1 = s; j1 = q; \
+        } else if (s < m2) { \
+            m2 = s; \
+        } \
+    }
+
+// Yinyang classify for many classes. Centroids are sorted by group: slot q
+// holds centroid CI[q] of group PG[q], and group g owns slots G[g]..G[g+1].
+// Per point, U is an upper bound on the distance to its centroid (slot L) and
+// B[g * count + i] a lower bound on the distance to every other centroid of
+// group g. After the centroids move by drift[q] (at most group_drift[g] within
+// a group) a group is only scanned if its bound no longer clears the upper
+// bound. Labels and the M list are reported as in classify.
+__kernel void classify_yinyang(__global point_t *D, __global float2 *C, __global int *CI,
+    __global int *PG, __global int *G, __global float *drift, __global float *group_drift,
+    __global int *L, __global float *U, __global float *B,
+    __global uint2 *M, __global uint *M_n, int gn, float2 origin, float2 scale,
+    ulong base, uint count) {
+    __local uint l_n, l_base;
+    size_t i = get_global_id(0);
+    uint slot = 0;
+    int best = -1;
+    int moved = 0;
+
+    if (get_local_id(0) == 0) l_n = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (i < count) {
+        float2 d = LOAD_POINT(D, base + i);
+        int p = L[i];
+        float best_s = INFINITY;
+        int gb = -1;
+        int scan = 1;
+
+        if (p >= 0) {
+            // Global filter: the smallest group bound against the drifted
+            // upper bound, then against the exact distance
+            float u = U[i] + drift[p];
+            float glb = INFINITY;
+            for (int g = 0; g < gn; ++g) {
+                float lb = B[g * count + i] - group_drift[g];
+                B[g * count + i] = lb;
+                glb = fmin(glb, lb);
+            }
+            best = p;
+            if (u * YINYANG_SLACK < glb) {
+                scan = 0;
+            } else {
+                float2 t = d - C[p];
+                best_s = dot(t, t);
+                u = sqrt(best_s);
+                scan = !(u * YINYANG_SLACK < glb);
+            }
+            U[i] = u;
+
+            // The group of the old centroid goes first, so that its bound
+            // never counts the old centroid itself
+            if (scan) {
+                gb = PG[p];
+                if (!(u * YINYANG_SLACK < B[gb * count + i])) {
+                    float m1, m2;
+                    int j1;
+                    SCAN_GROUP(G[gb], G[gb + 1], m1, j1, m2);
+                    best = j1;
+                    best_s = m1;
+                    B[gb * count + i] = sqrt(m2);
+                }
+            }
+        }
+
+        if (scan) {
+            for (int g = 0; g < gn; ++g) {
+                if (g == gb)
+                    continue;
+                if (p >= 0 && sqrt(best_s) * YINYANG_SLACK < B[g * count + i])
+                    continue;
+                float m1, m2;
+                int j1;
+                SCAN_GROUP(G[g], G[g + 1], m1, j1, m2);
+                if (m1 < best_s || (m1 == best_s && CI[j1] < CI[best])) {
+                    // The old best is now just another member of its group
+                    if (gb >= 0)
+                        B[gb * count + i] = fmin(B[gb * count + i], sqrt(best_s));
+                    best = j1;
+                    best_s = m1;
+                    gb = g;
+                    B[g * count + i] = sqrt(m2);
+                } else {
+                    B[g * count + i] = sqrt(m1);
+                }
+            }
+            U[i] = sqrt(best_s);
+        }
+
+        if (best != p) {
+            L[i] = best;
+            slot = atomic_inc(&l_n);
+            moved = 1;
+        }
+    }
+
+    APPEND_MOVED(moved, slot, CI[best]);
+}
+
+// Label each of the n points with its nearest centroid and write the distance
+// to it, without touching the centroids
+__kernel void assign(__global point_t *D, __global float2 *C, __global int *E,
+    __global float *M, int cn, uint n, float2 origin, float2 scale) {
+    size_t i = get_global_id(0);
+    if (i >= n) return;
+    float2 d = LOAD_POINT(D, i);
     float m = INFINITY;
-    uchar mj;
-    for (uchar j = 0; j < cn; ++j) {
-        float t = fast_distance(D[i], C[j]);
-        if (m > t) {
-            m = t;
+    int mj = 0;
+    for (int j = 0; j < cn; ++j) {
+        float2 t = d - C[j];
+        float s = dot(t, t);
+        if (m > s) {
+            m = s;
             mj = j;
         }
     }
     E[i] = mj;
+    M[i] = sqrt(m);
 }
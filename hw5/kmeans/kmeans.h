@@ -1,15 +1,89 @@
 
 
-#ifndef __KMENAS_H__
+#ifndef __KMEANS_H__
 #define __KMEANS_H__
 
+#include <stdio.h>
+#include <stddef.h>
+
 struct Point {
     float x, y;
 };
 
+// Storage format of the data points on the device
+enum PointFormat {
+    POINT_FLOAT,    // float2, 8 bytes per point
+    POINT_HALF,     // half2, 4 bytes per point
+    POINT_FIXED,    // 16-bit fixed point relative to the bounding box, 4 bytes per point
+};
+
+// Options selected on the command line
+struct KmeansOptions {
+    PointFormat point_format;
+    int depth;                  // chunks in flight on the device
+};
+
+extern KmeansOptions kmeans_opt;
+
 
 // Kmean algorighm
-void kmeans(int iteration_n, int class_n, int data_n, Point* centroids, Point* data, int* clsfy_result);
+void kmeans(int iteration_n, int class_n, size_t data_n, Point* centroids, Point* data, int* clsfy_result);
+
+// Weighted variant: point i counts weights[i] times in the update step.
+// Weights are double so that counts stay exact far beyond 2^24.
+void kmeans_weighted(int iteration_n, int class_n, size_t data_n, Point* centroids, Point* data, double* weights,
+    int* clsfy_result);
+
+// Label data with the nearest of the fixed centroids, without any update step.
+// Writes the distance to that centroid into dist unless it is NULL.
+void kmeans_assign(int class_n, size_t data_n, Point* centroids, Point* data, int* clsfy_result, float* dist);
+
+// Drop anything the engine keeps for data, before its contents change or it is freed
+void kmeans_forget(Point* data);
+
+// Time the engine's launch configurations on these inputs and keep the
+// fastest in the tuning database (common/tune_db.h) for later runs
+void kmeans_tune(int class_n, size_t data_n, Point* centroids, Point* data);
+
+// Node of a hierarchical k-means tree; children are stored contiguously
+struct KmeansNode {
+    Point centroid;
+    int first_child, child_n;   // child_n is 0 for leaves
+    int leaf;                   // class of a leaf, -1 for internal nodes
+};
+
+struct KmeansTree {
+    int node_n, leaf_n;
+    KmeansNode* nodes;          // nodes[0] is the root
+};
+
+// Hierarchical k-means (kmeans_tree.cpp): splits clusters into branch_n parts
+// with kmeans() runs until class_n leaves exist, then runs refine_n iterations
+// that only search the leaves found by a beam search of width beam_n
+KmeansTree* kmeans_tree(int iteration_n, int class_n, size_t data_n, Point* centroids, Point* data, int* clsfy_result,
+    int branch_n, int refine_n, int beam_n);
+int kmeans_tree_lookup(const KmeansTree* tree, Point p, int beam_n);
+void kmeans_tree_free(KmeansTree* tree);
+
+// Aggregate data into a grid_n x grid_n grid (kmeans_coreset.cpp). Returns the
+// number of non-empty cells and allocates their mean points and weights.
+size_t kmeans_grid_coreset(size_t data_n, Point* data, int grid_n, Point** coreset_p, double** weights_p);
+
+// File helpers shared by the command line and the server (kmeans_main.cpp).
+// Files start with the number of entries as a 32-bit unsigned int; counts
+// that do not fit are stored as LARGE_SIZE_MARK followed by a 64-bit count.
+// The readers and writers print what went wrong and return 0, or 1 on success.
+#define LARGE_SIZE_MARK 0xffffffffu
+int read_size(FILE* f, size_t* size_p);
+int write_size(FILE* f, size_t size);
+int read_data(FILE* f, float** data_p, size_t* size_p);
+int write_result(const char* path, size_t data_n, int* partitioned);
+int write_centroids(const char* path, int class_n, Point* centroids);
+double inertia(size_t data_n, Point* centroids, Point* data, int* partitioned);
+
+// Resident server mode over a Unix domain socket (kmeans_server.cpp)
+int kmeans_serve(const char* socket_path);
+int kmeans_submit(const char* socket_path, int argc, char** argv);
 
 #endif // __KMEANS_H__
 
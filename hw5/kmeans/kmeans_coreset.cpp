@@ -0,0 +1,92 @@
+/*
+  Grid coreset for KMeans
+
+  Points are aggregated into a grid_n x grid_n grid over their bounding box.
+  Every non-empty cell becomes one weighted point at the mean of its points,
+  with the number of points as its weight. Weighted k-means on the cells then
+  costs O(cells) per iteration instead of O(points); the error of each point
+  is bounded by the cell diagonal.
+*/
+
+#include "kmeans.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+#define EMPTY_CELL ((unsigned long long)-1)
+
+
+// Aggregated points of one grid cell
+struct Cell {
+    unsigned long long key;
+    double sx, sy;
+    size_t count;
+};
+
+
+size_t kmeans_grid_coreset(size_t data_n, Point* data, int grid_n, Point** coreset_p, double** weights_p)
+{
+    float lo[2] = { FLT_MAX, FLT_MAX }, hi[2] = { -FLT_MAX, -FLT_MAX };
+    float inv_cell[2];
+
+    for (size_t i = 0; i < data_n; i++) {
+        if (data[i].x < lo[0]) lo[0] = data[i].x;
+        if (data[i].x > hi[0]) hi[0] = data[i].x;
+        if (data[i].y < lo[1]) lo[1] = data[i].y;
+        if (data[i].y > hi[1]) hi[1] = data[i].y;
+    }
+    for (int d = 0; d < 2; d++)
+        inv_cell[d] = hi[d] > lo[d] ? grid_n / (hi[d] - lo[d]) : 0.0f;
+
+    // Open addressing table with at least twice as many slots as cells in use
+    size_t max_cells = (size_t)grid_n * grid_n < data_n ? (size_t)grid_n * grid_n : data_n;
+    size_t table_n = 2;
+    int table_bits = 1;
+    while (table_n < max_cells * 2) {
+        table_n <<= 1;
+        table_bits++;
+    }
+    Cell* table = (Cell*)malloc(sizeof(Cell) * table_n);
+    for (size_t t = 0; t < table_n; t++)
+        table[t].key = EMPTY_CELL;
+
+    size_t cell_n = 0;
+    for (size_t i = 0; i < data_n; i++) {
+        long long cx = (long long)((data[i].x - lo[0]) * inv_cell[0]);
+        long long cy = (long long)((data[i].y - lo[1]) * inv_cell[1]);
+        if (cx >= grid_n) cx = grid_n - 1;
+        if (cy >= grid_n) cy = grid_n - 1;
+        unsigned long long key = (unsigned long long)cy * grid_n + cx;
+
+        size_t t = (key * 0x9e3779b97f4a7c15ULL) >> (64 - table_bits);
+        while (table[t].key != key && table[t].key != EMPTY_CELL)
+            t = (t + 1) & (table_n - 1);
+        if (table[t].key == EMPTY_CELL) {
+            table[t].key = key;
+            table[t].sx = table[t].sy = 0.0;
+            table[t].count = 0;
+            cell_n++;
+        }
+        table[t].sx += data[i].x;
+        table[t].sy += data[i].y;
+        table[t].count++;
+    }
+
+    Point* coreset = (Point*)malloc(sizeof(Point) * cell_n);
+    double* weights = (double*)malloc(sizeof(double) * cell_n);
+    size_t c = 0;
+    for (size_t t = 0; t < table_n; t++) {
+        if (table[t].key == EMPTY_CELL)
+            continue;
+        coreset[c].x = table[t].sx / table[t].count;
+        coreset[c].y = table[t].sy / table[t].count;
+        weights[c] = table[t].count;
+        c++;
+    }
+
+    free(table);
+    *coreset_p = coreset;
+    *weights_p = weights;
+    return cell_n;
+}
@@ -3,33 +3,126 @@
 */
 
 #include "kmeans.h"
+#include "prof.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+#include <unistd.h>
 
 #define DATA_DIM 2
 #define DEFAULT_ITERATION 1024
+// Points read from the input stream per kmeans_assign() call in assign mode
+#define ASSIGN_BATCH (1 << 22)
+// Beam width of the refinement search in hierarchical mode
+#define DEFAULT_BEAM 4
 
-#define GET_TIME(T) __asm__ __volatile__ ("rdtsc\n" : "=A" (T))
 
+int assign_stream(const char* centroid_path, const char* data_path, const char* result_path, const char* dist_path);
 
-// Read data from file
-unsigned int read_data(FILE* f, float** data_p);
-int timespec_subtract(struct timespec*, struct timespec*, struct timespec*);
+KmeansOptions kmeans_opt = { POINT_FLOAT, 2 };
 
 
 int main(int argc, char** argv)
 {
-    int class_n, data_n, iteration_n;
+    int class_n, iteration_n;
+    size_t data_n;
     float *centroids, *data;
     int* partitioned;
     FILE *io_file;
-    struct timespec start, end, spent;
+
+    const char* prog_name = argv[0];
+    const char* serve_path = NULL;
+    const char* submit_path = NULL;
+    int assign_mode = 0;
+    int tune_mode = 0;
+    int branch_n = 0, refine_n = 0, beam_n = DEFAULT_BEAM;
+    int grid_n = 0;
+    int opt;
+
+    // Parse options
+    while ((opt = getopt(argc, argv, "p:d:s:c:aTt:r:b:g:")) != -1) {
+        switch (opt) {
+            case 'g':
+                grid_n = atoi(optarg);
+                if (grid_n < 1) {
+                    fprintf(stderr, "Grid cells per axis must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                branch_n = atoi(optarg);
+                if (branch_n < 2 || branch_n > 255) {
+                    fprintf(stderr, "Branch factor must be between 2 and 255\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                refine_n = atoi(optarg);
+                if (refine_n < 0) {
+                    fprintf(stderr, "Refine iterations must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                beam_n = atoi(optarg);
+                if (beam_n < 1) {
+                    fprintf(stderr, "Beam width must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                assign_mode = 1;
+                break;
+            case 'T':
+                tune_mode = 1;
+                break;
+            case 's':
+                serve_path = optarg;
+                break;
+            case 'c':
+                submit_path = optarg;
+                break;
+            case 'd':
+                kmeans_opt.depth = atoi(optarg);
+                if (kmeans_opt.depth < 1) {
+                    fprintf(stderr, "Depth must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg, "float") == 0) kmeans_opt.point_format = POINT_FLOAT;
+                else if (strcmp(optarg, "half") == 0) kmeans_opt.point_format = POINT_HALF;
+                else if (strcmp(optarg, "fixed") == 0) kmeans_opt.point_format = POINT_FIXED;
+                else {
+                    fprintf(stderr, "Unknown point format %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                exit(EXIT_FAILURE);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (serve_path != NULL)
+        return kmeans_serve(serve_path);
+
+    if (submit_path != NULL && argc >= 5)
+        return kmeans_submit(submit_path, argc - 1, argv + 1);
+
+    if (assign_mode && argc >= 4)
+        return assign_stream(argv[1], argv[2], argv[3], argc > 4 ? argv[4] : NULL);
 
     // Check parameters
-    if (argc < 4) {
-        fprintf(stderr, "usage: %s <centroid file> <data file> <paritioned result> [<final centroids>] [<iteration number>]\n", argv[0]);
+    if ((argc < 4 && !(tune_mode && argc >= 3)) || submit_path != NULL || assign_mode) {
+        fprintf(stderr, "usage: %s [-p float|half|fixed] [-d <depth>] [-t <branch factor> [-r <refine iterations>] [-b <beam width>] | -g <grid cells per axis>] <centroid file> <data file> <paritioned result> [<final centroids>] [<iteration number>]\n", prog_name);
+        fprintf(stderr, "       %s [-p float|half|fixed] [-d <depth>] -s <socket>\n", prog_name);
+        fprintf(stderr, "       %s [-p float|half|fixed] [-d <depth>] -a <centroid file> <data file|-> <paritioned result|-> [<distances>]\n", prog_name);
+        fprintf(stderr, "       %s [-p float|half|fixed] [-d <depth>] -T <centroid file> <data file>\n", prog_name);
+        fprintf(stderr, "       %s -c <socket> <data file> <class number> <iteration number> <paritioned result> [<final centroids>]\n", prog_name);
         exit(EXIT_FAILURE);
     }
 
@@ -39,7 +132,10 @@ int main(int argc, char** argv)
         fprintf(stderr, "File open error %s\n", argv[1]);
         exit(EXIT_FAILURE);
     }
-    class_n = read_data(io_file, &centroids);
+    size_t size;
+    if (!read_data(io_file, &centroids, &size))
+        exit(EXIT_FAILURE);
+    class_n = size;
     fclose(io_file);
 
     // Read input data
@@ -48,36 +144,62 @@ int main(int argc, char** argv)
         fprintf(stderr, "File open error %s\n", argv[2]);
         exit(EXIT_FAILURE);
     }
-    data_n = read_data(io_file, &data);
+    if (!read_data(io_file, &data, &data_n))
+        exit(EXIT_FAILURE);
     fclose(io_file);
 
+    if (tune_mode) {
+        kmeans_tune(class_n, data_n, (Point*)centroids, (Point*)data);
+        return 0;
+    }
+
     iteration_n = argc > 5 ? atoi(argv[5]) : DEFAULT_ITERATION;
         
 
     partitioned = (int*)malloc(sizeof(int)*data_n);
 
 
-    clock_gettime(CLOCK_MONOTONIC, &start);
+    prof_begin("kmeans");
     // Run Kmeans algorithm
-    kmeans(iteration_n, class_n, data_n, (Point*)centroids, (Point*)data, partitioned);
-    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (branch_n > 0) {
+        // Only the number of initial centroids is used
+        KmeansTree* tree = kmeans_tree(iteration_n, class_n, data_n, (Point*)centroids, (Point*)data, partitioned,
+            branch_n, refine_n, beam_n);
+        class_n = tree->leaf_n;
+        printf("Tree: %d nodes, %d leaves\n", tree->node_n, tree->leaf_n);
+        kmeans_tree_free(tree);
+    } else if (grid_n > 0) {
+        // Run on the weighted grid cells, then label the raw points in one pass
+        Point* coreset;
+        double* weights;
+        size_t coreset_n = kmeans_grid_coreset(data_n, (Point*)data, grid_n, &coreset, &weights);
+        int* coreset_partitioned = (int*)malloc(sizeof(int) * coreset_n);
+        printf("Coreset: %zu cells for %zu points\n", coreset_n, data_n);
+
+        kmeans_weighted(iteration_n, class_n, coreset_n, (Point*)centroids, coreset, weights, coreset_partitioned);
+        kmeans_forget(coreset);
+        kmeans_assign(class_n, data_n, (Point*)centroids, (Point*)data, partitioned, NULL);
 
-    timespec_subtract(&spent, &end, &start);
-    printf("Time spent: %ld.%09ld\n", spent.tv_sec, spent.tv_nsec);
+        free(coreset);
+        free(weights);
+        free(coreset_partitioned);
+    } else {
+        kmeans(iteration_n, class_n, data_n, (Point*)centroids, (Point*)data, partitioned);
+    }
+    double spent = prof_end();
+
+    printf("Time spent: %.9f\n", spent);
+    printf("Inertia: %f\n", inertia(data_n, (Point*)centroids, (Point*)data, partitioned));
 
     // Write classified result
-    io_file = fopen(argv[3], "wb");
-    fwrite(&data_n, sizeof(data_n), 1, io_file);
-    fwrite(partitioned, sizeof(int), data_n, io_file); 
-    fclose(io_file);
+    if (!write_result(argv[3], data_n, partitioned))
+        exit(EXIT_FAILURE);
 
 
     // Write final centroid data
     if (argc > 4) {
-        io_file = fopen(argv[4], "wb");
-        fwrite(&class_n, sizeof(class_n), 1, io_file);
-        fwrite(centroids, sizeof(Point), class_n, io_file); 
-        fclose(io_file);
+        if (!write_centroids(argv[4], class_n, (Point*)centroids))
+            exit(EXIT_FAILURE);
     }
 
 
@@ -91,49 +213,202 @@ int main(int argc, char** argv)
 
 
      
-int timespec_subtract (struct timespec* result, struct timespec *x, struct timespec *y)
+// Exit as write_result's callers do unless a write to path went through
+static void check_write(int ok, const char* path)
 {
-    /* Perform the carry for the later subtraction by updating y. */
-    if (x->tv_nsec < y->tv_nsec) {
-        int nsec = (y->tv_nsec - x->tv_nsec) / 1000000000 + 1;
-        y->tv_nsec -= 1000000000 * nsec;
-        y->tv_sec += nsec;
+    if (!ok) {
+        fprintf(stderr, "Error writing %s\n", path);
+        exit(EXIT_FAILURE);
     }
-    if (x->tv_nsec - y->tv_nsec > 1000000000) {
-        int nsec = (x->tv_nsec - y->tv_nsec) / 1000000000;
-        y->tv_nsec += 1000000000 * nsec;
-        y->tv_sec -= nsec;
+}
+
+
+// Label the points of a file, or stdin for "-", with the nearest of the
+// trained centroids. Points are streamed in batches so the input can be
+// larger than memory; labels (and distances) are written as each batch is done.
+int assign_stream(const char* centroid_path, const char* data_path, const char* result_path, const char* dist_path)
+{
+    float* centroids;
+    FILE *io_file, *in_file, *out_file, *dist_file = NULL;
+    size_t size, done, m;
+
+    io_file = fopen(centroid_path, "rb");
+    if (io_file == NULL) {
+        fprintf(stderr, "File open error %s\n", centroid_path);
+        exit(EXIT_FAILURE);
     }
-     
-    /* Compute the time remaining to wait.
-       tv_nsec is certainly positive. */
-    result->tv_sec = x->tv_sec - y->tv_sec;
-    result->tv_nsec = x->tv_nsec - y->tv_nsec;
-    
-    /* Return 1 if result is negative. */
-    return x->tv_sec < y->tv_sec;
+    if (!read_data(io_file, &centroids, &size))
+        exit(EXIT_FAILURE);
+    int class_n = size;
+    fclose(io_file);
+
+    in_file = strcmp(data_path, "-") == 0 ? stdin : fopen(data_path, "rb");
+    if (in_file == NULL) {
+        fprintf(stderr, "File open error %s\n", data_path);
+        exit(EXIT_FAILURE);
+    }
+    out_file = strcmp(result_path, "-") == 0 ? stdout : fopen(result_path, "wb");
+    const char* result_name = out_file == stdout ? "stdout" : result_path;
+    if (out_file == NULL) {
+        fprintf(stderr, "File open error %s\n", result_path);
+        exit(EXIT_FAILURE);
+    }
+    if (dist_path != NULL) {
+        dist_file = fopen(dist_path, "wb");
+        if (dist_file == NULL) {
+            fprintf(stderr, "File open error %s\n", dist_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!read_size(in_file, &size))
+        exit(EXIT_FAILURE);
+    check_write(write_size(out_file, size), result_name);
+    if (dist_file != NULL)
+        check_write(write_size(dist_file, size), dist_path);
+
+    Point* data = (Point*)malloc(sizeof(Point) * ASSIGN_BATCH);
+    int* partitioned = (int*)malloc(sizeof(int) * ASSIGN_BATCH);
+    float* dist = dist_file != NULL ? (float*)malloc(sizeof(float) * ASSIGN_BATCH) : NULL;
+
+    prof_begin("assign");
+    for (done = 0; done < size; done += m) {
+        m = size - done < ASSIGN_BATCH ? size - done : ASSIGN_BATCH;
+        if (fread(data, sizeof(Point), m, in_file) < m) {
+            fputs("Error reading data", stderr);
+            exit(EXIT_FAILURE);
+        }
+
+        kmeans_assign(class_n, m, (Point*)centroids, data, partitioned, dist);
+
+        check_write(fwrite(partitioned, sizeof(int), m, out_file) == m, result_name);
+        if (dist_file != NULL)
+            check_write(fwrite(dist, sizeof(float), m, dist_file) == m, dist_path);
+    }
+    double sec = prof_end();
+
+    // stdout may carry the labels, so report on stderr
+    fprintf(stderr, "Assigned %zu points in %.9f sec (%.2f Mpoints/s)\n",
+        size, sec, sec > 0 ? size / sec * 1e-6 : 0.0);
+
+    if (in_file != stdin)
+        fclose(in_file);
+    check_write((out_file != stdout ? fclose(out_file) : fflush(out_file)) == 0, result_name);
+    if (dist_file != NULL)
+        check_write(fclose(dist_file) == 0, dist_path);
+    free(centroids);
+    free(data);
+    free(partitioned);
+    free(dist);
+
+    return 0;
 }
 
 
-unsigned int read_data(FILE* f, float** data_p)
+int read_size(FILE* f, size_t* size_p)
 {
     unsigned int size;
-    size_t r;
+    unsigned long long large_size;
 
-    r = fread(&size, sizeof(size), 1, f);
-    if (r < 1) {
-        fputs("Error reading file size", stderr);
-        exit(EXIT_FAILURE);
+    if (fread(&size, sizeof(size), 1, f) < 1) {
+        fputs("Error reading file size\n", stderr);
+        return 0;
+    }
+    if (size != LARGE_SIZE_MARK) {
+        *size_p = size;
+        return 1;
+    }
+
+    if (fread(&large_size, sizeof(large_size), 1, f) < 1) {
+        fputs("Error reading file size\n", stderr);
+        return 0;
+    }
+    *size_p = large_size;
+    return 1;
+}
+
+
+int write_size(FILE* f, size_t size)
+{
+    unsigned int small_size = size < LARGE_SIZE_MARK ? size : LARGE_SIZE_MARK;
+    unsigned long long large_size = size;
+
+    if (fwrite(&small_size, sizeof(small_size), 1, f) < 1)
+        return 0;
+    if (small_size == LARGE_SIZE_MARK && fwrite(&large_size, sizeof(large_size), 1, f) < 1)
+        return 0;
+    return 1;
+}
+
+
+// Write size and then count items of elem bytes to a new file at path
+static int write_file(const char* path, size_t size, const void* items, size_t elem)
+{
+    FILE* io_file = fopen(path, "wb");
+    if (io_file == NULL) {
+        fprintf(stderr, "File open error %s\n", path);
+        return 0;
+    }
+    int ok = write_size(io_file, size) && fwrite(items, elem, size, io_file) == size;
+    if (fclose(io_file) != 0)
+        ok = 0;
+    if (!ok)
+        fprintf(stderr, "Error writing %s\n", path);
+    return ok;
+}
+
+
+int write_result(const char* path, size_t data_n, int* partitioned)
+{
+    return write_file(path, data_n, partitioned, sizeof(int));
+}
+
+
+int write_centroids(const char* path, int class_n, Point* centroids)
+{
+    return write_file(path, class_n, centroids, sizeof(Point));
+}
+
+
+// Sum of squared distances from each point to its assigned centroid
+double inertia(size_t data_n, Point* centroids, Point* data, int* partitioned)
+{
+    double sum = 0.0;
+
+    for (size_t i = 0; i < data_n; i++) {
+        double dx = data[i].x - centroids[partitioned[i]].x;
+        double dy = data[i].y - centroids[partitioned[i]].y;
+        sum += dx * dx + dy * dy;
+    }
+
+    return sum;
+}
+
+
+int read_data(FILE* f, float** data_p, size_t* size_p)
+{
+    size_t size, r;
+
+    *data_p = NULL;
+    if (!read_size(f, &size))
+        return 0;
+
+    // A size beyond what the file can hold is caught by the read below,
+    // unless it does not even fit in memory
+    if (size > SIZE_MAX / (sizeof(float) * DATA_DIM)
+        || (*data_p = (float*)malloc(sizeof(float) * DATA_DIM * size)) == NULL) {
+        fprintf(stderr, "Cannot allocate %zu points\n", size);
+        return 0;
     }
-    
-    *data_p = (float*)malloc(sizeof(float) * DATA_DIM * size);
 
     r = fread(*data_p, sizeof(float), DATA_DIM*size, f);
     if (r < DATA_DIM*size) {
-        fputs("Error reading data", stderr);
-        exit(EXIT_FAILURE);
+        fputs("Error reading data\n", stderr);
+        free(*data_p);
+        *data_p = NULL;
+        return 0;
     }
 
-    return size;
+    *size_p = size;
+    return 1;
 }
-
@@ -3,8 +3,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <float.h>
+#include <math.h>
 #include <string.h>
+#include <time.h>
 #include <CL/cl.h>
+#include "tune_db.h"
+#include "pipeline.h"
+#include "prof.h"
+#include "stage_pool.h"
+
+// Points per classify launch, lowered if the device cannot allocate that many
+#define CLASSIFY_CHUNK (1 << 24)
+// Points per launch in kmeans_assign()
+#define ASSIGN_CHUNK (1 << 20)
+// Work-group size unless the tuning database has one for the device
+#define DEFAULT_LOCAL 256
+// Label of a point that has not been classified yet
+#define NO_CLASS -1
+// Yinyang classify is used from this many classes on, with about
+// YINYANG_GROUP_SIZE centroids per group
+#define YINYANG_MIN_CLASS 64
+#define YINYANG_GROUP_SIZE 10
+// Chunks in flight, -d at most
+#define MAX_DEPTH 8
 
 #define CHECK_ERROR(err) \
   if (err != CL_SUCCESS) { \
@@ -35,38 +56,184 @@ char *get_source_code(const char *file_name, size_t *len) {
   return source_code;
 }
 
-void kmeans(int iteration_n, int class_n, int data_n, Point* centroids, Point* data, int* partitioned)
-{
-    cl_int err;
+// Convert a float to IEEE half precision, rounding to nearest even
+cl_half float_to_half(float f) {
+    union { float f; unsigned int u; } v;
+    v.f = f;
+    unsigned int sign = (v.u >> 16) & 0x8000;
+    int exp = (int)((v.u >> 23) & 0xff) - 127 + 15;
+    unsigned int mant = v.u & 0x7fffff;
 
-    cl_platform_id platform;
-    err = clGetPlatformIDs(1, &platform, NULL);
-    CHECK_ERROR(err);
+    if (((v.u >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if (exp >= 31)
+        return sign | 0x7c00;
+    if (exp <= 0) {
+        if (exp < -10)
+            return sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        unsigned int h = mant >> shift;
+        unsigned int rem = mant & ((1u << shift) - 1);
+        unsigned int mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (h & 1)))
+            ++h;
+        return sign | h;
+    }
 
-    cl_device_id device;
-    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
-    CHECK_ERROR(err);
+    unsigned int h = ((unsigned int)exp << 10) | (mant >> 13);
+    unsigned int rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        ++h;
+    return sign | h;
+}
+
+// Bytes per point in the device storage format
+size_t point_size(PointFormat format) {
+    return format == POINT_FLOAT ? sizeof(cl_float2) : sizeof(cl_ushort) * 2;
+}
+
+// Pack the data points in the device storage format into packed, which holds
+// point_size(format) * data_n bytes. Sets origin/scale used to decode fixed
+// point values.
+void pack_points(size_t data_n, Point* data, PointFormat format, void *packed,
+    cl_float2 *origin, cl_float2 *scale) {
+    origin->s[0] = origin->s[1] = 0.0f;
+    scale->s[0] = scale->s[1] = 1.0f;
 
+    if (format == POINT_HALF) {
+        cl_half *P = (cl_half*)packed;
+        for (size_t i = 0; i < data_n; ++i) {
+            P[i * 2] = float_to_half(data[i].x);
+            P[i * 2 + 1] = float_to_half(data[i].y);
+        }
+        return;
+    }
+
+    if (format == POINT_FIXED) {
+        float lo[2] = { FLT_MAX, FLT_MAX }, hi[2] = { -FLT_MAX, -FLT_MAX };
+        for (size_t i = 0; i < data_n; ++i) {
+            if (data[i].x < lo[0]) lo[0] = data[i].x;
+            if (data[i].x > hi[0]) hi[0] = data[i].x;
+            if (data[i].y < lo[1]) lo[1] = data[i].y;
+            if (data[i].y > hi[1]) hi[1] = data[i].y;
+        }
+        for (int d = 0; d < 2; ++d) {
+            origin->s[d] = lo[d];
+            scale->s[d] = hi[d] > lo[d] ? (hi[d] - lo[d]) / 65535.0f : 1.0f;
+        }
+
+        cl_ushort *P = (cl_ushort*)packed;
+        for (size_t i = 0; i < data_n; ++i) {
+            float q[2] = { (data[i].x - lo[0]) / scale->s[0], (data[i].y - lo[1]) / scale->s[1] };
+            for (int d = 0; d < 2; ++d) {
+                float r = q[d] + 0.5f;
+                P[i * 2 + d] = r >= 65535.0f ? 65535 : (cl_ushort)r;
+            }
+        }
+        return;
+    }
+
+    float *P = (float*)packed;
+    for (size_t i = 0; i < data_n; ++i) {
+        P[i * 2] = data[i].x;
+        P[i * 2 + 1] = data[i].y;
+    }
+}
+
+// Data points uploaded to the device, kept for later calls on the same data.
+// Datasets larger than one device allocation are not resident: memD is NULL
+// and the packed points in host are streamed chunk by chunk every iteration.
+struct Resident {
+    Point* data;
+    size_t data_n;
+    PointFormat format;
+    cl_mem memD;
+    void* host;
+    cl_float2 origin, scale;
+    Resident* next;
+};
+
+// OpenCL state kept alive across kmeans() calls, so that a long-running
+// process pays for platform discovery, context creation and program build once
+struct Engine {
+    cl_device_id device;
     cl_context context;
-    context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-    CHECK_ERROR(err);
+    cl_command_queue queueIO, queueSM;
+    cl_program program;
+    cl_kernel kernel, yinyang, assign;
+    PointFormat format;     // format the program was built for
+    size_t max_alloc;       // CL_DEVICE_MAX_MEM_ALLOC_SIZE
+    size_t global_mem;      // CL_DEVICE_GLOBAL_MEM_SIZE
+    size_t chunk;           // points per classify launch
+    size_t local_size;      // work-group size of all kernels
+    Resident* resident;
+    int depth;              // chunks in flight, from kmeans_opt.depth
+    // Pinned host buffers of every transfer, kept across calls
+    stage_pool* pool;
+    // Staging slots of kmeans_assign(), allocated on first use
+    cl_mem memAD[MAX_DEPTH], memAE[MAX_DEPTH], memAM[MAX_DEPTH];
+    void* hostAD[MAX_DEPTH];
+};
 
-    cl_command_queue queueIO;
-    queueIO = clCreateCommandQueue(context, device, 0, &err);
-    CHECK_ERROR(err);
-    cl_command_queue queueSM;
-    queueSM = clCreateCommandQueue(context, device, 0, &err);
-    CHECK_ERROR(err);
+static Engine* engine = NULL;
+
+void engine_release() {
+    while (engine->resident != NULL) {
+        Resident* r = engine->resident;
+        engine->resident = r->next;
+        if (r->memD != NULL)
+            clReleaseMemObject(r->memD);
+        if (r->host != r->data)
+            free(r->host);
+        free(r);
+    }
+    if (engine->hostAD[0] != NULL) {
+        for (int s = 0; s < engine->depth; ++s) {
+            clReleaseMemObject(engine->memAD[s]);
+            clReleaseMemObject(engine->memAE[s]);
+            clReleaseMemObject(engine->memAM[s]);
+        }
+    }
+    stage_pool_release(engine->pool);
+    clReleaseKernel(engine->assign);
+    clReleaseKernel(engine->yinyang);
+    clReleaseKernel(engine->kernel);
+    clReleaseProgram(engine->program);
+    clReleaseCommandQueue(engine->queueIO);
+    clReleaseCommandQueue(engine->queueSM);
+    clReleaseContext(engine->context);
+    free(engine);
+    engine = NULL;
+}
+
+void engine_build(PointFormat format) {
+    cl_int err;
+
+    if (engine->program != NULL) {
+        clReleaseKernel(engine->assign);
+        clReleaseKernel(engine->yinyang);
+        clReleaseKernel(engine->kernel);
+        clReleaseProgram(engine->program);
+    }
 
     const char *source_code;
     size_t source_size;
     source_code = get_source_code("kernel.cl", &source_size);
 
     cl_program program;
-    program = clCreateProgramWithSource(context, 1, &source_code, &source_size, &err);
+    program = clCreateProgramWithSource(engine->context, 1, &source_code, &source_size, &err);
     CHECK_ERROR(err);
+    free((void*)source_code);
 
-    err = clBuildProgram(program, 1, &device, "", NULL, NULL);
+    const char *build_options = "";
+    if (format == POINT_HALF)
+        build_options = "-DPOINT_HALF";
+    else if (format == POINT_FIXED)
+        build_options = "-DPOINT_FIXED";
+
+    cl_device_id device = engine->device;
+    err = clBuildProgram(program, 1, &device, build_options, NULL, NULL);
     if (err == CL_BUILD_PROGRAM_FAILURE) {
         char *log;
         size_t log_size;
@@ -79,147 +246,796 @@ void kmeans(int iteration_n, int class_n, int data_n, Point* centroids, Point* d
     }
     CHECK_ERROR(err);
 
-    cl_kernel kernel;
-    kernel = clCreateKernel(program, "classify", &err);
+    engine->kernel = clCreateKernel(program, "classify", &err);
+    CHECK_ERROR(err);
+    engine->yinyang = clCreateKernel(program, "classify_yinyang", &err);
+    CHECK_ERROR(err);
+    engine->assign = clCreateKernel(program, "assign", &err);
     CHECK_ERROR(err);
+    engine->program = program;
+    engine->format = format;
+}
 
-    size_t global_size, local_size = 256;
-    global_size = (data_n + local_size - 1) / local_size * local_size;
-    int n = (data_n + global_size - 1) / global_size * global_size;
-    float *D = (float*)malloc(sizeof(float) * 2 * data_n);
-    float *C = (float*)malloc(sizeof(float) * 2 * class_n);
-    cl_uchar *E = (cl_uchar*)malloc(sizeof(cl_uchar) * n);
-    int *F = (int*)malloc(sizeof(int) * class_n);
-    for (int i = 0; i < data_n; ++i) {
-        D[i * 2] = data[i].x;
-        D[i * 2 + 1] = data[i].y;
-    }
-    for (int i = 0; i < class_n; ++i) {
-        C[i * 2] = centroids[i].x;
-        C[i * 2 + 1] = centroids[i].y;
-    }
+void engine_init() {
+    cl_int err;
 
-    cl_mem memD;
-    memD = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        sizeof(cl_float2) * n, NULL, &err);
-    CHECK_ERROR(err);
-    cl_mem memC;
-    memC = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        sizeof(cl_float2) * class_n, NULL, &err);
+    engine = (Engine*)calloc(1, sizeof(Engine));
+    engine->depth = kmeans_opt.depth < MAX_DEPTH ? kmeans_opt.depth : MAX_DEPTH;
+
+    cl_platform_id platform;
+    err = clGetPlatformIDs(1, &platform, NULL);
     CHECK_ERROR(err);
-    cl_mem memE;
-    memE = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-        sizeof(cl_uchar) * n, NULL, &err);
+
+    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &engine->device, NULL);
     CHECK_ERROR(err);
 
-    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &memD);
+    cl_ulong max_alloc;
+    err = clGetDeviceInfo(engine->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+        sizeof(max_alloc), &max_alloc, NULL);
     CHECK_ERROR(err);
-    err = clSetKernelArg(kernel, 1, sizeof(cl_mem), &memC);
+    engine->max_alloc = max_alloc;
+    cl_ulong global_mem;
+    err = clGetDeviceInfo(engine->device, CL_DEVICE_GLOBAL_MEM_SIZE,
+        sizeof(global_mem), &global_mem, NULL);
     CHECK_ERROR(err);
-    err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &memE);
+    engine->global_mem = global_mem;
+    engine->chunk = CLASSIFY_CHUNK;
+    if (engine->chunk * sizeof(cl_float2) > engine->max_alloc)
+        engine->chunk = engine->max_alloc / sizeof(cl_float2) / 256 * 256;
+
+    char params[256];
+    size_t max_group, local;
+    err = clGetDeviceInfo(engine->device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+        sizeof(max_group), &max_group, NULL);
     CHECK_ERROR(err);
-    err = clSetKernelArg(kernel, 3, sizeof(cl_uchar), &class_n);
+    engine->local_size = DEFAULT_LOCAL < max_group ? DEFAULT_LOCAL : max_group;
+    if (tune_lookup(engine->device, "kmeans", params, sizeof(params))
+        && sscanf(params, "local=%zu", &local) == 1 && local > 0 && local <= max_group)
+        engine->local_size = local;
+
+    engine->context = clCreateContext(NULL, 1, &engine->device, NULL, NULL, &err);
     CHECK_ERROR(err);
 
-    err = clEnqueueWriteBuffer(queueIO, memD, CL_TRUE, 0,
-        sizeof(cl_float2) * data_n, D, 0, NULL, NULL);
+    engine->queueIO = clCreateCommandQueue(engine->context, engine->device, 0, &err);
     CHECK_ERROR(err);
-    for (int iter = 0; iter < iteration_n; ++iter) {
-        err = clEnqueueWriteBuffer(queueIO, memC, CL_TRUE, 0,
-            sizeof(cl_float2) * class_n, C, 0, NULL, NULL);
-        CHECK_ERROR(err);
-        memset(C, 0, sizeof(cl_float2) * class_n);
-        memset(F, 0, sizeof(int) * class_n);
-
-        int xSM = -1, xHost = -1;
-        cl_uint num_events = 0;
-        cl_event event[2];
-        for (int i = 0; i < n; i += global_size) {
-            if (num_events > 0) {
-                err = clWaitForEvents(num_events, event);
-                CHECK_ERROR(err);
-            }
+    engine->queueSM = clCreateCommandQueue(engine->context, engine->device, 0, &err);
+    CHECK_ERROR(err);
+    engine->pool = stage_pool_create(engine->context, engine->queueIO);
 
-            if (xSM != -1) {
-                err = clEnqueueReadBuffer(queueIO, memE, CL_FALSE,
-                    sizeof(cl_uchar) * xSM, sizeof(cl_uchar) * global_size,
-                    &E[xSM], 0, NULL, &event[1]);
-                CHECK_ERROR(err);
-                xHost = xSM;
-            }
+    engine_build(kmeans_opt.point_format);
+    atexit(engine_release);
+}
 
-            num_events = 0;
-            size_t global_offset = i;
-            err = clEnqueueNDRangeKernel(queueSM, kernel, 1, &global_offset,
-                &global_size, &local_size, 0, NULL, &event[num_events++]);
-            CHECK_ERROR(err);
-            xSM = i;
-
-            if (xHost != -1) {
-                err = clWaitForEvents(1, &event[1]);
-                CHECK_ERROR(err);
-                for (size_t x = 0; x < global_size; ++x) {
-                    int idx = xHost + x;
-                    C[E[idx] * 2] += D[idx * 2];
-                    C[E[idx] * 2 + 1] += D[idx * 2 + 1];
-                    ++F[E[idx]];
+// Pinned buffer of at least bytes from the engine's pool
+void* engine_stage(size_t bytes) {
+    void* host = stage_get(engine->pool, bytes);
+    if (host == NULL)
+        exit(EXIT_FAILURE);
+    return host;
+}
+
+// Find the device copy of data, uploading it on first use
+Resident* engine_upload(size_t data_n, Point* data) {
+    cl_int err;
+    Resident* r;
+
+    for (r = engine->resident; r != NULL; r = r->next) {
+        if (r->data == data && r->data_n == data_n && r->format == engine->format)
+            return r;
+    }
+
+    r = (Resident*)malloc(sizeof(Resident));
+    r->data = data;
+    r->data_n = data_n;
+    r->format = engine->format;
+    r->memD = NULL;
+
+    // Float points are streamed straight from data
+    size_t bytes = point_size(r->format) * data_n;
+    if (r->format == POINT_FLOAT)
+        r->host = data;
+    else
+        r->host = malloc(bytes);
+    pack_points(data_n, data, r->format, r->host, &r->origin, &r->scale);
+
+    if (bytes <= engine->max_alloc) {
+        r->memD = clCreateBuffer(engine->context, CL_MEM_READ_ONLY, bytes, NULL, &err);
+        CHECK_ERROR(err);
+        err = clEnqueueWriteBuffer(engine->queueIO, r->memD, CL_TRUE, 0,
+            bytes, r->host, 0, NULL, NULL);
+        CHECK_ERROR(err);
+        if (r->host != data)
+            free(r->host);
+        r->host = NULL;
+    }
+
+    r->next = engine->resident;
+    engine->resident = r;
+    return r;
+}
+
+void kmeans_forget(Point* data)
+{
+    if (engine == NULL)
+        return;
+
+    for (Resident** p = &engine->resident; *p != NULL; ) {
+        Resident* r = *p;
+        if (r->data != data) {
+            p = &r->next;
+            continue;
+        }
+        *p = r->next;
+        if (r->memD != NULL)
+            clReleaseMemObject(r->memD);
+        if (r->host != r->data)
+            free(r->host);
+        free(r);
+    }
+}
+
+// Set up the engine on first use, or rebuild it for a new point format
+void engine_prepare() {
+    if (engine == NULL)
+        engine_init();
+    else if (engine->format != kmeans_opt.point_format)
+        engine_build(kmeans_opt.point_format);
+}
+
+// Cluster the centroids into at most gn groups with a few Lloyd iterations and
+// lay them out group by group: slot q holds centroid CI[q] of group PG[q], and
+// group g owns slots G[g]..G[g+1]. Returns the number of non-empty groups.
+int group_centroids(int class_n, cl_float2* C, int gn, int* CI, int* PG, int* G) {
+    cl_float2 *center = (cl_float2*)malloc(sizeof(cl_float2) * gn);
+    double *sum = (double*)malloc(sizeof(double) * 3 * gn);
+    int *own = (int*)malloc(sizeof(int) * class_n);
+
+    for (int g = 0; g < gn; ++g)
+        center[g] = C[(size_t)g * class_n / gn];
+    for (int iter = 0; iter < 5; ++iter) {
+        memset(sum, 0, sizeof(double) * 3 * gn);
+        for (int j = 0; j < class_n; ++j) {
+            float m = FLT_MAX;
+            for (int g = 0; g < gn; ++g) {
+                float dx = C[j].s[0] - center[g].s[0], dy = C[j].s[1] - center[g].s[1];
+                if (dx * dx + dy * dy < m) {
+                    m = dx * dx + dy * dy;
+                    own[j] = g;
                 }
             }
+            sum[own[j] * 3] += C[j].s[0];
+            sum[own[j] * 3 + 1] += C[j].s[1];
+            sum[own[j] * 3 + 2] += 1.0;
+        }
+        for (int g = 0; g < gn; ++g) {
+            if (sum[g * 3 + 2] > 0) {
+                center[g].s[0] = sum[g * 3] / sum[g * 3 + 2];
+                center[g].s[1] = sum[g * 3 + 1] / sum[g * 3 + 2];
+            }
         }
+    }
 
-        if (num_events > 0) {
-            err = clWaitForEvents(num_events, event);
-            CHECK_ERROR(err);
+    // Counting sort by group, dropping empty groups
+    int n = 0, q = 0;
+    for (int g = 0; g < gn; ++g) {
+        int first = q;
+        for (int j = 0; j < class_n; ++j) {
+            if (own[j] == g) {
+                CI[q] = j;
+                PG[q++] = n;
+            }
+        }
+        if (q > first)
+            G[n++] = first;
+    }
+    G[n] = class_n;
+
+    free(center);
+    free(sum);
+    free(own);
+    return n;
+}
+
+// One iteration of kmeans_weighted() as a pipeline over chunks. The kernel
+// of a chunk writes the points whose label changed into memM of its slot
+// and their number into N; the host reads them back and moves their
+// weights between the running sums.
+struct WeightedJob {
+    Point* data;
+    double* weights;
+    size_t data_n, chunk, psize;
+    Resident* resident;
+    cl_kernel kernel;
+    int yinyang, arg_L, arg_M, arg_base;
+    cl_mem *memL, *memU, *memB;         // of each chunk
+    cl_mem memM[MAX_DEPTH], memN[MAX_DEPTH], memD[MAX_DEPTH];
+    void* stageD[MAX_DEPTH];
+    cl_uint N[MAX_DEPTH];
+    cl_uint2* H;
+    double *S, *F;
+    int* E;
+    size_t changed;
+};
+
+// Points of chunk item and where it starts
+cl_uint weighted_count(const WeightedJob* job, size_t item, size_t* start) {
+    *start = item * job->chunk;
+    return job->data_n - *start < job->chunk ? job->data_n - *start : job->chunk;
+}
+
+// Host stage of points that are not resident: copy the chunk into pinned
+// staging, so that its upload runs as DMA while the host goes on
+cl_int weighted_stage(void* arg, const pipe_call* call, cl_event* event) {
+    WeightedJob* job = (WeightedJob*)arg;
+    size_t start;
+    cl_uint count = weighted_count(job, call->item, &start);
+
+    memcpy(job->stageD[call->slot], (char*)job->resident->host + job->psize * start, job->psize * count);
+    return CL_SUCCESS;
+}
+
+cl_int weighted_upload(void* arg, const pipe_call* call, cl_event* event) {
+    WeightedJob* job = (WeightedJob*)arg;
+    size_t start;
+    cl_uint count = weighted_count(job, call->item, &start);
+
+    return clEnqueueWriteBuffer(call->queue, job->memD[call->slot], CL_FALSE, 0,
+        job->psize * count, job->stageD[call->slot], call->wait_n, call->wait, event);
+}
+
+// Clear the count of moved points, classify the chunk and read the count back
+cl_int weighted_kernel(void* arg, const pipe_call* call, cl_event* event) {
+    static const cl_uint zero = 0;
+    WeightedJob* job = (WeightedJob*)arg;
+    cl_kernel kernel = job->kernel;
+    cl_int err;
+    int s = call->slot;
+    size_t start;
+    cl_uint count = weighted_count(job, call->item, &start);
+    cl_ulong base = start;
+
+    if (job->resident->memD != NULL) {
+        err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &job->resident->memD);
+        CHECK_ERROR(err);
+    } else {
+        base = 0;
+        err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &job->memD[s]);
+        CHECK_ERROR(err);
+    }
+    err = clSetKernelArg(kernel, job->arg_L, sizeof(cl_mem), &job->memL[call->item]);
+    CHECK_ERROR(err);
+    if (job->yinyang) {
+        err = clSetKernelArg(kernel, job->arg_L + 1, sizeof(cl_mem), &job->memU[call->item]);
+        CHECK_ERROR(err);
+        err = clSetKernelArg(kernel, job->arg_L + 2, sizeof(cl_mem), &job->memB[call->item]);
+        CHECK_ERROR(err);
+    }
+    err = clSetKernelArg(kernel, job->arg_M, sizeof(cl_mem), &job->memM[s]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, job->arg_M + 1, sizeof(cl_mem), &job->memN[s]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, job->arg_base, sizeof(cl_ulong), &base);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, job->arg_base + 1, sizeof(cl_uint), &count);
+    CHECK_ERROR(err);
+
+    cl_event zeroed, computed;
+    err = clEnqueueWriteBuffer(call->queue, job->memN[s], CL_FALSE, 0,
+        sizeof(cl_uint), &zero, call->wait_n, call->wait, &zeroed);
+    CHECK_ERROR(err);
+    size_t local_size = engine->local_size;
+    size_t global_size = (count + local_size - 1) / local_size * local_size;
+    err = clEnqueueNDRangeKernel(call->queue, kernel, 1, NULL, &global_size,
+        &local_size, 1, &zeroed, &computed);
+    CHECK_ERROR(err);
+    err = clEnqueueReadBuffer(call->queue, job->memN[s], CL_FALSE, 0,
+        sizeof(cl_uint), &job->N[s], 1, &computed, event);
+    clReleaseEvent(zeroed);
+    clReleaseEvent(computed);
+    return err;
+}
+
+// Host stage: read back only the moved points, whose number is known now,
+// and apply their label changes to the running sums
+cl_int weighted_apply(void* arg, const pipe_call* call, cl_event* event) {
+    WeightedJob* job = (WeightedJob*)arg;
+    cl_int err;
+    size_t start;
+    weighted_count(job, call->item, &start);
+
+    // The kernel that wrote them has finished, so queueIO need not wait
+    // for queueSM
+    cl_uint n = job->N[call->slot];
+    if (n > 0) {
+        err = clEnqueueReadBuffer(engine->queueIO, job->memM[call->slot], CL_TRUE, 0,
+            sizeof(cl_uint2) * n, job->H, 0, NULL, NULL);
+        CHECK_ERROR(err);
+    }
+    for (cl_uint k = 0; k < n; ++k) {
+        size_t idx = start + job->H[k].s[0];
+        int from = job->E[idx], to = job->H[k].s[1];
+        double w = job->weights != NULL ? job->weights[idx] : 1.0;
+        double wx = w * job->data[idx].x, wy = w * job->data[idx].y;
+        if (from != NO_CLASS) {
+            job->S[from * 2] -= wx;
+            job->S[from * 2 + 1] -= wy;
+            job->F[from] -= w;
         }
+        job->S[to * 2] += wx;
+        job->S[to * 2 + 1] += wy;
+        job->F[to] += w;
+        job->E[idx] = to;
+    }
+    job->changed += n;
+    return CL_SUCCESS;
+}
 
-        if (xSM != -1) {
-            err = clEnqueueReadBuffer(queueIO, memE, CL_FALSE,
-                sizeof(cl_uchar) * xSM, sizeof(cl_uchar) * global_size,
-                &E[xSM], 0, NULL, &event[1]);
+void kmeans(int iteration_n, int class_n, size_t data_n, Point* centroids, Point* data, int* partitioned)
+{
+    kmeans_weighted(iteration_n, class_n, data_n, centroids, data, NULL, partitioned);
+}
+
+void kmeans_weighted(int iteration_n, int class_n, size_t data_n, Point* centroids, Point* data, double* weights,
+    int* partitioned)
+{
+    cl_int err;
+
+    // Without an iteration no label would be set, so give the points those
+    // of the centroids as they are
+    if (iteration_n < 1) {
+        kmeans_assign(class_n, data_n, centroids, data, partitioned, NULL);
+        return;
+    }
+
+    engine_prepare();
+
+    cl_context context = engine->context;
+    cl_command_queue queueIO = engine->queueIO;
+    cl_command_queue queueSM = engine->queueSM;
+
+    size_t chunk = engine->chunk;
+    size_t chunk_n = (data_n + chunk - 1) / chunk;
+    size_t psize = point_size(engine->format);
+    cl_float2 *C = (cl_float2*)malloc(sizeof(cl_float2) * class_n);
+    cl_uint2 *H = (cl_uint2*)engine_stage(sizeof(cl_uint2) * chunk);
+    double *S = (double*)calloc(2 * class_n, sizeof(double));
+    double *F = (double*)calloc(class_n, sizeof(double));
+    // Labels are kept in partitioned itself
+    int *E = partitioned;
+    for (int i = 0; i < class_n; ++i) {
+        C[i].s[0] = centroids[i].x;
+        C[i].s[1] = centroids[i].y;
+    }
+    for (size_t i = 0; i < data_n; ++i)
+        E[i] = NO_CLASS;
+
+    // Yinyang needs a bound per group for every point. The group count is
+    // lowered until the bounds of a chunk fit in one allocation and those of
+    // all chunks in half of the device memory; below one group, or for few
+    // classes, every point scans all centroids instead.
+    int gn = 0;
+    if (class_n >= YINYANG_MIN_CLASS) {
+        gn = (class_n + YINYANG_GROUP_SIZE - 1) / YINYANG_GROUP_SIZE;
+        size_t fit = engine->max_alloc / (sizeof(cl_float) * chunk);
+        if ((size_t)gn > fit)
+            gn = fit;
+        fit = engine->global_mem / 2 / data_n;
+        fit = fit > 2 * sizeof(cl_float) ? (fit - 2 * sizeof(cl_float)) / sizeof(cl_float) : 0;
+        if ((size_t)gn > fit)
+            gn = fit;
+    }
+    int yinyang = gn > 0;
+    cl_kernel kernel = yinyang ? engine->yinyang : engine->kernel;
+    // Argument indices that differ between classify and classify_yinyang
+    int arg_L = yinyang ? 7 : 2, arg_M = yinyang ? 10 : 3, arg_base = yinyang ? 15 : 8;
+
+    int *CI = NULL, *PG = NULL, *G = NULL;
+    cl_float2 *P = NULL;
+    float *drift = NULL, *group_drift = NULL;
+    if (yinyang) {
+        CI = (int*)malloc(sizeof(int) * class_n);
+        PG = (int*)malloc(sizeof(int) * class_n);
+        G = (int*)malloc(sizeof(int) * (gn + 1));
+        gn = group_centroids(class_n, C, gn, CI, PG, G);
+        P = (cl_float2*)malloc(sizeof(cl_float2) * class_n);
+        drift = (float*)calloc(class_n, sizeof(float));
+        group_drift = (float*)calloc(gn, sizeof(float));
+    }
+
+    Resident* resident = engine_upload(data_n, data);
+
+    cl_mem memC;
+    memC = clCreateBuffer(context, CL_MEM_READ_ONLY,
+        sizeof(cl_float2) * class_n, NULL, &err);
+    CHECK_ERROR(err);
+
+    // Labels (and for Yinyang, bounds) stay on the device between
+    // iterations, one buffer per chunk
+    cl_mem *memL = (cl_mem*)malloc(sizeof(cl_mem) * chunk_n);
+    cl_mem *memU = NULL, *memB = NULL;
+    if (yinyang) {
+        memU = (cl_mem*)malloc(sizeof(cl_mem) * chunk_n);
+        memB = (cl_mem*)malloc(sizeof(cl_mem) * chunk_n);
+    }
+    for (size_t c = 0; c < chunk_n; ++c) {
+        size_t count = data_n - c * chunk < chunk ? data_n - c * chunk : chunk;
+        memL[c] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+            sizeof(cl_int) * count, NULL, &err);
+        CHECK_ERROR(err);
+        err = clEnqueueWriteBuffer(queueIO, memL[c], CL_FALSE, 0,
+            sizeof(cl_int) * count, E, 0, NULL, NULL);
+        CHECK_ERROR(err);
+        if (yinyang) {
+            memU[c] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                sizeof(cl_float) * count, NULL, &err);
+            CHECK_ERROR(err);
+            memB[c] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                sizeof(cl_float) * gn * count, NULL, &err);
             CHECK_ERROR(err);
-            xHost = xSM;
         }
+    }
+    clFinish(queueIO);
 
-        if (xHost != -1) {
-            err = clWaitForEvents(1, &event[1]);
+    WeightedJob job;
+    job.data = data;
+    job.weights = weights;
+    job.data_n = data_n;
+    job.chunk = chunk;
+    job.psize = psize;
+    job.resident = resident;
+    job.kernel = kernel;
+    job.yinyang = yinyang;
+    job.arg_L = arg_L;
+    job.arg_M = arg_M;
+    job.arg_base = arg_base;
+    job.memL = memL;
+    job.memU = memU;
+    job.memB = memB;
+    job.H = H;
+    job.S = S;
+    job.F = F;
+    job.E = E;
+    for (int s = 0; s < engine->depth; ++s) {
+        job.memM[s] = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+            sizeof(cl_uint2) * chunk, NULL, &err);
+        CHECK_ERROR(err);
+        job.memN[s] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+            sizeof(cl_uint), NULL, &err);
+        CHECK_ERROR(err);
+        job.memD[s] = NULL;
+        job.stageD[s] = NULL;
+        if (resident->memD == NULL) {
+            job.memD[s] = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                psize * chunk, NULL, &err);
             CHECK_ERROR(err);
-            for (size_t x = 0; x < global_size; ++x) {
-                int idx = xHost + x;
-                if (idx >= n) break;
-                C[E[idx] * 2] += D[idx * 2];
-                C[E[idx] * 2 + 1] += D[idx * 2 + 1];
-                ++F[E[idx]];
+            job.stageD[s] = engine_stage(psize * chunk);
+        }
+    }
+
+    // Uploads of points that are not resident go through queueIO, while
+    // the chunks before are classified on queueSM and the host applies
+    // their label changes to the running sums
+    pipeline pipe = {};
+    if (resident->memD == NULL) {
+        pipeline_stage(&pipe, PIPE_HOST, 0, weighted_stage);
+        pipeline_stage(&pipe, PIPE_UPLOAD, 0, weighted_upload);
+    }
+    pipeline_stage(&pipe, PIPE_KERNEL, 0, weighted_kernel);
+    pipeline_stage(&pipe, PIPE_HOST, 0, weighted_apply);
+    pipe.depth = engine->depth;
+    pipe.upload[pipe.upload_n++] = queueIO;
+    pipe.compute[pipe.compute_n++] = queueSM;
+    pipe.arg = &job;
+
+    cl_mem memCI = NULL, memPG = NULL, memG = NULL, memDrift = NULL, memGroupDrift = NULL;
+    err = clSetKernelArg(kernel, 1, sizeof(cl_mem), &memC);
+    CHECK_ERROR(err);
+    if (yinyang) {
+        memCI = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            sizeof(cl_int) * class_n, CI, &err);
+        CHECK_ERROR(err);
+        memPG = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            sizeof(cl_int) * class_n, PG, &err);
+        CHECK_ERROR(err);
+        memG = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            sizeof(cl_int) * (gn + 1), G, &err);
+        CHECK_ERROR(err);
+        memDrift = clCreateBuffer(context, CL_MEM_READ_ONLY,
+            sizeof(cl_float) * class_n, NULL, &err);
+        CHECK_ERROR(err);
+        memGroupDrift = clCreateBuffer(context, CL_MEM_READ_ONLY,
+            sizeof(cl_float) * gn, NULL, &err);
+        CHECK_ERROR(err);
+
+        err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &memCI);
+        CHECK_ERROR(err);
+        err = clSetKernelArg(kernel, 3, sizeof(cl_mem), &memPG);
+        CHECK_ERROR(err);
+        err = clSetKernelArg(kernel, 4, sizeof(cl_mem), &memG);
+        CHECK_ERROR(err);
+        err = clSetKernelArg(kernel, 5, sizeof(cl_mem), &memDrift);
+        CHECK_ERROR(err);
+        err = clSetKernelArg(kernel, 6, sizeof(cl_mem), &memGroupDrift);
+        CHECK_ERROR(err);
+        err = clSetKernelArg(kernel, 12, sizeof(cl_int), &gn);
+        CHECK_ERROR(err);
+    } else {
+        err = clSetKernelArg(kernel, 5, sizeof(cl_int), &class_n);
+        CHECK_ERROR(err);
+    }
+    err = clSetKernelArg(kernel, arg_base - 2, sizeof(cl_float2), &resident->origin);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, arg_base - 1, sizeof(cl_float2), &resident->scale);
+    CHECK_ERROR(err);
+
+    for (int iter = 0; iter < iteration_n; ++iter) {
+        if (yinyang) {
+            // Centroids go to the device in group order, along with how far
+            // each moved since the last iteration
+            for (int q = 0; q < class_n; ++q) {
+                cl_float2 c = C[CI[q]];
+                if (iter > 0) {
+                    double dx = c.s[0] - P[q].s[0], dy = c.s[1] - P[q].s[1];
+                    drift[q] = sqrt(dx * dx + dy * dy);
+                    if (drift[q] > group_drift[PG[q]])
+                        group_drift[PG[q]] = drift[q];
+                }
+                P[q] = c;
             }
+            err = clEnqueueWriteBuffer(queueIO, memDrift, CL_FALSE, 0,
+                sizeof(cl_float) * class_n, drift, 0, NULL, NULL);
+            CHECK_ERROR(err);
+            err = clEnqueueWriteBuffer(queueIO, memGroupDrift, CL_FALSE, 0,
+                sizeof(cl_float) * gn, group_drift, 0, NULL, NULL);
+            CHECK_ERROR(err);
         }
+        err = clEnqueueWriteBuffer(queueIO, memC, CL_TRUE, 0,
+            sizeof(cl_float2) * class_n, yinyang ? P : C, 0, NULL, NULL);
+        CHECK_ERROR(err);
+
+        job.changed = 0;
+        err = pipeline_run(&pipe, chunk_n);
+        CHECK_ERROR(err);
+
+        // Nothing moved, so the centroids are already final
+        if (job.changed == 0)
+            break;
 
+        // Empty classes keep their centroid
         for (int x = 0; x < class_n; ++x) {
             if (F[x] > 0) {
-                C[x * 2] /= F[x];
-                C[x * 2 + 1] /= F[x];
+                C[x].s[0] = S[x * 2] / F[x];
+                C[x].s[1] = S[x * 2 + 1] / F[x];
             }
         }
+        if (yinyang)
+            memset(group_drift, 0, sizeof(float) * gn);
     }
 
     for (int i = 0; i < class_n; ++i) {
-        centroids[i].x = C[i * 2];
-        centroids[i].y = C[i * 2 + 1];
-    }
-    for (int i = 0; i < data_n; ++i) {
-        partitioned[i] = E[i];
+        centroids[i].x = C[i].s[0];
+        centroids[i].y = C[i].s[1];
     }
 
-    free(D);
     free(C);
-    free(E);
+    stage_put(engine->pool, H);
+    free(S);
     free(F);
-    clReleaseMemObject(memD);
     clReleaseMemObject(memC);
-    clReleaseMemObject(memE);
+    for (size_t c = 0; c < chunk_n; ++c) {
+        clReleaseMemObject(memL[c]);
+        if (yinyang) {
+            clReleaseMemObject(memU[c]);
+            clReleaseMemObject(memB[c]);
+        }
+    }
+    free(memL);
+    for (int s = 0; s < engine->depth; ++s) {
+        clReleaseMemObject(job.memM[s]);
+        clReleaseMemObject(job.memN[s]);
+        if (job.memD[s] != NULL)
+            clReleaseMemObject(job.memD[s]);
+        stage_put(engine->pool, job.stageD[s]);
+    }
+    if (yinyang) {
+        free(memU);
+        free(memB);
+        free(CI);
+        free(PG);
+        free(G);
+        free(P);
+        free(drift);
+        free(group_drift);
+        clReleaseMemObject(memCI);
+        clReleaseMemObject(memPG);
+        clReleaseMemObject(memG);
+        clReleaseMemObject(memDrift);
+        clReleaseMemObject(memGroupDrift);
+    }
+}
+
+// One kmeans_assign() call as a pipeline over chunks of ASSIGN_CHUNK points
+struct AssignJob {
+    size_t data_n;
+    Point* data;
+    int* partitioned;
+    float* dist;
+    cl_mem memC;
+    cl_float2 origin[MAX_DEPTH], scale[MAX_DEPTH];  // of the chunk in each slot
+};
+
+// Points of chunk item and where it starts
+cl_uint assign_count(const AssignJob* job, size_t item, size_t* start) {
+    *start = item * ASSIGN_CHUNK;
+    return job->data_n - *start < ASSIGN_CHUNK ? job->data_n - *start : ASSIGN_CHUNK;
+}
+
+// Host stage: pack the chunk into the pinned buffer of its slot
+cl_int assign_pack(void* arg, const pipe_call* call, cl_event* event) {
+    AssignJob* job = (AssignJob*)arg;
+    size_t start;
+    cl_uint m = assign_count(job, call->item, &start);
+
+    pack_points(m, job->data + start, engine->format, engine->hostAD[call->slot],
+        &job->origin[call->slot], &job->scale[call->slot]);
+    return CL_SUCCESS;
+}
+
+cl_int assign_upload(void* arg, const pipe_call* call, cl_event* event) {
+    AssignJob* job = (AssignJob*)arg;
+    size_t start;
+    cl_uint m = assign_count(job, call->item, &start);
+
+    return clEnqueueWriteBuffer(call->queue, engine->memAD[call->slot], CL_FALSE, 0,
+        point_size(engine->format) * m, engine->hostAD[call->slot],
+        call->wait_n, call->wait, event);
+}
+
+cl_int assign_kernel(void* arg, const pipe_call* call, cl_event* event) {
+    AssignJob* job = (AssignJob*)arg;
+    cl_kernel kernel = engine->assign;
+    cl_int err;
+    size_t start;
+    cl_uint m = assign_count(job, call->item, &start);
+
+    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &engine->memAD[call->slot]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, 1, sizeof(cl_mem), &job->memC);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &engine->memAE[call->slot]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, 3, sizeof(cl_mem), &engine->memAM[call->slot]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, 5, sizeof(cl_uint), &m);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, 6, sizeof(cl_float2), &job->origin[call->slot]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, 7, sizeof(cl_float2), &job->scale[call->slot]);
+    CHECK_ERROR(err);
+
+    size_t local_size = engine->local_size;
+    size_t global_size = (m + local_size - 1) / local_size * local_size;
+    return clEnqueueNDRangeKernel(call->queue, kernel, 1, NULL, &global_size,
+        &local_size, call->wait_n, call->wait, event);
+}
+
+// Read the labels, then the distances, straight into the caller's arrays
+cl_int assign_download(void* arg, const pipe_call* call, cl_event* event) {
+    AssignJob* job = (AssignJob*)arg;
+    cl_int err;
+    size_t start;
+    cl_uint m = assign_count(job, call->item, &start);
+
+    if (job->dist == NULL) {
+        return clEnqueueReadBuffer(call->queue, engine->memAE[call->slot], CL_FALSE, 0,
+            sizeof(cl_int) * m, &job->partitioned[start], call->wait_n, call->wait, event);
+    }
+    cl_event labels;
+    err = clEnqueueReadBuffer(call->queue, engine->memAE[call->slot], CL_FALSE, 0,
+        sizeof(cl_int) * m, &job->partitioned[start], call->wait_n, call->wait, &labels);
+    CHECK_ERROR(err);
+    err = clEnqueueReadBuffer(call->queue, engine->memAM[call->slot], CL_FALSE, 0,
+        sizeof(cl_float) * m, &job->dist[start], 1, &labels, event);
+    clReleaseEvent(labels);
+    return err;
+}
 
-    clReleaseKernel(kernel);
-    clReleaseProgram(program);
-    clReleaseCommandQueue(queueIO);
-    clReleaseCommandQueue(queueSM);
-    clReleaseContext(context);
+void kmeans_assign(int class_n, size_t data_n, Point* centroids, Point* data, int* partitioned, float* dist)
+{
+    cl_int err;
+
+    engine_prepare();
+
+    cl_context context = engine->context;
+    cl_kernel kernel = engine->assign;
+
+    if (engine->hostAD[0] == NULL) {
+        for (int s = 0; s < engine->depth; ++s) {
+            engine->memAD[s] = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                sizeof(cl_float2) * ASSIGN_CHUNK, NULL, &err);
+            CHECK_ERROR(err);
+            engine->memAE[s] = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+                sizeof(cl_int) * ASSIGN_CHUNK, NULL, &err);
+            CHECK_ERROR(err);
+            engine->memAM[s] = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+                sizeof(cl_float) * ASSIGN_CHUNK, NULL, &err);
+            CHECK_ERROR(err);
+            engine->hostAD[s] = engine_stage(sizeof(cl_float2) * ASSIGN_CHUNK);
+        }
+    }
+
+    AssignJob job;
+    job.data_n = data_n;
+    job.data = data;
+    job.partitioned = partitioned;
+    job.dist = dist;
+    job.memC = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        sizeof(cl_float2) * class_n, centroids, &err);
+    CHECK_ERROR(err);
+
+    err = clSetKernelArg(kernel, 4, sizeof(cl_int), &class_n);
+    CHECK_ERROR(err);
+
+    // Uploads go through queueIO while the kernels and read backs of the
+    // chunks before run on queueSM, so transfers overlap the compute
+    pipeline pipe = {};
+    pipeline_stage(&pipe, PIPE_HOST, 0, assign_pack);
+    pipeline_stage(&pipe, PIPE_UPLOAD, 0, assign_upload);
+    pipeline_stage(&pipe, PIPE_KERNEL, 0, assign_kernel);
+    pipeline_stage(&pipe, PIPE_DOWNLOAD, 0, assign_download);
+    pipe.depth = engine->depth;
+    pipe.upload[pipe.upload_n++] = engine->queueIO;
+    pipe.compute[pipe.compute_n++] = engine->queueSM;
+    pipe.arg = &job;
+    err = pipeline_run(&pipe, (data_n + ASSIGN_CHUNK - 1) / ASSIGN_CHUNK);
+    CHECK_ERROR(err);
+
+    clReleaseMemObject(job.memC);
 }
 
+void kmeans_tune(int class_n, size_t data_n, Point* centroids, Point* data)
+{
+    static const size_t locals[] = { 32, 64, 128, 256, 512, 1024 };
+    const int iteration_n = 5;
+    Point* C = (Point*)malloc(sizeof(Point) * class_n);
+    int* partitioned = (int*)malloc(sizeof(int) * data_n);
+    size_t max_group, best_local = 0;
+    double best_time = 0.0;
+    cl_int err;
+
+    engine_prepare();
+    err = clGetDeviceInfo(engine->device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+        sizeof(max_group), &max_group, NULL);
+    CHECK_ERROR(err);
+
+    // Upload the points before timing anything
+    memcpy(C, centroids, sizeof(Point) * class_n);
+    kmeans(1, class_n, data_n, C, data, partitioned);
+
+    for (size_t l = 0; l < sizeof(locals) / sizeof(locals[0]); ++l) {
+        if (locals[l] > max_group)
+            continue;
+        engine->local_size = locals[l];
+
+        memcpy(C, centroids, sizeof(Point) * class_n);
+        prof_begin("tune");
+        kmeans(iteration_n, class_n, data_n, C, data, partitioned);
+        double t = prof_end();
+        printf("local %zu : %f sec\n", locals[l], t);
+        if (best_local == 0 || t < best_time) {
+            best_local = locals[l];
+            best_time = t;
+        }
+    }
+
+    char params[64];
+    snprintf(params, sizeof(params), "local=%zu", best_local);
+    printf("Tuned: %s\n", params);
+    stage_pool_report(engine->pool, "kmeans");
+    engine->local_size = best_local;
+    if (!tune_store(engine->device, "kmeans", params))
+        printf("Failed to store the tuning\n");
+
+    free(C);
+    free(partitioned);
+}
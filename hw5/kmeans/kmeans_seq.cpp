@@ -3,24 +3,52 @@
 
 #include <stdlib.h>
 #include <float.h>
+#include <math.h>
 
+// Points labeled together in kmeans_assign(); the inner loop runs over a
+// block of points so the compiler can vectorize it
+#define ASSIGN_BLOCK 256
 
-void kmeans(int iteration_n, int class_n, int data_n, Point* centroids, Point* data, int* partitioned)
+
+void kmeans(int iteration_n, int class_n, size_t data_n, Point* centroids, Point* data, int* partitioned)
+{
+    kmeans_weighted(iteration_n, class_n, data_n, centroids, data, NULL, partitioned);
+}
+
+
+void kmeans_weighted(int iteration_n, int class_n, size_t data_n, Point* centroids, Point* data, double* weights,
+    int* partitioned)
 {
     // Loop indices for iteration, data and class
-    int i, data_i, class_i;
-    // Count number of data in each class
-    int* count = (int*)malloc(sizeof(int) * class_n);
+    int i, class_i;
+    size_t data_i;
+    // Running sums and total weight of data in each class. Only points whose
+    // class changed are moved between them, so the update step costs O(churn).
+    double* sum = (double*)calloc(2 * class_n, sizeof(double));
+    double* count = (double*)calloc(class_n, sizeof(double));
     // Temporal point value to calculate distance
     Point t;
 
+    // Without an iteration no label would be set, so give the points those
+    // of the centroids as they are
+    if (iteration_n < 1) {
+        kmeans_assign(class_n, data_n, centroids, data, partitioned, NULL);
+        free(sum);
+        free(count);
+        return;
+    }
+
+    for (data_i = 0; data_i < data_n; data_i++)
+        partitioned[data_i] = -1;
 
     // Iterate through number of interations
     for (i = 0; i < iteration_n; i++) {
+        size_t changed = 0;
 
         // Assignment step
         for (data_i = 0; data_i < data_n; data_i++) {
             float min_dist = DBL_MAX;
+            int old_class = partitioned[data_i], new_class = old_class;
       
             for (class_i = 0; class_i < class_n; class_i++) {
                 t.x = data[data_i].x - centroids[class_i].x;
@@ -29,32 +57,89 @@ void kmeans(int iteration_n, int class_n, int data_n, Point* centroids, Point* d
                 float dist = t.x * t.x + t.y * t.y;
 	
                 if (dist < min_dist) {
-                    partitioned[data_i] = class_i;
+                    new_class = class_i;
                     min_dist = dist;
                 }
             }
+
+            if (new_class != old_class) {
+                double w = weights != NULL ? weights[data_i] : 1.0;
+                if (old_class >= 0) {
+                    sum[old_class * 2] -= w * data[data_i].x;
+                    sum[old_class * 2 + 1] -= w * data[data_i].y;
+                    count[old_class] -= w;
+                }
+                sum[new_class * 2] += w * data[data_i].x;
+                sum[new_class * 2 + 1] += w * data[data_i].y;
+                count[new_class] += w;
+                partitioned[data_i] = new_class;
+                changed++;
+            }
         }
 
         // Update step
-        // Clear sum buffer and class count
+        // Divide the sum with number of class for mean point
         for (class_i = 0; class_i < class_n; class_i++) {
-            centroids[class_i].x = 0.0;
-            centroids[class_i].y = 0.0;
-            count[class_i] = 0;
+            if (count[class_i] > 0) {
+                centroids[class_i].x = sum[class_i * 2] / count[class_i];
+                centroids[class_i].y = sum[class_i * 2 + 1] / count[class_i];
+            }
         }
 
-        // Sum up and count data for each class
-        for (data_i = 0; data_i < data_n; data_i++) {         
-            centroids[partitioned[data_i]].x += data[data_i].x;
-            centroids[partitioned[data_i]].y += data[data_i].y;
-            count[partitioned[data_i]]++;
+        // Nothing moved, so later iterations would not change anything
+        if (changed == 0)
+            break;
+    }
+
+    free(sum);
+    free(count);
+}
+
+
+
+void kmeans_assign(int class_n, size_t data_n, Point* centroids, Point* data, int* partitioned, float* dist)
+{
+    float x[ASSIGN_BLOCK], y[ASSIGN_BLOCK], min_dist[ASSIGN_BLOCK];
+    int label[ASSIGN_BLOCK];
+
+    for (size_t block_i = 0; block_i < data_n; block_i += ASSIGN_BLOCK) {
+        int m = data_n - block_i < ASSIGN_BLOCK ? data_n - block_i : ASSIGN_BLOCK;
+
+        for (int i = 0; i < m; i++) {
+            x[i] = data[block_i + i].x;
+            y[i] = data[block_i + i].y;
+            min_dist[i] = FLT_MAX;
+            label[i] = 0;
         }
-        
-        // Divide the sum with number of class for mean point
-        for (class_i = 0; class_i < class_n; class_i++) {
-            centroids[class_i].x /= count[class_i];
-            centroids[class_i].y /= count[class_i];
+
+        for (int class_i = 0; class_i < class_n; class_i++) {
+            float cx = centroids[class_i].x, cy = centroids[class_i].y;
+
+            for (int i = 0; i < m; i++) {
+                float tx = x[i] - cx, ty = y[i] - cy;
+                float d = tx * tx + ty * ty;
+                label[i] = d < min_dist[i] ? class_i : label[i];
+                min_dist[i] = d < min_dist[i] ? d : min_dist[i];
+            }
+        }
+
+        for (int i = 0; i < m; i++)
+            partitioned[block_i + i] = label[i];
+        if (dist != NULL) {
+            for (int i = 0; i < m; i++)
+                dist[block_i + i] = sqrtf(min_dist[i]);
         }
     }
 }
 
+
+void kmeans_forget(Point* data)
+{
+    // Nothing is cached
+}
+
+
+void kmeans_tune(int class_n, size_t data_n, Point* centroids, Point* data)
+{
+    printf("Nothing to tune for the sequential engine\n");
+}
@@ -0,0 +1,348 @@
+/*
+  Resident server mode for KMeans
+
+  The server keeps the engine state (for OpenCL: context, compiled kernels and
+  uploaded points) and every dataset it has loaded alive between jobs. Clients
+  connect to a Unix domain socket and send one job per connection:
+
+    <data file> <class number> <iteration number> <paritioned result> [<final centroids>]\n
+
+  Initial centroids are sampled evenly from the data. The reply is a single
+  line with the queue wait and execution latency of the job, or "error" and
+  what went wrong. Loaded datasets are kept up to DATASET_CACHE_BYTES; past
+  that, the least recently used ones are dropped along with their device
+  copies. SIGUSR1 prints the profile of the jobs so far to stderr.
+*/
+
+#include "kmeans.h"
+#include "prof.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define MAX_LINE 4096
+// Seconds a client has to send its job line once connected
+#define RECEIVE_TIMEOUT 10
+// Points kept in memory between jobs, beyond which datasets are dropped
+#define DATASET_CACHE_BYTES ((size_t)4 << 30)
+
+
+// Input data loaded by an earlier job
+struct Dataset {
+    char* path;
+    size_t data_n;
+    Point* data;
+    Dataset* next;
+};
+
+// Job received from a client, waiting for the worker
+struct Job {
+    int fd;
+    char line[MAX_LINE];
+    double received;
+    Job* next;
+};
+
+// Most recently used first
+static Dataset* datasets = NULL;
+static size_t dataset_bytes = 0;
+static Job *queue_head = NULL, *queue_tail = NULL;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t report_requested = 0;
+
+
+static double now()
+{
+    return prof_now() * 1e-9;
+}
+
+
+static void request_report(int)
+{
+    report_requested = 1;
+}
+
+
+// Drop the least recently used datasets but the first until the rest fit
+static void evict_datasets()
+{
+    while (dataset_bytes > DATASET_CACHE_BYTES && datasets != NULL && datasets->next != NULL) {
+        Dataset** last = &datasets;
+        while ((*last)->next != NULL)
+            last = &(*last)->next;
+        Dataset* d = *last;
+        *last = NULL;
+
+        printf("unload %s\n", d->path);
+        kmeans_forget(d->data);
+        dataset_bytes -= sizeof(Point) * d->data_n;
+        free(d->data);
+        free(d->path);
+        free(d);
+    }
+}
+
+
+// The dataset at path, loaded by an earlier job or now. Returns NULL with
+// the reason in error if it cannot be read.
+static Dataset* load_dataset(const char* path, const char** error)
+{
+    Dataset *d, **p;
+
+    for (p = &datasets; *p != NULL; p = &(*p)->next) {
+        d = *p;
+        if (strcmp(d->path, path) == 0) {
+            *p = d->next;
+            d->next = datasets;
+            datasets = d;
+            return d;
+        }
+    }
+
+    FILE* io_file = fopen(path, "rb");
+    if (io_file == NULL) {
+        *error = "cannot open";
+        return NULL;
+    }
+
+    float* data;
+    size_t data_n;
+    int ok = read_data(io_file, &data, &data_n);
+    fclose(io_file);
+    if (!ok) {
+        *error = "cannot read";
+        return NULL;
+    }
+
+    d = (Dataset*)malloc(sizeof(Dataset));
+    d->path = strdup(path);
+    d->data = (Point*)data;
+    d->data_n = data_n;
+    d->next = datasets;
+    datasets = d;
+    dataset_bytes += sizeof(Point) * data_n;
+    evict_datasets();
+    return d;
+}
+
+
+static void run_job(Job* job)
+{
+    char data_path[MAX_LINE], result_path[MAX_LINE], centroid_path[MAX_LINE];
+    char reply[MAX_LINE + 64];
+    int class_n, iteration_n;
+    Dataset* d = NULL;
+    const char* error = NULL;
+
+    double start = now();
+    int fields = sscanf(job->line, "%s %d %d %s %s", data_path, &class_n, &iteration_n,
+        result_path, centroid_path);
+
+    if (fields < 4 || class_n < 1 || iteration_n < 1) {
+        snprintf(reply, sizeof(reply), "error malformed job\n");
+    } else if ((d = load_dataset(data_path, &error)) == NULL) {
+        snprintf(reply, sizeof(reply), "error %s %s\n", error, data_path);
+    } else if ((size_t)class_n > d->data_n) {
+        snprintf(reply, sizeof(reply), "error more classes than points\n");
+    } else {
+        Point* centroids = (Point*)malloc(sizeof(Point) * class_n);
+        int* partitioned = (int*)malloc(sizeof(int) * d->data_n);
+
+        for (int i = 0; i < class_n; i++)
+            centroids[i] = d->data[i * d->data_n / class_n];
+
+        prof_begin("job");
+        kmeans(iteration_n, class_n, d->data_n, centroids, d->data, partitioned);
+        prof_end();
+        double end = now();
+
+        if (!write_result(result_path, d->data_n, partitioned)) {
+            snprintf(reply, sizeof(reply), "error cannot write %s\n", result_path);
+        } else if (fields > 4 && !write_centroids(centroid_path, class_n, centroids)) {
+            snprintf(reply, sizeof(reply), "error cannot write %s\n", centroid_path);
+        } else {
+            snprintf(reply, sizeof(reply), "ok points %zu wait %.6f exec %.6f inertia %f\n",
+                d->data_n, start - job->received, end - start,
+                inertia(d->data_n, centroids, d->data, partitioned));
+        }
+
+        free(centroids);
+        free(partitioned);
+    }
+
+    printf("job %s", reply);
+    fflush(stdout);
+    if (write(job->fd, reply, strlen(reply)) < 0)
+        perror("write");
+    close(job->fd);
+}
+
+
+// Read the job line of a connection and queue the job once it is
+// complete. Each connection has a thread of its own, so a client that is
+// slow to send holds up no other; one that sends nothing within
+// RECEIVE_TIMEOUT gets a malformed job.
+static void* receive_job(void* arg)
+{
+    Job* job = (Job*)arg;
+    size_t len = 0;
+    ssize_t r;
+
+    while (len < sizeof(job->line) - 1 && (r = read(job->fd, job->line + len, sizeof(job->line) - 1 - len)) > 0) {
+        len += r;
+        if (memchr(job->line, '\n', len) != NULL)
+            break;
+    }
+    job->received = now();
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail != NULL)
+        queue_tail->next = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+
+static void* worker(void*)
+{
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        Job* job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&queue_lock);
+
+        run_job(job);
+        free(job);
+    }
+    return NULL;
+}
+
+
+int kmeans_serve(const char* socket_path)
+{
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+
+    if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+        perror(socket_path);
+        return EXIT_FAILURE;
+    }
+
+    // Clients may hang up before their reply
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 interrupts accept() below; the worker, the threads it starts
+    // and those receiving jobs leave it to this one
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_report;
+    sigaction(SIGUSR1, &action, NULL);
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+
+    pthread_t thread;
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    pthread_create(&thread, NULL, worker, NULL);
+    pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+    printf("Listening on %s\n", socket_path);
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(sock, NULL, NULL);
+        if (report_requested) {
+            report_requested = 0;
+            const char* env = getenv("PROF");
+            prof_report(stderr, env != NULL && strcmp(env, "json") == 0);
+        }
+        if (fd < 0)
+            continue;
+
+        struct timeval timeout = { RECEIVE_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        Job* job = (Job*)calloc(1, sizeof(Job));
+        job->fd = fd;
+
+        pthread_t receiver;
+        pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+        int err = pthread_create(&receiver, NULL, receive_job, job);
+        pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+        if (err != 0) {
+            close(fd);
+            free(job);
+            continue;
+        }
+        pthread_detach(receiver);
+    }
+
+    return 0;
+}
+
+
+// Send a job to a running server and print its reply
+int kmeans_submit(const char* socket_path, int argc, char** argv)
+{
+    char line[MAX_LINE], cwd[MAX_LINE];
+    size_t len = 0;
+    struct sockaddr_un addr;
+
+    // The server resolves paths against its own working directory
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        cwd[0] = '\0';
+    for (int i = 0; i < argc; i++) {
+        int is_path = i == 0 || i >= 3;
+        len += snprintf(line + len, sizeof(line) - len, "%s%s%s%s", i > 0 ? " " : "",
+            is_path && argv[i][0] != '/' ? cwd : "", is_path && argv[i][0] != '/' ? "/" : "", argv[i]);
+        if (len >= sizeof(line) - 1) {
+            fprintf(stderr, "Job too long\n");
+            return EXIT_FAILURE;
+        }
+    }
+    line[len++] = '\n';
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror(socket_path);
+        return EXIT_FAILURE;
+    }
+
+    if (write(sock, line, len) < 0) {
+        perror("write");
+        return EXIT_FAILURE;
+    }
+
+    ssize_t r;
+    len = 0;
+    while (len < sizeof(line) - 1 && (r = read(sock, line + len, sizeof(line) - 1 - len)) > 0)
+        len += r;
+    line[len] = '\0';
+    close(sock);
+
+    fputs(line, stdout);
+    return strncmp(line, "ok", 2) == 0 ? 0 : EXIT_FAILURE;
+}
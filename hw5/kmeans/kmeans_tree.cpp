@@ -0,0 +1,397 @@
+/*
+  Hierarchical (bisecting) KMeans
+
+  Clusters are split recursively into branch_n parts by small-k runs of the
+  kmeans() engine, always splitting the leaf with the largest squared error,
+  until class_n leaves exist. Each split only touches the points of one leaf,
+  so building the tree costs O(n log k) distance computations instead of the
+  O(n k) per iteration of plain Lloyd. Optional refinement iterations then
+  reassign every point to the nearest leaf found by a beam search of the tree.
+*/
+
+#include "kmeans.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+// Subsets smaller than this are split on the host, where engine launch
+// overhead would dominate
+#define TREE_ENGINE_POINTS (1 << 16)
+// Widest beam kmeans_tree_lookup() searches
+#define TREE_MAX_BEAM 64
+
+
+// Leaf waiting to be split, ordered by squared error
+struct HeapEntry {
+    double sse;
+    int node;
+};
+
+struct Heap {
+    int n;
+    HeapEntry* entries;
+};
+
+
+static void heap_push(Heap* h, double sse, int node)
+{
+    int i = h->n++;
+    while (i > 0 && h->entries[(i - 1) / 2].sse < sse) {
+        h->entries[i] = h->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->entries[i].sse = sse;
+    h->entries[i].node = node;
+}
+
+
+static HeapEntry heap_pop(Heap* h)
+{
+    HeapEntry top = h->entries[0];
+    HeapEntry last = h->entries[--h->n];
+    int i = 0;
+
+    for (;;) {
+        int c = i * 2 + 1;
+        if (c >= h->n)
+            break;
+        if (c + 1 < h->n && h->entries[c + 1].sse > h->entries[c].sse)
+            c++;
+        if (h->entries[c].sse <= last.sse)
+            break;
+        h->entries[i] = h->entries[c];
+        i = c;
+    }
+    if (h->n > 0)
+        h->entries[i] = last;
+    return top;
+}
+
+
+static float dist2(Point a, Point b)
+{
+    float dx = a.x - b.x, dy = a.y - b.y;
+    return dx * dx + dy * dy;
+}
+
+
+// Label each point of the subset with its nearest centroid
+static void label_nearest(int k, size_t m, Point* centroids, Point* points, int* labels)
+{
+    for (size_t p = 0; p < m; p++) {
+        float min_dist = FLT_MAX;
+        for (int c = 0; c < k; c++) {
+            float d = dist2(points[p], centroids[c]);
+            if (d < min_dist) {
+                min_dist = d;
+                labels[p] = c;
+            }
+        }
+    }
+}
+
+
+// Plain Lloyd iterations for small subsets; without any, the points are
+// still labeled
+static void lloyd(int iteration_n, int k, size_t m, Point* centroids, Point* points, int* labels)
+{
+    if (iteration_n < 1) {
+        label_nearest(k, m, centroids, points, labels);
+        return;
+    }
+
+    double* sum = (double*)malloc(sizeof(double) * 2 * k);
+    size_t* count = (size_t*)malloc(sizeof(size_t) * k);
+
+    for (int i = 0; i < iteration_n; i++) {
+        label_nearest(k, m, centroids, points, labels);
+
+        memset(sum, 0, sizeof(double) * 2 * k);
+        memset(count, 0, sizeof(size_t) * k);
+        for (size_t p = 0; p < m; p++) {
+            sum[labels[p] * 2] += points[p].x;
+            sum[labels[p] * 2 + 1] += points[p].y;
+            count[labels[p]]++;
+        }
+        for (int c = 0; c < k; c++) {
+            if (count[c] > 0) {
+                centroids[c].x = sum[c * 2] / count[c];
+                centroids[c].y = sum[c * 2 + 1] / count[c];
+            }
+        }
+    }
+
+    free(sum);
+    free(count);
+}
+
+
+// k-means++ seeding of k centroids from the subset
+static void seed(int k, size_t m, Point* points, Point* centroids, float* min_dist, unsigned int* rand_state)
+{
+    centroids[0] = points[rand_r(rand_state) % m];
+    for (size_t p = 0; p < m; p++)
+        min_dist[p] = dist2(points[p], centroids[0]);
+
+    for (int c = 1; c < k; c++) {
+        double total = 0.0;
+        for (size_t p = 0; p < m; p++)
+            total += min_dist[p];
+
+        double r = total * rand_r(rand_state) / ((double)RAND_MAX + 1.0);
+        size_t chosen = m - 1;
+        for (size_t p = 0; p < m; p++) {
+            r -= min_dist[p];
+            if (r < 0.0) {
+                chosen = p;
+                break;
+            }
+        }
+
+        centroids[c] = points[chosen];
+        for (size_t p = 0; p < m; p++) {
+            float d = dist2(points[p], centroids[c]);
+            if (d < min_dist[p])
+                min_dist[p] = d;
+        }
+    }
+}
+
+
+// Mean and squared error of the points idx[begin, end)
+static double summarize(Point* data, size_t* idx, size_t begin, size_t end, Point* mean)
+{
+    double sx = 0.0, sy = 0.0, sse = 0.0;
+
+    for (size_t p = begin; p < end; p++) {
+        sx += data[idx[p]].x;
+        sy += data[idx[p]].y;
+    }
+    mean->x = sx / (end - begin);
+    mean->y = sy / (end - begin);
+    for (size_t p = begin; p < end; p++)
+        sse += dist2(data[idx[p]], *mean);
+
+    return sse;
+}
+
+
+int kmeans_tree_lookup(const KmeansTree* tree, Point p, int beam_n)
+{
+    int beam[2][TREE_MAX_BEAM];
+    float next_dist[TREE_MAX_BEAM];
+    int* frontier = beam[0];
+    int* next = beam[1];
+    int frontier_n = 1, best_leaf = 0;
+    float best_dist = FLT_MAX;
+
+    if (beam_n > TREE_MAX_BEAM)
+        beam_n = TREE_MAX_BEAM;
+    frontier[0] = 0;
+    while (frontier_n > 0) {
+        int next_n = 0;
+
+        for (int f = 0; f < frontier_n; f++) {
+            const KmeansNode* v = &tree->nodes[frontier[f]];
+
+            if (v->child_n == 0) {
+                float d = dist2(p, v->centroid);
+                if (d < best_dist) {
+                    best_dist = d;
+                    best_leaf = v->leaf;
+                }
+                continue;
+            }
+
+            // Keep the beam_n children closest to p, sorted by distance
+            for (int c = v->first_child; c < v->first_child + v->child_n; c++) {
+                float d = dist2(p, tree->nodes[c].centroid);
+                int i = next_n < beam_n ? next_n++ : beam_n;
+                while (i > 0 && next_dist[i - 1] > d) {
+                    if (i < beam_n) {
+                        next[i] = next[i - 1];
+                        next_dist[i] = next_dist[i - 1];
+                    }
+                    i--;
+                }
+                if (i < beam_n) {
+                    next[i] = c;
+                    next_dist[i] = d;
+                }
+            }
+        }
+
+        int* t = frontier;
+        frontier = next;
+        next = t;
+        frontier_n = next_n;
+    }
+
+    return best_leaf;
+}
+
+
+void kmeans_tree_free(KmeansTree* tree)
+{
+    free(tree->nodes);
+    free(tree);
+}
+
+
+KmeansTree* kmeans_tree(int iteration_n, int class_n, size_t data_n, Point* centroids, Point* data, int* partitioned,
+    int branch_n, int refine_n, int beam_n)
+{
+    KmeansTree* tree = (KmeansTree*)malloc(sizeof(KmeansTree));
+    size_t* idx = (size_t*)malloc(sizeof(size_t) * data_n);
+    size_t* scratch_idx = (size_t*)malloc(sizeof(size_t) * data_n);
+    Point* sub = (Point*)malloc(sizeof(Point) * data_n);
+    int* labels = (int*)malloc(sizeof(int) * data_n);
+    float* min_dist = (float*)malloc(sizeof(float) * data_n);
+    // Range of idx owned by each node
+    size_t* begin = (size_t*)malloc(sizeof(size_t) * 2 * class_n);
+    size_t* end = (size_t*)malloc(sizeof(size_t) * 2 * class_n);
+    Point* sub_centroids = (Point*)malloc(sizeof(Point) * branch_n);
+    size_t* child_count = (size_t*)malloc(sizeof(size_t) * branch_n);
+    unsigned int rand_state = 1;
+    Heap heap;
+    int leaf_n = 1;
+
+    // A tree with class_n leaves has fewer than 2 * class_n nodes
+    tree->nodes = (KmeansNode*)malloc(sizeof(KmeansNode) * 2 * class_n);
+    heap.entries = (HeapEntry*)malloc(sizeof(HeapEntry) * class_n);
+    heap.n = 0;
+
+    for (size_t p = 0; p < data_n; p++)
+        idx[p] = p;
+    tree->node_n = 1;
+    tree->nodes[0].child_n = 0;
+    tree->nodes[0].first_child = 0;
+    begin[0] = 0;
+    end[0] = data_n;
+    heap_push(&heap, summarize(data, idx, 0, data_n, &tree->nodes[0].centroid), 0);
+
+    while (leaf_n < class_n && heap.n > 0) {
+        HeapEntry top = heap_pop(&heap);
+        int v = top.node;
+        size_t m = end[v] - begin[v];
+        int k = class_n - leaf_n + 1 < branch_n ? class_n - leaf_n + 1 : branch_n;
+        if (top.sse <= 0.0 || m < 2)
+            continue;
+        if ((size_t)k > m)
+            k = m;
+
+        // Split the points of v with a small-k run
+        for (size_t p = 0; p < m; p++)
+            sub[p] = data[idx[begin[v] + p]];
+        seed(k, m, sub, sub_centroids, min_dist, &rand_state);
+        if (m >= TREE_ENGINE_POINTS) {
+            kmeans(iteration_n, k, m, sub_centroids, sub, labels);
+            kmeans_forget(sub);
+        } else {
+            lloyd(iteration_n, k, m, sub_centroids, sub, labels);
+        }
+
+        // Reorder the range of v so each child owns a contiguous part
+        memset(child_count, 0, sizeof(size_t) * k);
+        for (size_t p = 0; p < m; p++)
+            child_count[labels[p]]++;
+        int nonempty = 0;
+        for (int c = 0; c < k; c++)
+            nonempty += child_count[c] > 0;
+        if (nonempty < 2)
+            continue;
+
+        tree->nodes[v].first_child = tree->node_n;
+        tree->nodes[v].child_n = nonempty;
+        size_t offset = begin[v];
+        for (int c = 0; c < k; c++) {
+            if (child_count[c] == 0)
+                continue;
+            int u = tree->node_n++;
+            tree->nodes[u].child_n = 0;
+            tree->nodes[u].first_child = 0;
+            begin[u] = offset;
+            end[u] = offset;
+            offset += child_count[c];
+            // Remember the child of each label in child_count
+            child_count[c] = u;
+        }
+        for (size_t p = 0; p < m; p++)
+            scratch_idx[end[child_count[labels[p]]]++] = idx[begin[v] + p];
+        memcpy(&idx[begin[v]], &scratch_idx[begin[v]], sizeof(size_t) * m);
+
+        for (int u = tree->nodes[v].first_child; u < tree->node_n; u++)
+            heap_push(&heap, summarize(data, idx, begin[u], end[u], &tree->nodes[u].centroid), u);
+        leaf_n += nonempty - 1;
+    }
+
+    // Number the leaves and label their points
+    tree->leaf_n = 0;
+    for (int v = 0; v < tree->node_n; v++) {
+        if (tree->nodes[v].child_n > 0) {
+            tree->nodes[v].leaf = -1;
+            continue;
+        }
+        tree->nodes[v].leaf = tree->leaf_n;
+        centroids[tree->leaf_n++] = tree->nodes[v].centroid;
+        for (size_t p = begin[v]; p < end[v]; p++)
+            partitioned[idx[p]] = tree->nodes[v].leaf;
+    }
+
+    // Refinement: Lloyd iterations where each point only searches the leaves
+    // reached by a beam search, then internal centroids are recomputed bottom up
+    int* leaf_node = (int*)malloc(sizeof(int) * tree->leaf_n);
+    double* sum = (double*)malloc(sizeof(double) * 2 * tree->node_n);
+    size_t* count = (size_t*)malloc(sizeof(size_t) * tree->node_n);
+    for (int v = 0; v < tree->node_n; v++) {
+        if (tree->nodes[v].leaf >= 0)
+            leaf_node[tree->nodes[v].leaf] = v;
+    }
+
+    for (int i = 0; i < refine_n; i++) {
+        for (size_t p = 0; p < data_n; p++)
+            partitioned[p] = kmeans_tree_lookup(tree, data[p], beam_n);
+
+        memset(sum, 0, sizeof(double) * 2 * tree->node_n);
+        memset(count, 0, sizeof(size_t) * tree->node_n);
+        for (size_t p = 0; p < data_n; p++) {
+            int v = leaf_node[partitioned[p]];
+            sum[v * 2] += data[p].x;
+            sum[v * 2 + 1] += data[p].y;
+            count[v]++;
+        }
+
+        // Children always come after their parent
+        for (int v = tree->node_n - 1; v >= 0; v--) {
+            KmeansNode* node = &tree->nodes[v];
+            for (int c = node->first_child; c < node->first_child + node->child_n; c++) {
+                sum[v * 2] += sum[c * 2];
+                sum[v * 2 + 1] += sum[c * 2 + 1];
+                count[v] += count[c];
+            }
+            if (count[v] > 0) {
+                node->centroid.x = sum[v * 2] / count[v];
+                node->centroid.y = sum[v * 2 + 1] / count[v];
+            }
+        }
+    }
+
+    for (int l = 0; l < tree->leaf_n; l++)
+        centroids[l] = tree->nodes[leaf_node[l]].centroid;
+
+    free(leaf_node);
+    free(sum);
+    free(count);
+    free(idx);
+    free(scratch_idx);
+    free(sub);
+    free(labels);
+    free(min_dist);
+    free(begin);
+    free(end);
+    free(sub_centroids);
+    free(child_count);
+    free(heap.entries);
+    return tree;
+}
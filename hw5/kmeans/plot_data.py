@@ -12,6 +12,16 @@ matplotlib.use('AGG')
 import matplotlib.pyplot as plt
 
 DIM = 2
+# Counts that do not fit in 32 bits are written as this mark and a 64-bit count
+LARGE_SIZE_MARK = 0xffffffff
+
+
+
+def read_size(input_f):
+    size = struct.unpack('I', input_f.read(struct.calcsize('I')))[0]
+    if size == LARGE_SIZE_MARK:
+        size = struct.unpack('=Q', input_f.read(struct.calcsize('=Q')))[0]
+    return size
 
 
 
@@ -49,7 +59,7 @@ class DataPlotter:
         
     def read_data(self, file_name):
         with open(file_name, 'rb') as input_f:
-            size = struct.unpack('I', input_f.read(struct.calcsize('I')))[0]
+            size = read_size(input_f)
             data = array.array('f')
             data.fromfile(input_f, size * DIM)
         return size, data
@@ -63,7 +73,7 @@ class PartPlotter(DataPlotter):
     
     def set_color_dist(self):
         with open(self.part_file, 'rb') as part_f:        
-            part_size = struct.unpack('I', part_f.read(struct.calcsize('I')))[0]
+            part_size = read_size(part_f)
             if part_size != self.n_data:
                 print("Partition size dose not match data size")
                 sys.exit()
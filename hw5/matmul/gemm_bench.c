@@ -0,0 +1,311 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "matfile.h"
+#include "prof.h"
+#include "sgemm.h"
+#include "strassen.h"
+
+// Benchmark of every GEMM backend over a sweep of shapes, judged against
+// the roofline of the hardware it runs on. Device kernels run on matrices
+// already in device memory, against measured peaks of the device; the
+// pipeline multiplies host matrices through gemm_opencl, bounded by the
+// host link; the CPU SGEMM is bounded by its theoretical peak and measured
+// memory bandwidth. Bandwidth and arithmetic intensity count the bytes of
+// A, B and C once, the least any implementation moves.
+
+// Options read by mat_mul_opencl.c
+int compare_naive = 0;
+int half_storage = 0;
+int multi_device = 0;
+int pinned_staging = 0;
+int pipeline_depth = 2;
+int use_strassen = 0;
+size_t strassen_crossover = 0;
+
+void engine_init(size_t *global_size, size_t *local_size, int half);
+void engine_release();
+void gemm_opencl(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, float beta, float *C, size_t ldc);
+int bench_kernels(const char **names);
+void bench_release();
+int bench_kernel(int kernel, size_t m, size_t n, size_t k, int warmup, int reps, double *times);
+void bench_peak(char *name, size_t name_len, double *gflops, double *device_gbps, double *link_gbps);
+
+#define MAX_SHAPES 32
+#define MAX_REPS 100
+#define MAX_KERNELS 8
+// Bytes of each buffer of the CPU bandwidth test
+#define CPU_COPY_BYTES ((size_t)256 << 20)
+
+// M x N x K: square, tall and skinny, and sizes that are not multiples of
+// any block or tile
+static const size_t default_shapes[][3] = {
+    { 256, 256, 256 }, { 512, 512, 512 }, { 1024, 1024, 1024 },
+    { 2048, 2048, 2048 }, { 4096, 4096, 4096 },
+    { 8192, 64, 1024 }, { 64, 8192, 1024 }, { 4096, 4096, 64 }, { 64, 64, 65536 },
+    { 127, 129, 131 }, { 1000, 1000, 1000 }, { 1023, 1025, 1027 }, { 3001, 1537, 769 },
+};
+
+size_t shapes[MAX_SHAPES][3];
+int shape_n = 0;
+int warmup = 1;
+int reps = 5;
+const char *backends = "naive,tiled,tuned,pipeline,cpu";
+
+struct roof {
+    double gflops, gbps;
+};
+
+void print_help(const char* prog_name)
+{
+    printf("Usage: %s [-h] [-w warmups] [-r repetitions] [-b backends] [-s MxNxK]...\n", prog_name);
+    printf("\n");
+    printf("OPTIONS\n");
+    printf("  -w : untimed runs before each measurement (default 1).\n");
+    printf("  -r : timed runs of each measurement (default 5).\n");
+    printf("  -b : comma-separated backends out of naive, tiled, tuned, pipeline\n");
+    printf("       and cpu (default all).\n");
+    printf("  -s : benchmark this shape instead of the default sweep; repeatable.\n");
+    printf("  -h : print this page.\n");
+}
+
+void parse_opt(int argc, char** argv)
+{
+    int opt;
+
+    while( (opt = getopt(argc, argv, "w:r:b:s:h")) != -1 )
+    {
+        switch(opt)
+        {
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+
+            case 'r':
+                reps = atoi(optarg);
+                if (reps < 1 || reps > MAX_REPS) {
+                    printf("Repetitions must be 1 to %d\n", MAX_REPS);
+                    exit(1);
+                }
+                break;
+
+            case 'b':
+                backends = optarg;
+                break;
+
+            case 's':
+                if (shape_n == MAX_SHAPES || sscanf(optarg, "%zux%zux%zu",
+                        &shapes[shape_n][0], &shapes[shape_n][1], &shapes[shape_n][2]) != 3) {
+                    printf("Bad shape %s\n", optarg);
+                    exit(1);
+                }
+                ++shape_n;
+                break;
+
+            case 'h':
+            default:
+                print_help(argv[0]);
+                exit(0);
+                break;
+        }
+    }
+}
+
+// Whether backend is in the -b list; a tiled kernel is named "tiled 8x8"
+int selected(const char *backend)
+{
+    size_t len = strcspn(backend, " ");
+    const char *s = backends;
+    while (*s != '\0') {
+        size_t n = strcspn(s, ",");
+        if (n == len && strncmp(s, backend, len) == 0)
+            return 1;
+        s += n;
+        if (*s == ',')
+            ++s;
+    }
+    return 0;
+}
+
+static int time_cmp(const void *x, const void *y)
+{
+    double a = *(const double*)x, b = *(const double*)y;
+    return a < b ? -1 : a > b;
+}
+
+// One line of the table for reps times of backend on shape
+void report(const char *backend, const size_t *shape, double *times, const struct roof *roof)
+{
+    qsort(times, reps, sizeof(double), time_cmp);
+    double t = times[reps / 2];
+    double flop = 2.0 * shape[0] * shape[1] * shape[2];
+    double bytes = sizeof(float) * ((double)shape[0] * shape[2] + (double)shape[2] * shape[1]
+        + (double)shape[0] * shape[1]);
+    double intensity = flop / bytes;
+    double gflops = flop / t * 1e-9;
+    // Without a known compute peak only the bandwidth bounds
+    double bound = intensity * roof->gbps;
+    int compute = roof->gflops > 0 && roof->gflops < bound;
+    if (compute)
+        bound = roof->gflops;
+
+    printf("%5zu x %5zu x %5zu  %-12s %9.3lf %9.3lf %9.1lf %8.1lf %7.1lf %9.1lf %-7s %6.1lf%%\n",
+        shape[0], shape[1], shape[2], backend, t * 1e3, times[0] * 1e3, gflops, bytes / t * 1e-9,
+        intensity, bound, compute ? "compute" : "memory", gflops / bound * 100);
+}
+
+void print_header()
+{
+    printf("%-21s  %-12s %9s %9s %9s %8s %7s %9s %-7s %7s\n", "M x N x K", "backend",
+        "ms", "best ms", "GFLOPS", "GB/s", "flop/B", "roof", "bound", "of roof");
+}
+
+struct copy_job {
+    char *dst;
+    const char *src;
+    size_t bytes;
+};
+
+static void *run_copy(void *arg)
+{
+    struct copy_job *job = (struct copy_job*)arg;
+    memcpy(job->dst, job->src, job->bytes);
+    return NULL;
+}
+
+// Host memory bandwidth of a copy split over the SGEMM threads, best of
+// three after a warm-up
+double cpu_bandwidth()
+{
+    int thread_n = sgemm_cpu_threads();
+    char *src = (char*)huge_alloc(CPU_COPY_BYTES), *dst = (char*)huge_alloc(CPU_COPY_BYTES);
+    struct copy_job *jobs = (struct copy_job*)malloc(sizeof(struct copy_job) * thread_n);
+    pthread_t *threads = (pthread_t*)malloc(sizeof(pthread_t) * thread_n);
+    double best = 1e30;
+
+    if (src == NULL || dst == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    memset(src, 1, CPU_COPY_BYTES);
+    for (int r = 0; r < 4; ++r) {
+        uint64_t start = prof_now();
+        for (int t = 0; t < thread_n; ++t) {
+            size_t first = CPU_COPY_BYTES * t / thread_n, last = CPU_COPY_BYTES * (t + 1) / thread_n;
+            jobs[t].dst = dst + first;
+            jobs[t].src = src + first;
+            jobs[t].bytes = last - first;
+            if (t > 0)
+                pthread_create(&threads[t], NULL, run_copy, &jobs[t]);
+        }
+        run_copy(&jobs[0]);
+        for (int t = 1; t < thread_n; ++t)
+            pthread_join(threads[t], NULL);
+        double sec = (prof_now() - start) * 1e-9;
+        if (r > 0 && sec < best)
+            best = sec;
+    }
+
+    free(jobs);
+    free(threads);
+    huge_free(src, CPU_COPY_BYTES);
+    huge_free(dst, CPU_COPY_BYTES);
+    return 2.0 * CPU_COPY_BYTES / best * 1e-9;
+}
+
+// Run gemm on shape from host memory, warm-ups first
+void time_host(gemm_fn gemm, const size_t *shape, double *times)
+{
+    size_t m = shape[0], n = shape[1], k = shape[2];
+    float *A = (float*)huge_alloc(sizeof(float) * m * k);
+    float *B = (float*)huge_alloc(sizeof(float) * k * n);
+    float *C = (float*)huge_alloc(sizeof(float) * m * n);
+
+    if (A == NULL || B == NULL || C == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < m * k; ++i)
+        A[i] = (float)(i % 17) * 0.125f;
+    for (size_t i = 0; i < k * n; ++i)
+        B[i] = (float)(i % 13) * 0.25f;
+    for (int r = 0; r < warmup + reps; ++r) {
+        uint64_t start = prof_now();
+        gemm(m, n, k, A, k, B, n, 0.0f, C, n);
+        if (r >= warmup)
+            times[r - warmup] = (prof_now() - start) * 1e-9;
+    }
+
+    huge_free(A, sizeof(float) * m * k);
+    huge_free(B, sizeof(float) * k * n);
+    huge_free(C, sizeof(float) * m * n);
+}
+
+int main(int argc, char** argv)
+{
+    parse_opt(argc, argv);
+    if (shape_n == 0) {
+        shape_n = sizeof(default_shapes) / sizeof(default_shapes[0]);
+        memcpy(shapes, default_shapes, sizeof(default_shapes));
+    }
+
+    double times[MAX_REPS];
+    const char *names[MAX_KERNELS];
+    int kernel_n = 0;
+    struct roof device_roof, link_roof, cpu_roof;
+    int device = selected("naive") || selected("tiled") || selected("tuned") || selected("pipeline");
+
+    // The engine takes its blocks and tiles from the tuning database, as
+    // mat_mul does
+    if (device) {
+        size_t global_size[3] = {4096, 4096, 4096};
+        size_t local_size[2] = {16, 16};
+        char name[128];
+        engine_init(global_size, local_size, 0);
+        kernel_n = bench_kernels(names);
+        bench_peak(name, sizeof(name), &device_roof.gflops, &device_roof.gbps, &link_roof.gbps);
+        link_roof.gflops = device_roof.gflops;
+        printf("%s : %.1lf GFLOPS, %.1lf GB/s device memory, %.1lf GB/s host link (measured)\n",
+            name, device_roof.gflops, device_roof.gbps, link_roof.gbps);
+    }
+    if (selected("cpu")) {
+        cpu_roof.gflops = sgemm_cpu_peak();
+        cpu_roof.gbps = cpu_bandwidth();
+        printf("CPU (%s, %d threads) : %.1lf GFLOPS (theoretical), %.1lf GB/s memory (measured)\n",
+            sgemm_cpu_isa(), sgemm_cpu_threads(), cpu_roof.gflops, cpu_roof.gbps);
+    }
+    printf("Times are the median and best of %d runs after %d warm-ups\n\n", reps, warmup);
+    print_header();
+
+    for (int s = 0; s < shape_n; ++s) {
+        const size_t *shape = shapes[s];
+        for (int k = 0; k < kernel_n; ++k) {
+            if (!selected(names[k]))
+                continue;
+            if (bench_kernel(k, shape[0], shape[1], shape[2], warmup, reps, times))
+                report(names[k], shape, times, &device_roof);
+            else
+                printf("%5zu x %5zu x %5zu  %-12s does not fit the device\n",
+                    shape[0], shape[1], shape[2], names[k]);
+        }
+        if (selected("pipeline")) {
+            time_host(gemm_opencl, shape, times);
+            report("pipeline", shape, times, &link_roof);
+        }
+        if (selected("cpu")) {
+            time_host(sgemm_cpu, shape, times);
+            report("cpu", shape, times, &cpu_roof);
+        }
+    }
+
+    if (device) {
+        bench_release();
+        engine_release();
+    }
+    return 0;
+}
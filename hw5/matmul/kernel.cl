@@ -1,9 +1,147 @@
-__kernel void mat_mul(__global float *A, __global float *B, __global float *C,
-    ulong COL_A, ulong COL_B) {
+// A and B are stored as float by default. With -DHALF_STORAGE they are
+// stored as half, which halves their transfers; products are still
+// accumulated in fp32 and C stays float.
+#ifdef HALF_STORAGE
+typedef half elem_t;
+#define LOAD(P, i) vload_half(i, P)
+#define LOAD4(P, i) vload_half4(0, (P) + (i))
+#else
+typedef float elem_t;
+#define LOAD(P, i) (P)[i]
+#define LOAD4(P, i) vload4(0, (P) + (i))
+#endif
+
+// C = A * B + BETA * C for a ROW_A x COL_B block of C. With BETA = 0, C is
+// not read, so it may hold garbage. The NDRange may be rounded up past the
+// block; those work-items do nothing.
+__kernel void mat_mul(__global elem_t *A, __global elem_t *B, __global float *C,
+    ulong ROW_A, ulong COL_A, ulong COL_B, float BETA) {
     ulong i = get_global_id(0);
     ulong j = get_global_id(1);
+    if (i >= COL_B || j >= ROW_A)
+        return;
     float s = 0.0f;
     for (ulong k = 0; k < COL_A; ++k)
-        s += A[k + j * COL_A] * B[i + k * COL_B];
-    C[i + j * COL_B] = s;
+        s += LOAD(A, k + j * COL_A) * LOAD(B, i + k * COL_B);
+    C[i + j * COL_B] = BETA == 0.0f ? s : mad(BETA, C[i + j * COL_B], s);
+}
+
+// Tile sizes of mat_mul_tiled, set with -D when the program is built.
+// A work-group computes a TS_M x TS_N tile of C, stepping through K by TS_K;
+// each work-item computes WPT_M x WPT_N outputs held in registers. TS_K and
+// TS_N must be multiples of 4 for the vector loads.
+#ifndef TS_M
+#define TS_M 64
+#endif
+#ifndef TS_N
+#define TS_N 64
+#endif
+#ifndef TS_K
+#define TS_K 16
+#endif
+#ifndef WPT_M
+#define WPT_M 4
+#endif
+#ifndef WPT_N
+#define WPT_N 4
+#endif
+#define RTS_M (TS_M / WPT_M)
+#define RTS_N (TS_N / WPT_N)
+
+// Same as mat_mul, launched on one (RTS_N, RTS_M) work-group per TS_M x TS_N
+// tile of C, rounded up. The outputs of a work-item are RTS_M rows and RTS_N
+// columns apart, so neighbouring work-items touch neighbouring addresses.
+// Tiles that hang over an edge of the block, in M, N or K, are loaded
+// element by element with zeros past the edge and only store what is
+// inside; all others take the vector loads.
+__kernel __attribute__((reqd_work_group_size(RTS_N, RTS_M, 1)))
+void mat_mul_tiled(__global elem_t *A, __global elem_t *B, __global float *C,
+    ulong ROW_A, ulong COL_A, ulong COL_B, float BETA) {
+    const int tx = get_local_id(0), ty = get_local_id(1);
+    const int tid = ty * RTS_N + tx;
+    const ulong row0 = get_group_id(1) * TS_M, col0 = get_group_id(0) * TS_N;
+    const bool full_m = row0 + TS_M <= ROW_A, full_n = col0 + TS_N <= COL_B;
+
+    // A is stored transposed so that both tiles are read along a row
+    __local float As[TS_K][TS_M];
+    __local float Bs[TS_K][TS_N];
+
+    float acc[WPT_M][WPT_N];
+    for (int wm = 0; wm < WPT_M; ++wm)
+        for (int wn = 0; wn < WPT_N; ++wn)
+            acc[wm][wn] = 0.0f;
+
+    for (ulong t = 0; t < COL_A; t += TS_K) {
+        const bool full_k = t + TS_K <= COL_A;
+        if (full_m && full_k) {
+            for (int l = tid; l < TS_M * TS_K / 4; l += RTS_M * RTS_N) {
+                int r = l / (TS_K / 4), c = l % (TS_K / 4) * 4;
+                float4 v = LOAD4(A, (row0 + r) * COL_A + t + c);
+                As[c][r] = v.x;
+                As[c + 1][r] = v.y;
+                As[c + 2][r] = v.z;
+                As[c + 3][r] = v.w;
+            }
+        } else {
+            for (int l = tid; l < TS_M * TS_K; l += RTS_M * RTS_N) {
+                int r = l / TS_K, c = l % TS_K;
+                As[c][r] = row0 + r < ROW_A && t + c < COL_A ? LOAD(A, (row0 + r) * COL_A + t + c) : 0.0f;
+            }
+        }
+        if (full_n && full_k) {
+            for (int l = tid; l < TS_K * TS_N / 4; l += RTS_M * RTS_N) {
+                int r = l / (TS_N / 4), c = l % (TS_N / 4) * 4;
+                vstore4(LOAD4(B, (t + r) * COL_B + col0 + c), 0, &Bs[r][c]);
+            }
+        } else {
+            for (int l = tid; l < TS_K * TS_N; l += RTS_M * RTS_N) {
+                int r = l / TS_N, c = l % TS_N;
+                Bs[r][c] = t + r < COL_A && col0 + c < COL_B ? LOAD(B, (t + r) * COL_B + col0 + c) : 0.0f;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int k = 0; k < TS_K; ++k) {
+            float b[WPT_N];
+            for (int wn = 0; wn < WPT_N; ++wn)
+                b[wn] = Bs[k][tx + wn * RTS_N];
+            for (int wm = 0; wm < WPT_M; ++wm) {
+                float a = As[k][ty + wm * RTS_M];
+                for (int wn = 0; wn < WPT_N; ++wn)
+                    acc[wm][wn] = mad(a, b[wn], acc[wm][wn]);
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (int wm = 0; wm < WPT_M; ++wm) {
+        for (int wn = 0; wn < WPT_N; ++wn) {
+            ulong row = row0 + ty + wm * RTS_M, col = col0 + tx + wn * RTS_N;
+            if (row >= ROW_A || col >= COL_B)
+                continue;
+            __global float *c = &C[row * COL_B + col];
+            *c = BETA == 0.0f ? acc[wm][wn] : mad(BETA, *c, acc[wm][wn]);
+        }
+    }
+}
+
+// Peaks of the device for the roofline of gemm_bench. Every work-item of
+// peak_flops runs ITERS rounds of four independent float8 mad chains, 64
+// flops a round; out only keeps the compiler from dropping them.
+__kernel void peak_flops(__global float *out, float x, int ITERS) {
+    float8 a = (float8)(x) + (float)get_global_id(0), b = a + 1.0f, c = a + 2.0f, d = a + 3.0f;
+    const float8 m = (float8)(0.999f), s = (float8)(0.001f);
+    for (int i = 0; i < ITERS; ++i) {
+        a = mad(a, m, s);
+        b = mad(b, m, s);
+        c = mad(c, m, s);
+        d = mad(d, m, s);
+    }
+    float8 r = a + b + c + d;
+    out[get_global_id(0)] = r.s0 + r.s1 + r.s2 + r.s3 + r.s4 + r.s5 + r.s6 + r.s7;
+}
+
+// Reads and writes 16 bytes a work-item
+__kernel void peak_copy(__global const float4 *in, __global float4 *out) {
+    out[get_global_id(0)] = in[get_global_id(0)];
 }
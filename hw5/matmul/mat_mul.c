@@ -1,47 +1,62 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <limits.h>
 #include <stdio.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include "timers.h"
+#include "matfile.h"
+#include "ooc.h"
+#include "prof.h"
+#include "verify.h"
 
 size_t const N = 10000;
 
 int print_matrix = 0;
 int validation = 0;
+size_t spot_samples = 0;
+int verify_rounds = 3;
+double verify_tol = 0.0;
+int compare_naive = 0;
+int half_storage = 0;
+int multi_device = 0;
+int pinned_staging = 0;
+int pipeline_depth = 2;
+int tune = 0;
+int use_strassen = 0;
+size_t strassen_crossover = 0;
+const char *a_path = NULL;
+const char *b_path = NULL;
+const char *c_path = NULL;
+int out_of_core = 0;
+size_t ooc_budget = 0;
 
 void mat_mul(float *a, float *b, float *c,
-    size_t *dim, size_t *global_size, size_t *local_size);
+    size_t *dim, size_t *ld, size_t *global_size, size_t *local_size);
+void mat_mul_tune(size_t *global_size, size_t *local_size);
+int mat_mul_out_of_core(struct matfile *a, struct matfile *b, struct matfile *c, size_t budget,
+    size_t *global_size, size_t *local_size);
 
 /************************** DO NOT TOUCH BELOW HERE ******************************/
 
-void check_mat_mul(float *a, float *b, float *c, size_t *dim)
+void check_mat_mul(float *a, float *b, float *c, size_t *dim, size_t *ld)
 {
-    int i, j, k;
-    float sum;
-    int validated = 1;
+    int validated;
 
     printf("Validating the result..\n");
 
-    // C = AB
-    for( i = 0; i < N; i++ )
-    {
-        for( j = 0; j < N; j++ )
-        {
-            sum = 0;
-            for( k = 0; k < N; k++ )
-            {
-                sum += a[i * dim[2] + k] * b[k * dim[0] + j];
-            }
-
-            if( c[i * dim[0] + j] != sum )
-            {
-                printf("c[%d][%d] is differ(value=%lf correct_value=%lf)!!\n",
-                    i, j, c[i * dim[0] + j], sum );
-                validated = 0;
-            }
-        }
-    }
+    // C = AB, checked with Freivalds' randomized test or on sampled entries.
+    // Half inputs round at 2^-11, which a row of Freivalds' test adds up
+    double tol = verify_tol > 0.0 ? verify_tol : half_storage ? 1e-2 : 1e-4;
+    prof_begin("validation");
+    if( spot_samples > 0 )
+        validated = verify_sampled(dim[1], dim[0], dim[2], a, ld[0], b, ld[1], c, ld[2],
+            spot_samples, tol);
+    else
+        validated = verify_freivalds(dim[1], dim[0], dim[2], a, ld[0], b, ld[1], c, ld[2],
+            verify_rounds, tol);
+    printf("Validation time : %lf sec\n", prof_end());
 
     printf("Validation : ");
     if( validated )
@@ -50,15 +65,15 @@ void check_mat_mul(float *a, float *b, float *c, size_t *dim)
         printf("FAILED.\n");
 }
 
-void print_mat(float *mat, size_t *dim)
+void print_mat(float *mat, size_t rows, size_t cols, size_t ld)
 {
-    int i, j;
+    size_t i, j;
 
-    for( i = 0; i < N; i++ )
+    for( i = 0; i < rows; i++ )
     {
-        for( j = 0; j < N; j++ )
+        for( j = 0; j < cols; j++ )
         {
-            printf("%8.2lf ", mat[i * dim[0] + j]);
+            printf("%8.2lf ", mat[i * ld + j]);
         }
         printf("\n");
     }
@@ -66,11 +81,27 @@ void print_mat(float *mat, size_t *dim)
 
 void print_help(const char* prog_name)
 {
-    printf("Usage: %s [-pvh]\n", prog_name );
+    printf("Usage: %s [-pvnHPmTh] [-V samples] [-R rounds] [-E tolerance] [-D depth] [-S crossover]\n", prog_name );
+    printf("       [-A file -B file] [-C file] [-O budget]\n");
     printf("\n");
     printf("OPTIONS\n");
     printf("  -p : print matrix data.\n");
-    printf("  -v : validate matrix multiplication.\n");
+    printf("  -v : validate matrix multiplication with Freivalds' test.\n");
+    printf("  -V : validate samples random entries instead.\n");
+    printf("  -R : rounds of Freivalds' test (default 3).\n");
+    printf("  -E : relative tolerance of validation (default 1e-4, 1e-2 under -H).\n");
+    printf("  -n : compare with the naive kernel, and with fp32 storage under -H.\n");
+    printf("  -H : store A and B as half on the device, accumulating in fp32;\n");
+    printf("       fp32 if a value is beyond the range of half.\n");
+    printf("  -P : copy float blocks of A and B into pinned buffers to upload.\n");
+    printf("  -D : blocks and tiles in flight on the device (default 2).\n");
+    printf("  -m : spread output tiles over every OpenCL device.\n");
+    printf("  -T : tune the kernel for this device and exit.\n");
+    printf("  -S : Strassen-Winograd down to crossover (0: tuned).\n");
+    printf("  -A, -B : multiply the matrices in these files (see matfile.h).\n");
+    printf("  -C : write the product to this file.\n");
+    printf("  -O : stream -A, -B and -C through budget MB of host memory (0: half\n");
+    printf("       of it), for matrices that do not fit; no Strassen-Winograd.\n");
     printf("  -h : print this page.\n");
 }
 
@@ -78,7 +109,7 @@ void parse_opt(int argc, char** argv)
 {
     int opt;
 
-    while( (opt = getopt(argc, argv, "pvhikjs:")) != -1 )
+    while( (opt = getopt(argc, argv, "pvV:R:E:nHPD:mTS:A:B:C:O:hikjs:")) != -1 )
     {
         switch(opt)
         {
@@ -92,6 +123,90 @@ void parse_opt(int argc, char** argv)
                 validation = 1;
                 break;
 
+            case 'V':
+                // spot-check instead of Freivalds' test
+                validation = 1;
+                spot_samples = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'R':
+            {
+                char *end;
+                long rounds = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || rounds < 1 || rounds > INT_MAX) {
+                    fprintf(stderr, "-R needs a number of rounds of at least 1\n");
+                    exit(1);
+                }
+                verify_rounds = (int)rounds;
+                break;
+            }
+
+            case 'E':
+            {
+                char *end;
+                verify_tol = strtod(optarg, &end);
+                if (end == optarg || *end != '\0' || !(verify_tol > 0.0)) {
+                    fprintf(stderr, "-E needs a positive tolerance\n");
+                    exit(1);
+                }
+                break;
+            }
+
+            case 'n':
+                // time the naive kernel too
+                compare_naive = 1;
+                break;
+
+            case 'H':
+                // half the bytes of every A and B upload
+                half_storage = 1;
+                break;
+
+            case 'P':
+                // uploads run from page-locked memory, as half ones do
+                pinned_staging = 1;
+                break;
+
+            case 'D':
+                // buffers of each kind the pipeline cycles through
+                pipeline_depth = atoi(optarg);
+                break;
+
+            case 'm':
+                // every device takes tiles, stealing once out of its own
+                multi_device = 1;
+                break;
+
+            case 'T':
+                // store the fastest launch configuration
+                tune = 1;
+                break;
+
+            case 'S':
+                // recurse while every dimension is at least the crossover
+                use_strassen = 1;
+                strassen_crossover = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'A':
+                a_path = optarg;
+                break;
+
+            case 'B':
+                b_path = optarg;
+                break;
+
+            case 'C':
+                // mapped, so the product lands in the file as it is read back
+                c_path = optarg;
+                break;
+
+            case 'O':
+                // out-of-core, with a budget in MB
+                out_of_core = 1;
+                ooc_budget = strtoul(optarg, NULL, 10) << 20;
+                break;
+
             case 'h':
             default:
                 print_help(argv[0]);
@@ -109,40 +224,141 @@ int main(int argc, char** argv)
     float *a, *b, *c;
     size_t global_size[3] = {4096, 4096, 4096};
     size_t local_size[2] = {16, 16};
+    if (tune) {
+        mat_mul_tune(global_size, local_size);
+        return 0;
+    }
     size_t dim[3] = {N, N, N};
-    for (int i = 0; i < 3; ++i)
-        dim[i] = (dim[i] + global_size[i] - 1) / global_size[i] * global_size[i];
-    a = (float*)calloc(dim[1] * dim[2], sizeof(float));
-    b = (float*)calloc(dim[2] * dim[0], sizeof(float));
-    c = (float*)calloc(dim[1] * dim[0], sizeof(float));
-    float k = 0;
-    for (int i = 0; i < N; ++i)
-        for (int j = 0; j < N; ++j) {
-            a[i * dim[0] + j] = b[i * dim[0] + j] = k;
-            k += 1.f;
+    size_t ld[3] = {N, N, N};
+    struct matfile fa, fb, fc;
+
+    // Out of core, the files are only mapped afterwards to be validated,
+    // which streams them through the page cache
+    if (out_of_core) {
+        if (a_path == NULL || b_path == NULL || c_path == NULL) {
+            fprintf(stderr, "-O needs -A, -B and -C\n");
+            exit(1);
         }
+        if (!matfile_open_stream(&fa, a_path) || !matfile_open_stream(&fb, b_path))
+            exit(1);
+        if (fa.header.cols != fb.header.rows) {
+            fprintf(stderr, "A is %llu x %llu and B is %llu x %llu\n",
+                (unsigned long long)fa.header.rows, (unsigned long long)fa.header.cols,
+                (unsigned long long)fb.header.rows, (unsigned long long)fb.header.cols);
+            exit(1);
+        }
+        if (!matfile_create_stream(&fc, c_path, fa.header.rows, fb.header.cols))
+            exit(1);
 
-    timer_start(1);
-    mat_mul(a, b, c, dim, global_size, local_size);
-    timer_stop(1);
+        prof_begin("mat_mul");
+        int ok = mat_mul_out_of_core(&fa, &fb, &fc, ooc_budget > 0 ? ooc_budget : ooc_default_budget(),
+            global_size, local_size);
+        printf("Time elapsed : %lf sec\n", prof_end());
+        matfile_close(&fa);
+        matfile_close(&fb);
+        matfile_close(&fc);
+        if (!ok)
+            exit(1);
 
-    printf("Time elapsed : %lf sec\n", timer_read(1));
+        if( validation )
+        {
+            a = matfile_open(&fa, a_path);
+            b = matfile_open(&fb, b_path);
+            c = matfile_open(&fc, c_path);
+            if (a == NULL || b == NULL || c == NULL)
+                exit(1);
+            dim[0] = fb.header.cols;
+            dim[1] = fa.header.rows;
+            dim[2] = fa.header.cols;
+            ld[0] = fa.header.ld;
+            ld[1] = fb.header.ld;
+            ld[2] = fc.header.ld;
+            check_mat_mul(a, b, c, dim, ld);
+            matfile_close(&fa);
+            matfile_close(&fb);
+            matfile_close(&fc);
+        }
+        return 0;
+    }
+    if (a_path != NULL || b_path != NULL) {
+        // Inputs are mapped from their files, read-only
+        if (a_path == NULL || b_path == NULL) {
+            fprintf(stderr, "-A and -B go together\n");
+            exit(1);
+        }
+        a = matfile_open(&fa, a_path);
+        b = matfile_open(&fb, b_path);
+        if (a == NULL || b == NULL)
+            exit(1);
+        if (fa.header.cols != fb.header.rows) {
+            fprintf(stderr, "A is %llu x %llu and B is %llu x %llu\n",
+                (unsigned long long)fa.header.rows, (unsigned long long)fa.header.cols,
+                (unsigned long long)fb.header.rows, (unsigned long long)fb.header.cols);
+            exit(1);
+        }
+        dim[0] = fb.header.cols;
+        dim[1] = fa.header.rows;
+        dim[2] = fa.header.cols;
+        ld[0] = fa.header.ld;
+        ld[1] = fb.header.ld;
+        ld[2] = dim[0];
+    } else {
+        a = (float*)huge_alloc(sizeof(float) * dim[1] * dim[2]);
+        b = (float*)huge_alloc(sizeof(float) * dim[2] * dim[0]);
+        if (a == NULL || b == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        float k = 0;
+        for (int i = 0; i < N; ++i)
+            for (int j = 0; j < N; ++j) {
+                a[i * dim[0] + j] = b[i * dim[0] + j] = k;
+                k += 1.f;
+            }
+    }
+    if (c_path != NULL) {
+        c = matfile_create(&fc, c_path, dim[1], dim[0]);
+        if (c == NULL)
+            exit(1);
+    } else {
+        c = (float*)huge_alloc(sizeof(float) * dim[1] * dim[0]);
+        if (c == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    prof_begin("mat_mul");
+    mat_mul(a, b, c, dim, ld, global_size, local_size);
+    printf("Time elapsed : %lf sec\n", prof_end());
 
 
     if( validation )
-        check_mat_mul(a, b, c, dim);
+        check_mat_mul(a, b, c, dim, ld);
 
     if( print_matrix )
     {
         printf("MATRIX A: \n");
-        print_mat(a, dim);
+        print_mat(a, dim[1], dim[2], ld[0]);
 
         printf("MATRIX B: \n");
-        print_mat(b, dim);
+        print_mat(b, dim[2], dim[0], ld[1]);
 
         printf("MATRIX C: \n");
-        print_mat(c, dim);
+        print_mat(c, dim[1], dim[0], ld[2]);
     }
 
+    if (a_path != NULL) {
+        matfile_close(&fa);
+        matfile_close(&fb);
+    } else {
+        huge_free(a, sizeof(float) * dim[1] * dim[2]);
+        huge_free(b, sizeof(float) * dim[2] * dim[0]);
+    }
+    if (c_path != NULL)
+        matfile_close(&fc);
+    else
+        huge_free(c, sizeof(float) * dim[1] * dim[0]);
+
     return 0;
 }
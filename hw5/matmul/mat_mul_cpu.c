@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include "ooc.h"
+#include "prof.h"
+#include "sgemm.h"
+#include "strassen.h"
+
+// Crossover when -S does not give one; see mat_mul -T
+#define STRASSEN_CROSSOVER 4096
+
+extern int compare_naive;
+extern int use_strassen;
+extern size_t strassen_crossover;
+
+void mat_mul(float *a, float *b, float *c,
+    size_t *dim, size_t *ld, size_t *global_size, size_t *local_size)
+{
+    if (use_strassen) {
+        size_t crossover = strassen_crossover > 0 ? strassen_crossover : STRASSEN_CROSSOVER;
+        strassen_mul(dim[1], dim[0], dim[2], a, ld[0], b, ld[1], c, ld[2],
+            crossover, sgemm_cpu, compare_naive);
+        return;
+    }
+
+    prof_begin("sgemm_cpu");
+    sgemm_cpu(dim[1], dim[0], dim[2], a, ld[0], b, ld[1], 0.0f, c, ld[2]);
+    double t = prof_end();
+
+    double gflops = 2.0 * dim[0] * dim[1] * dim[2] / t * 1e-9;
+    double peak = sgemm_cpu_peak();
+    printf("CPU SGEMM (%s, %d threads) : %.2lf GFLOPS", sgemm_cpu_isa(), sgemm_cpu_threads(), gflops);
+    if (peak > 0)
+        printf(", %.1lf%% of %.1lf GFLOPS peak", gflops / peak * 100, peak);
+    printf("\n");
+}
+
+int mat_mul_out_of_core(struct matfile *a, struct matfile *b, struct matfile *c, size_t budget,
+    size_t *global_size, size_t *local_size)
+{
+    return gemm_out_of_core(sgemm_cpu, a, b, c, budget);
+}
+
+// There is no tuning database without a device, so the crossover is only
+// printed, to be passed with -S
+void mat_mul_tune(size_t *global_size, size_t *local_size)
+{
+    size_t crossover = strassen_tune(sgemm_cpu, 2 * global_size[0]);
+    printf("Strassen-Winograd crossover : %zu\n", crossover);
+}
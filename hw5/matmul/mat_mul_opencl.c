@@ -1,7 +1,14 @@
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "timers.h"
+#include "ooc.h"
+#include "pipeline.h"
+#include "prof.h"
+#include "stage_pool.h"
+#include "tune_db.h"
+#include "strassen.h"
 #include <CL/cl.h>
 
 #define CHECK_ERROR(err) \
@@ -33,34 +40,123 @@ char *get_source_code(const char *file_name, size_t *len) {
   return source_code;
 }
 
-void in2buf(float *in, float *buf, size_t n, size_t m, size_t l, int sx, int sy) {
-    for (int x = 0; x < n; ++x)
-        memcpy(&buf[x * m], &in[(sx + x) * l + sy], sizeof(float) * m);
-}
+// Kernel variants, best first. Tiled ones are built with their tile sizes
+// as -D options; see kernel.cl.
+struct variant {
+    const char *name;
+    int ts_m, ts_n, ts_k;   // C tile of a work-group and K step
+    int wpt_m, wpt_n;       // C outputs of a work-item
+};
 
-void mat_mul(float *a, float *b, float *c,
-    size_t *dim, size_t *global_size, size_t *local_size) {
-    cl_int err;
+static const struct variant variants[] = {
+    { "tiled 8x8", 128, 128, 16, 8, 8 },
+    { "tiled 4x4", 64, 64, 16, 4, 4 },
+    { "tiled 2x2", 32, 32, 16, 2, 2 },
+};
 
-    cl_platform_id platform;
-    err = clGetPlatformIDs(1, &platform, NULL);
-    CHECK_ERROR(err);
+// Crossover when neither -S nor the tuning database gives one
+#define STRASSEN_CROSSOVER 4096
 
-    cl_device_id device;
-    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
-    CHECK_ERROR(err);
+extern int compare_naive;
+extern int half_storage;
+extern int multi_device;
+extern int pinned_staging;
+extern int pipeline_depth;
+extern int use_strassen;
+extern size_t strassen_crossover;
 
-    cl_context context;
-    context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-    CHECK_ERROR(err);
+// Whether the tiles of t fit the device
+int variant_fits(cl_device_id device, const struct variant *t) {
+    cl_int err;
+    cl_ulong local_mem;
+    size_t max_group;
 
-    cl_command_queue queueIO;
-    queueIO = clCreateCommandQueue(context, device, 0, &err);
+    err = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
     CHECK_ERROR(err);
-    cl_command_queue queueSM;
-    queueSM = clCreateCommandQueue(context, device, 0, &err);
+    err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
     CHECK_ERROR(err);
 
+    if (t->ts_m % t->wpt_m != 0 || t->ts_n % t->wpt_n != 0 || t->ts_n % 4 != 0 || t->ts_k % 4 != 0)
+        return 0;
+    if (sizeof(float) * t->ts_k * (t->ts_m + t->ts_n) > local_mem)
+        return 0;
+    if ((size_t)(t->ts_m / t->wpt_m) * (t->ts_n / t->wpt_n) > max_group)
+        return 0;
+    return 1;
+}
+
+// Pick the first variant that fits, or NULL for the naive kernel
+const struct variant *pick_variant(cl_device_id device) {
+    for (int v = 0; v < sizeof(variants) / sizeof(variants[0]); ++v) {
+        if (variant_fits(device, &variants[v]))
+            return &variants[v];
+    }
+    return NULL;
+}
+
+// Build options of variant t (naive if NULL)
+void variant_options(const struct variant *t, char *options, size_t options_len) {
+    if (t == NULL) {
+        options[0] = '\0';
+        return;
+    }
+    snprintf(options, options_len, "-DTS_M=%d -DTS_N=%d -DTS_K=%d -DWPT_M=%d -DWPT_N=%d",
+        t->ts_m, t->ts_n, t->ts_k, t->wpt_m, t->wpt_n);
+}
+
+// NDRange of variant t (naive if NULL) for a block of any size, rounded up
+// to whole work-groups; the kernels skip what falls outside
+void variant_range(const struct variant *t, size_t *global_size, size_t *local_size,
+    size_t *kernel_global, size_t *kernel_local) {
+    if (t == NULL) {
+        kernel_local[0] = local_size[0];
+        kernel_local[1] = local_size[1];
+        kernel_global[0] = (global_size[0] + local_size[0] - 1) / local_size[0] * local_size[0];
+        kernel_global[1] = (global_size[1] + local_size[1] - 1) / local_size[1] * local_size[1];
+        return;
+    }
+    kernel_local[0] = t->ts_n / t->wpt_n;
+    kernel_local[1] = t->ts_m / t->wpt_m;
+    kernel_global[0] = (global_size[0] + t->ts_n - 1) / t->ts_n * kernel_local[0];
+    kernel_global[1] = (global_size[1] + t->ts_m - 1) / t->ts_m * kernel_local[1];
+}
+
+// Take block sizes, naive work-group shape and tiles from the tuning
+// database. Returns 1 if there is a usable entry for this device; *tiled is
+// set to 0 if the naive kernel was fastest.
+int load_tuning(cl_device_id device, size_t *global_size, size_t *local_size,
+    struct variant *tuned, int *tiled) {
+    char params[256];
+    size_t block[3], local[2];
+    struct variant t = { "tuned", 0, 0, 0, 0, 0 };
+
+    if (!tune_lookup(device, "mat_mul", params, sizeof(params)))
+        return 0;
+    if (sscanf(params, "block=%zu,%zu,%zu local=%zu,%zu tile=%d,%d,%d,%d,%d",
+            &block[0], &block[1], &block[2], &local[0], &local[1],
+            &t.ts_m, &t.ts_n, &t.ts_k, &t.wpt_m, &t.wpt_n) != 10)
+        return 0;
+    for (int d = 0; d < 3; ++d) {
+        if (block[d] == 0)
+            return 0;
+    }
+    if (local[0] == 0 || local[1] == 0)
+        return 0;
+    if (t.ts_m > 0 && !variant_fits(device, &t))
+        return 0;
+
+    for (int d = 0; d < 3; ++d)
+        global_size[d] = block[d];
+    local_size[0] = local[0];
+    local_size[1] = local[1];
+    *tuned = t;
+    *tiled = t.ts_m > 0;
+    return 1;
+}
+
+// Compile kernel.cl for device with the given options
+cl_program build_program(cl_context context, cl_device_id device, const char *options) {
+    cl_int err;
     const char *source_code;
     size_t source_size;
     source_code = get_source_code("kernel.cl", &source_size);
@@ -69,7 +165,7 @@ void mat_mul(float *a, float *b, float *c,
     program = clCreateProgramWithSource(context, 1, &source_code, &source_size, &err);
     CHECK_ERROR(err);
 
-    err = clBuildProgram(program, 1, &device, "", NULL, NULL);
+    err = clBuildProgram(program, 1, &device, options, NULL, NULL);
     if (err == CL_BUILD_PROGRAM_FAILURE) {
         char *log;
         size_t log_size;
@@ -81,188 +177,1570 @@ void mat_mul(float *a, float *b, float *c,
         free(log);
     }
     CHECK_ERROR(err);
+    free((char*)source_code);
+    return program;
+}
 
-    cl_kernel kernel;
-    kernel = clCreateKernel(program, "mat_mul", &err);
+// Seconds between start and end of a profiled command
+double event_time(cl_event event) {
+    cl_ulong start, end;
+    cl_int err;
+
+    err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+    CHECK_ERROR(err);
+    err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
     CHECK_ERROR(err);
+    return (end - start) * 1e-9;
+}
 
-    cl_mem memA[2];
-    memA[0] = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        sizeof(float) * global_size[1] * global_size[2], NULL, &err);
+// Host repacking of a block, only used to report what the rectangular
+// transfers save
+void in2buf(const float *in, float *buf, size_t n, size_t m, size_t l, int sx, int sy) {
+    for (int x = 0; x < n; ++x)
+        memcpy(&buf[x * m], &in[(sx + x) * l + sy], sizeof(float) * m);
+}
+
+// Upload the rows x cols block at (sx, sy) of the row-major matrix in, with
+// ld columns, straight into the contiguous buffer mem
+cl_int write_block(cl_command_queue queue, cl_mem mem, const float *in, size_t rows, size_t cols,
+    size_t ld, size_t sx, size_t sy, cl_uint wait_n, const cl_event *wait, cl_event *event) {
+    size_t buffer_origin[3] = { 0, 0, 0 };
+    size_t host_origin[3] = { sizeof(float) * sy, sx, 0 };
+    size_t region[3] = { sizeof(float) * cols, rows, 1 };
+    return clEnqueueWriteBufferRect(queue, mem, CL_FALSE, buffer_origin, host_origin, region,
+        sizeof(float) * cols, 0, sizeof(float) * ld, 0, in, wait_n, wait, event);
+}
+
+// Read the contiguous rows x cols buffer mem back into the block at (sx, sy)
+// of out, with ld columns
+cl_int read_block(cl_command_queue queue, cl_mem mem, float *out, size_t rows, size_t cols,
+    size_t ld, size_t sx, size_t sy, cl_uint wait_n, const cl_event *wait, cl_event *event) {
+    size_t buffer_origin[3] = { 0, 0, 0 };
+    size_t host_origin[3] = { sizeof(float) * sy, sx, 0 };
+    size_t region[3] = { sizeof(float) * cols, rows, 1 };
+    return clEnqueueReadBufferRect(queue, mem, CL_FALSE, buffer_origin, host_origin, region,
+        sizeof(float) * cols, 0, sizeof(float) * ld, 0, out, wait_n, wait, event);
+}
+
+// Convert a float to IEEE half precision, rounding to nearest even
+cl_half float_to_half(float f) {
+    union { float f; unsigned int u; } v;
+    v.f = f;
+    unsigned int sign = (v.u >> 16) & 0x8000;
+    int exp = (int)((v.u >> 23) & 0xff) - 127 + 15;
+    unsigned int mant = v.u & 0x7fffff;
+
+    if (((v.u >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if (exp >= 31)
+        return sign | 0x7c00;
+    if (exp <= 0) {
+        if (exp < -10)
+            return sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        unsigned int h = mant >> shift;
+        unsigned int rem = mant & ((1u << shift) - 1);
+        unsigned int mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (h & 1)))
+            ++h;
+        return sign | h;
+    }
+
+    unsigned int h = ((unsigned int)exp << 10) | (mant >> 13);
+    unsigned int rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        ++h;
+    return sign | h;
+}
+
+// Smallest magnitude that rounds to infinity in half
+#define HALF_OVERFLOW 65520.0f
+
+// Whether every finite element of the rows x cols matrix in, with ld
+// columns, stays finite in half
+int fits_half(const float *in, size_t rows, size_t cols, size_t ld) {
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = 0; y < cols; ++y) {
+            if (fabsf(in[x * ld + y]) >= HALF_OVERFLOW && !isinf(in[x * ld + y]))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// fits_half for the matrix of a stream, read a band of rows at a time.
+// A read error is left for the product to report.
+int stream_fits_half(struct matfile *m) {
+    size_t rows = m->header.rows, cols = m->header.cols;
+    if (m->header.dtype == MATFILE_HALF || rows == 0 || cols == 0)
+        return 1;
+    size_t band = ((size_t)16 << 20) / (sizeof(float) * cols);
+    band = band == 0 ? 1 : band < rows ? band : rows;
+    float *buf = (float*)malloc(sizeof(float) * band * cols);
+    if (buf == NULL)
+        return 1;
+    int fits = 1;
+    for (size_t i = 0; i < rows && fits; i += band) {
+        size_t n = rows - i < band ? rows - i : band;
+        if (!matfile_read(m, i, 0, n, cols, buf, cols))
+            break;
+        fits = fits_half(buf, n, cols, cols);
+    }
+    free(buf);
+    return fits;
+}
+
+// Copy the rows x cols block at (sx, sy) of in, with ld columns, into the
+// contiguous buffer stage, converted to half with half. Values beyond the
+// range of half become infinities and are counted in *overflow.
+void stage_block(void *stage, const float *in, size_t rows, size_t cols, size_t ld,
+    size_t sx, size_t sy, int half, size_t *overflow) {
+    for (size_t x = 0; x < rows; ++x) {
+        const float *row = &in[(sx + x) * ld + sy];
+        if (!half) {
+            memcpy((float*)stage + x * cols, row, sizeof(float) * cols);
+            continue;
+        }
+        cl_half *out = (cl_half*)stage + x * cols;
+        for (size_t y = 0; y < cols; ++y) {
+            out[y] = float_to_half(row[y]);
+            if ((out[y] & 0x7fff) == 0x7c00 && !isinf(row[y]))
+                ++*overflow;
+        }
+    }
+}
+
+// Stage the block as stage_block does and upload it to the contiguous
+// buffer mem. stage must be left alone until the upload is done.
+cl_int write_staged_block(cl_command_queue queue, cl_mem mem, void *stage, const float *in,
+    size_t rows, size_t cols, size_t ld, size_t sx, size_t sy, int half, size_t *overflow,
+    cl_event *event) {
+    stage_block(stage, in, rows, cols, ld, sx, sy, half, overflow);
+    size_t elem = half ? sizeof(cl_half) : sizeof(float);
+    return clEnqueueWriteBuffer(queue, mem, CL_FALSE, 0, elem * rows * cols,
+        stage, 0, NULL, event);
+}
+
+// Slots of the engine's pipeline, -D at most
+#define MAX_DEPTH 8
+
+// OpenCL state kept across the products of a run, so that the leaves of
+// Strassen-Winograd do not each pay for context creation and program build
+struct engine {
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queueIO, queueSM;
+    cl_program program;
+    cl_kernel kernel, naive;
+    struct variant tuned;
+    const struct variant *variant;  // NULL for the naive kernel
+    size_t block[3];                // largest block, as global_size
+    size_t local[2];                // work-group of the naive kernel
+    int half;                       // A and B stored as half on the device
+    int staged;                     // A and B copied into pinned staging
+    int depth;                      // A and B blocks in flight
+    cl_mem memA[MAX_DEPTH], memB[MAX_DEPTH];
+    cl_mem *rowC;                   // C tiles of the two rows in flight
+    size_t rowC_n;
+    struct stage_pool *pool;
+    void *stageA[MAX_DEPTH], *stageB[MAX_DEPTH];  // pinned staging of A and B blocks
+    size_t overflow;                // values of A and B beyond half range
+    double sent[3], received;       // bytes uploaded of A, B and C, and read back
+    size_t last[3];                 // block of the last product
+    double kernel_time, flop;       // profiled kernel time and its work
+    double issue_time;              // host time spent queueing blocks
+    size_t launch_n;
+};
+
+static struct engine *engine = NULL;
+
+void engine_release() {
+    for (int s = 0; s < engine->depth; ++s) {
+        clReleaseMemObject(engine->memA[s]);
+        clReleaseMemObject(engine->memB[s]);
+    }
+    for (size_t t = 0; t < engine->rowC_n; ++t)
+        clReleaseMemObject(engine->rowC[t]);
+    free(engine->rowC);
+    stage_pool_release(engine->pool);
+    clReleaseKernel(engine->naive);
+    clReleaseKernel(engine->kernel);
+    clReleaseProgram(engine->program);
+    clReleaseCommandQueue(engine->queueIO);
+    clReleaseCommandQueue(engine->queueSM);
+    clReleaseContext(engine->context);
+    free(engine);
+    engine = NULL;
+}
+
+// Bytes the products of the engine moved over the bus, as enqueued
+void engine_report_transfers() {
+    printf("Transfers : %.1lf MB up (A %.1lf, B %.1lf, C %.1lf), %.1lf MB down\n",
+        (engine->sent[0] + engine->sent[1] + engine->sent[2]) * 1e-6,
+        engine->sent[0] * 1e-6, engine->sent[1] * 1e-6, engine->sent[2] * 1e-6,
+        engine->received * 1e-6);
+}
+
+// Set up the first GPU for products in blocks of global_size, unless the
+// tuning database has an entry for it. With half, A and B are converted to
+// half on upload and the kernels accumulate in fp32. Half blocks, and float
+// ones with -P, go through pinned staging.
+void engine_init(size_t *global_size, size_t *local_size, int half) {
+    cl_int err;
+
+    engine = (struct engine*)calloc(1, sizeof(struct engine));
+    engine->half = half;
+    engine->staged = half || pinned_staging;
+    engine->depth = pipeline_depth < 1 ? 1 : pipeline_depth > MAX_DEPTH ? MAX_DEPTH : pipeline_depth;
+
+    cl_platform_id platform;
+    err = clGetPlatformIDs(1, &platform, NULL);
+    CHECK_ERROR(err);
+
+    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &engine->device, NULL);
     CHECK_ERROR(err);
-    memA[1] = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        sizeof(float) * global_size[1] * global_size[2], NULL, &err);
+
+    engine->context = clCreateContext(NULL, 1, &engine->device, NULL, NULL, &err);
     CHECK_ERROR(err);
-    cl_mem memB[2];
-    memB[0] = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        sizeof(float) * global_size[2] * global_size[0], NULL, &err);
+
+    engine->queueIO = clCreateCommandQueue(engine->context, engine->device, 0, &err);
     CHECK_ERROR(err);
-    memB[1] = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        sizeof(float) * global_size[2] * global_size[0], NULL, &err);
+    engine->queueSM = clCreateCommandQueue(engine->context, engine->device,
+        CL_QUEUE_PROFILING_ENABLE, &err);
     CHECK_ERROR(err);
-    cl_mem memC[2];
-    memC[0] = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-        sizeof(float) * global_size[1] * global_size[0], NULL, &err);
+    engine->pool = stage_pool_create(engine->context, engine->queueIO);
+
+    // A tuning database entry for this device overrides the block sizes
+    // given by the caller
+    int tiled;
+    for (int d = 0; d < 3; ++d)
+        engine->block[d] = global_size[d];
+    engine->local[0] = local_size[0];
+    engine->local[1] = local_size[1];
+    if (load_tuning(engine->device, engine->block, engine->local, &engine->tuned, &tiled))
+        engine->variant = tiled ? &engine->tuned : NULL;
+    else
+        engine->variant = pick_variant(engine->device);
+
+    char options[256];
+    variant_options(engine->variant, options, sizeof(options));
+    if (half)
+        strncat(options, " -DHALF_STORAGE", sizeof(options) - strlen(options) - 1);
+    engine->program = build_program(engine->context, engine->device, options);
+
+    engine->kernel = clCreateKernel(engine->program,
+        engine->variant != NULL ? "mat_mul_tiled" : "mat_mul", &err);
     CHECK_ERROR(err);
-    memC[1] = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-        sizeof(float) * global_size[1] * global_size[0], NULL, &err);
+    engine->naive = clCreateKernel(engine->program, "mat_mul", &err);
     CHECK_ERROR(err);
 
-    err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &memC[0]);
+    size_t elem = half ? sizeof(cl_half) : sizeof(float);
+    size_t a_size = elem * engine->block[1] * engine->block[2];
+    size_t b_size = elem * engine->block[2] * engine->block[0];
+    for (int s = 0; s < engine->depth; ++s) {
+        engine->memA[s] = clCreateBuffer(engine->context, CL_MEM_READ_ONLY, a_size, NULL, &err);
+        CHECK_ERROR(err);
+        engine->memB[s] = clCreateBuffer(engine->context, CL_MEM_READ_ONLY, b_size, NULL, &err);
+        CHECK_ERROR(err);
+        if (engine->staged) {
+            engine->stageA[s] = stage_get(engine->pool, a_size);
+            engine->stageB[s] = stage_get(engine->pool, b_size);
+            if (engine->stageA[s] == NULL || engine->stageB[s] == NULL)
+                exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// One product of gemm_opencl as a pipeline over the rows of C tiles. Item
+// (a * grid_n + j), with a = r * steps + l, multiplies K block l of A row r
+// by the B block above tile j and accumulates it into that tile (beta = 1
+// after the first K block). Block a of A is uploaded once, by the item of
+// tile 0, into A slot a % depth, and the grid_n items after it reuse it;
+// B blocks are in the slot of their item. The C tiles of a row stay on the
+// device in its group slot until its last item reads them back.
+struct gemm_job {
+    size_t dim[3], block[3];
+    size_t grid_n, steps;           // tiles in a row of C, K blocks of a tile
+    const float *A, *B;
+    float *C;
+    size_t lda, ldb, ldc;
+    float beta;
+    cl_event uploadedA[MAX_DEPTH];  // last upload out of each A staging slot
+    cl_event *launched;             // kernel events, to sum up their profiled time
+    size_t launch_n;
+};
+
+// Origin and size of the blocks of item, and the A block it reads
+static void job_block(const struct gemm_job *job, size_t item, size_t *a, size_t *i, size_t *j,
+    size_t *l, cl_ulong *rows, cl_ulong *cols, cl_ulong *depth) {
+    *a = item / job->grid_n;
+    *i = *a / job->steps * job->block[1];
+    *j = item % job->grid_n * job->block[0];
+    *l = *a % job->steps * job->block[2];
+    *rows = job->dim[1] - *i < job->block[1] ? job->dim[1] - *i : job->block[1];
+    *cols = job->dim[0] - *j < job->block[0] ? job->dim[0] - *j : job->block[0];
+    *depth = job->dim[2] - *l < job->block[2] ? job->dim[2] - *l : job->block[2];
+}
+
+// Host stage: copy or convert the blocks of A and B into pinned staging.
+// The pipeline only covers the B slot, so the A slot first waits for the
+// upload of the block depth back out of it.
+static cl_int job_stage(void *arg, const struct pipe_call *call, cl_event *event) {
+    struct gemm_job *job = (struct gemm_job*)arg;
+    cl_int err;
+    size_t a, i, j, l;
+    cl_ulong rows, cols, depth;
+
+    job_block(job, call->item, &a, &i, &j, &l, &rows, &cols, &depth);
+    if (j == 0) {
+        int sA = a % engine->depth;
+        if (job->uploadedA[sA] != NULL) {
+            err = clWaitForEvents(1, &job->uploadedA[sA]);
+            if (err != CL_SUCCESS)
+                return err;
+            clReleaseEvent(job->uploadedA[sA]);
+            job->uploadedA[sA] = NULL;
+        }
+        stage_block(engine->stageA[sA], job->A, rows, depth, job->lda, i, l,
+            engine->half, &engine->overflow);
+    }
+    stage_block(engine->stageB[call->slot], job->B, depth, cols, job->ldb, l, j,
+        engine->half, &engine->overflow);
+    return CL_SUCCESS;
+}
+
+// Upload the block of B, the block of A on tile 0, and the C tiles of the
+// row first when beta != 0, from staging or straight from the matrices
+// with rectangular transfers. The A slot is free once the kernel of the
+// item depth back is: kernels run in order, and the last one to read the
+// slot is no later than that.
+static cl_int job_upload(void *arg, const struct pipe_call *call, cl_event *event) {
+    struct gemm_job *job = (struct gemm_job*)arg;
+    cl_int err;
+    cl_event last;
+    size_t a, i, j, l;
+    cl_ulong rows, cols, depth;
+    size_t elem = engine->half ? sizeof(cl_half) : sizeof(float);
+
+    job_block(job, call->item, &a, &i, &j, &l, &rows, &cols, &depth);
+    if (engine->staged)
+        err = clEnqueueWriteBuffer(call->queue, engine->memB[call->slot], CL_FALSE, 0,
+            elem * depth * cols, engine->stageB[call->slot], call->wait_n, call->wait, &last);
+    else
+        err = write_block(call->queue, engine->memB[call->slot], job->B, depth, cols, job->ldb,
+            l, j, call->wait_n, call->wait, &last);
+    CHECK_ERROR(err);
+    engine->sent[1] += elem * depth * cols;
+
+    if (j == 0) {
+        int sA = a % engine->depth;
+        cl_event uploadA;
+        if (engine->staged)
+            err = clEnqueueWriteBuffer(call->queue, engine->memA[sA], CL_FALSE, 0,
+                elem * rows * depth, engine->stageA[sA], 1, &last, &uploadA);
+        else
+            err = write_block(call->queue, engine->memA[sA], job->A, rows, depth, job->lda,
+                i, l, 1, &last, &uploadA);
+        CHECK_ERROR(err);
+        engine->sent[0] += elem * rows * depth;
+        clReleaseEvent(last);
+        last = uploadA;
+        if (engine->staged) {
+            clRetainEvent(uploadA);
+            job->uploadedA[sA] = uploadA;
+        }
+    }
+
+    if (l == 0 && j == 0 && job->beta != 0.0f) {
+        for (size_t t = 0; t < job->grid_n; ++t) {
+            size_t tj = t * job->block[0];
+            cl_ulong tcols = job->dim[0] - tj < job->block[0] ? job->dim[0] - tj : job->block[0];
+            cl_event uploadC;
+            err = write_block(call->queue, engine->rowC[call->group_slot * job->grid_n + t],
+                job->C, rows, tcols, job->ldc, i, tj, 1, &last, &uploadC);
+            CHECK_ERROR(err);
+            engine->sent[2] += sizeof(float) * rows * tcols;
+            clReleaseEvent(last);
+            last = uploadC;
+        }
+    }
+    *event = last;
+    return CL_SUCCESS;
+}
+
+static cl_int job_kernel(void *arg, const struct pipe_call *call, cl_event *event) {
+    struct gemm_job *job = (struct gemm_job*)arg;
+    cl_kernel kernel = engine->kernel;
+    cl_int err;
+    size_t a, i, j, l;
+    cl_ulong rows, cols, depth;
+
+    job_block(job, call->item, &a, &i, &j, &l, &rows, &cols, &depth);
+    size_t shape[3] = { cols, rows, depth };
+    size_t kernel_global[2], kernel_local[2];
+    variant_range(engine->variant, shape, engine->local, kernel_global, kernel_local);
+
+    cl_float b = l == 0 ? job->beta : 1.0f;
+    cl_mem tile = engine->rowC[call->group_slot * job->grid_n + j / job->block[0]];
+    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &engine->memA[a % engine->depth]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, 1, sizeof(cl_mem), &engine->memB[call->slot]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &tile);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, 3, sizeof(cl_ulong), &rows);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, 4, sizeof(cl_ulong), &depth);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kernel, 5, sizeof(cl_ulong), &cols);
     CHECK_ERROR(err);
-    err = clSetKernelArg(kernel, 3, sizeof(cl_ulong), &global_size[2]);
+    err = clSetKernelArg(kernel, 6, sizeof(cl_float), &b);
     CHECK_ERROR(err);
-    err = clSetKernelArg(kernel, 4, sizeof(cl_ulong), &global_size[0]);
+    err = clEnqueueNDRangeKernel(call->queue, kernel, 2, NULL,
+        kernel_global, kernel_local, call->wait_n, call->wait, event);
     CHECK_ERROR(err);
+    clRetainEvent(*event);
+    job->launched[job->launch_n++] = *event;
+    return CL_SUCCESS;
+}
 
-    float *bufA, *bufB, *bufC;
-    bufA = (float*)malloc(sizeof(float) * global_size[1] * global_size[2]);
-    bufB = (float*)malloc(sizeof(float) * global_size[2] * global_size[0]);
-    bufC = (float*)malloc(sizeof(float) * global_size[1] * global_size[0]);
+// Read the finished row of C tiles back, after the last item of the row
+static cl_int job_download(void *arg, const struct pipe_call *call, cl_event *event) {
+    const struct gemm_job *job = (const struct gemm_job*)arg;
+    cl_int err;
+    cl_event last = NULL;
+    size_t a, i, j, l;
+    cl_ulong rows, cols, depth;
 
-    int swA = 0, swB = 0, swC = 0;
-    cl_uint num_events = 0;
-    cl_event event[3];
-    int xIO, yIO, xSM, ySM, xHost, yHost;
-    xIO = yIO = xSM = ySM = xHost = yHost = -1;
-    for (int i = 0; i < dim[1]; i += global_size[1]) {
-        for (int k = 0; k < dim[2]; k += global_size[2]) {
-            for (int j = 0; j < dim[0]; j += global_size[0]) {
-                if (num_events > 0) {
-                    err = clWaitForEvents(num_events, event);
-                    CHECK_ERROR(err);
-                }
+    job_block(job, call->item, &a, &i, &j, &l, &rows, &cols, &depth);
+    for (size_t t = 0; t < job->grid_n; ++t) {
+        size_t tj = t * job->block[0];
+        cl_ulong tcols = job->dim[0] - tj < job->block[0] ? job->dim[0] - tj : job->block[0];
+        cl_event readC;
+        if (last == NULL)
+            err = read_block(call->queue, engine->rowC[call->group_slot * job->grid_n + t],
+                job->C, rows, tcols, job->ldc, i, tj, call->wait_n, call->wait, &readC);
+        else
+            err = read_block(call->queue, engine->rowC[call->group_slot * job->grid_n + t],
+                job->C, rows, tcols, job->ldc, i, tj, 1, &last, &readC);
+        CHECK_ERROR(err);
+        engine->received += sizeof(float) * rows * tcols;
+        if (last != NULL)
+            clReleaseEvent(last);
+        last = readC;
+    }
+    *event = last;
+    return CL_SUCCESS;
+}
 
-                if (xSM != -1) {
-                    err = clEnqueueReadBuffer(queueIO, memC[swC], CL_FALSE, 0,
-                        sizeof(float) * global_size[0] * global_size[1],
-                        bufC, 0, NULL, &event[1]);
-                    CHECK_ERROR(err);
-                    swC ^= 1;
-                    err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &memC[swC]);
-                    CHECK_ERROR(err);
-                    xHost = xSM; yHost = ySM;
-                }
+// C = A * B + beta * C on the device, for row-major A (m x k), B (k x n)
+// and C (m x n) of any size. Blocks are as large as the engine's but no
+// larger than the matrices; the last block along each dimension takes what
+// is left and is stored contiguously at its own size.
+void gemm_opencl(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, float beta, float *C, size_t ldc) {
+    cl_int err;
+    struct gemm_job job = { { n, m, k } };
+    size_t block_n = 1;
 
-                num_events = 0;
-                if (xIO != -1) {
-                    err = clEnqueueNDRangeKernel(queueSM, kernel, 2, NULL,
-                        global_size, local_size, 0, NULL, &event[num_events++]);
-                    CHECK_ERROR(err);
-                    xSM = xIO; ySM = yIO;
-                }
+    for (int d = 0; d < 3; ++d) {
+        job.block[d] = job.dim[d] < engine->block[d] ? job.dim[d] : engine->block[d];
+        if (job.block[d] == 0)
+            return;
+        block_n *= (job.dim[d] + job.block[d] - 1) / job.block[d];
+    }
+    job.grid_n = (n + job.block[0] - 1) / job.block[0];
+    job.steps = (k + job.block[2] - 1) / job.block[2];
+    job.A = A;
+    job.B = B;
+    job.C = C;
+    job.lda = lda;
+    job.ldb = ldb;
+    job.ldc = ldc;
+    job.beta = beta;
+    job.launched = (cl_event*)malloc(sizeof(cl_event) * block_n);
 
-                if (xHost != -1) {
-                    err = clWaitForEvents(1, &event[1]);
-                    CHECK_ERROR(err);
-                }
+    // C tiles for two rows, kept from one product to the next
+    if (engine->rowC_n < 2 * job.grid_n) {
+        size_t c_size = sizeof(float) * engine->block[1] * engine->block[0];
+        engine->rowC = (cl_mem*)realloc(engine->rowC, sizeof(cl_mem) * 2 * job.grid_n);
+        for (; engine->rowC_n < 2 * job.grid_n; ++engine->rowC_n) {
+            engine->rowC[engine->rowC_n] = clCreateBuffer(engine->context, CL_MEM_READ_WRITE,
+                c_size, NULL, &err);
+            CHECK_ERROR(err);
+        }
+    }
 
-                if (j == 0) {
-                    in2buf(a, bufA, global_size[1], global_size[2], dim[2], i, k);
-                    err = clEnqueueWriteBuffer(queueIO, memA[swA], CL_FALSE, 0,
-                        sizeof(float) * global_size[1] * global_size[2],
-                        bufA, 0, NULL, &event[num_events++]);
-                    CHECK_ERROR(err);
-                    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &memA[swA]);
-                    CHECK_ERROR(err);
-                    swA ^= 1;
-                }
+    // Uploads go through queueIO, and kernels and tile read backs through
+    // queueSM, so a read back never holds up the uploads queued after it.
+    // Kernels run in order, and the first of a row waits for the row that
+    // last used its C tiles to be read back.
+    struct pipeline pipe = { 0 };
+    if (engine->staged)
+        pipeline_stage(&pipe, PIPE_HOST, 0, job_stage);
+    pipeline_stage(&pipe, PIPE_UPLOAD, beta != 0.0f ? PIPE_GROUP_USE : 0, job_upload);
+    pipeline_stage(&pipe, PIPE_KERNEL, PIPE_ORDERED | PIPE_GROUP_USE, job_kernel);
+    pipeline_stage(&pipe, PIPE_DOWNLOAD, PIPE_GROUP_END, job_download);
+    pipe.depth = engine->depth;
+    pipe.group_len = job.steps * job.grid_n;
+    pipe.group_depth = 2;
+    pipe.upload[pipe.upload_n++] = engine->queueIO;
+    pipe.compute[pipe.compute_n++] = engine->queueSM;
+    pipe.arg = &job;
 
-                in2buf(b, bufB, global_size[2], global_size[0], dim[0], k, j);
-                err = clEnqueueWriteBuffer(queueIO, memB[swB], CL_FALSE, 0,
-                    sizeof(float) * global_size[2] * global_size[0],
-                    bufB, 0, NULL, &event[num_events++]);
-                CHECK_ERROR(err);
-                err = clSetKernelArg(kernel, 1, sizeof(cl_mem), &memB[swB]);
-                CHECK_ERROR(err);
-                swB ^= 1;
-
-                xIO = i; yIO = j;
-
-                if (xHost != -1) {
-                    for (int x = 0; x < global_size[1]; ++x) {
-                        for (int y = 0; y < global_size[0]; ++y) {
-                            c[(xHost + x) * dim[0] + (yHost + y)] += bufC[x * global_size[0] + y];
-                        }
-                    }
-                }
+    prof_begin("gemm_opencl");
+    err = pipeline_run(&pipe, block_n);
+    CHECK_ERROR(err);
+    prof_end();
+    engine->issue_time += pipe.host_time;
+
+    for (int s = 0; s < MAX_DEPTH; ++s) {
+        if (job.uploadedA[s] != NULL)
+            clReleaseEvent(job.uploadedA[s]);
+    }
+    for (size_t l = 0; l < job.launch_n; ++l) {
+        engine->kernel_time += event_time(job.launched[l]);
+        clReleaseEvent(job.launched[l]);
+    }
+    free(job.launched);
+    engine->flop += 2.0 * m * n * k;
+    engine->launch_n += job.launch_n;
+    for (int d = 0; d < 3; ++d)
+        engine->last[d] = job.block[d];
+}
+
+// Tile scheduler over every OpenCL device of every platform, CPUs included.
+// The output tiles, in row-major order, are dealt out to the devices in
+// contiguous runs. A device takes tiles from the front of its own run and,
+// once that is empty, steals from the back of the run with the most left,
+// so faster devices end up with more tiles. Each device keeps the last two
+// A row panels and B column panels it uploaded, over the whole depth K, so
+// consecutive tiles of a row only upload their B panel.
+#define MAX_DEVICES 16
+#define NO_PANEL ((size_t)-1)
+
+struct worker {
+    cl_device_id device;
+    char name[128];
+    cl_context context;
+    cl_command_queue queueIO, queueSM;
+    cl_program program;
+    cl_kernel kernel;
+    struct variant tuned;
+    const struct variant *variant;  // NULL for the naive kernel
+    size_t local[2];
+    int active;                     // has room for the panels of this product
+    cl_mem panelA[2], panelB[2], memC[2];
+    size_t capA, capB, capC;        // bytes of each of the panels and tiles
+    struct stage_pool *pool;
+    void *stageA[2], *stageB[2];    // pinned staging of A and B panels
+    size_t cachedA[2], cachedB[2];  // panel held in each slot, or NO_PANEL
+    int nextA, nextB;               // slot the next uncached panel goes to
+    cl_event usedA[2], usedB[2];    // last kernel that read each panel
+    cl_event computed[2], readC[2]; // kernel and read back of each C tile
+    pthread_mutex_t lock;
+    size_t head, tail;              // tiles [head, tail) are left to it
+    size_t tile_n, stolen_n, upload_n, reuse_n, overflow;
+    double kernel_time;
+};
+
+// One product, shared by the worker threads
+struct product {
+    size_t m, n, k;
+    const float *A, *B;
+    float *C;
+    size_t lda, ldb, ldc;
+    float beta;
+    size_t tile_m, tile_n;          // rows and columns of a tile
+    size_t grid_n;                  // tiles in a row of C
+};
+
+struct job {
+    struct worker *w;
+    const struct product *p;
+};
+
+struct multi {
+    int worker_n;
+    struct worker workers[MAX_DEVICES];
+    size_t block[2];                // tile of C, as global_size
+    int half, staged;
+    double flop, wall;
+};
+
+static struct multi *multi = NULL;
+
+// Set up every device for products in tiles of global_size. Tiles and
+// work-groups of each device come from the tuning database, if it has an
+// entry for the device, else the first variant that fits.
+void multi_init(size_t *global_size, size_t *local_size, int half) {
+    cl_int err;
+    cl_uint platform_n;
+    cl_platform_id platforms[MAX_DEVICES];
+
+    multi = (struct multi*)calloc(1, sizeof(struct multi));
+    multi->block[0] = global_size[0];
+    multi->block[1] = global_size[1];
+    multi->half = half;
+    multi->staged = half || pinned_staging;
+
+    err = clGetPlatformIDs(MAX_DEVICES, platforms, &platform_n);
+    CHECK_ERROR(err);
+    if (platform_n > MAX_DEVICES)
+        platform_n = MAX_DEVICES;
+
+    for (cl_uint p = 0; p < platform_n; ++p) {
+        cl_uint device_n;
+        cl_device_id devices[MAX_DEVICES];
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, MAX_DEVICES, devices, &device_n) != CL_SUCCESS)
+            continue;
+        if (device_n > MAX_DEVICES)
+            device_n = MAX_DEVICES;
+
+        for (cl_uint d = 0; d < device_n && multi->worker_n < MAX_DEVICES; ++d) {
+            struct worker *w = &multi->workers[multi->worker_n++];
+            w->device = devices[d];
+            err = clGetDeviceInfo(w->device, CL_DEVICE_NAME, sizeof(w->name), w->name, NULL);
+            CHECK_ERROR(err);
+
+            w->context = clCreateContext(NULL, 1, &w->device, NULL, NULL, &err);
+            CHECK_ERROR(err);
+            w->queueIO = clCreateCommandQueue(w->context, w->device, 0, &err);
+            CHECK_ERROR(err);
+            w->queueSM = clCreateCommandQueue(w->context, w->device,
+                CL_QUEUE_PROFILING_ENABLE, &err);
+            CHECK_ERROR(err);
+            w->pool = stage_pool_create(w->context, w->queueIO);
+
+            size_t block[3] = { global_size[0], global_size[1], global_size[2] };
+            int tiled;
+            w->local[0] = local_size[0];
+            w->local[1] = local_size[1];
+            if (load_tuning(w->device, block, w->local, &w->tuned, &tiled))
+                w->variant = tiled ? &w->tuned : NULL;
+            else
+                w->variant = pick_variant(w->device);
+
+            char options[256];
+            variant_options(w->variant, options, sizeof(options));
+            if (half)
+                strncat(options, " -DHALF_STORAGE", sizeof(options) - strlen(options) - 1);
+            w->program = build_program(w->context, w->device, options);
+            w->kernel = clCreateKernel(w->program,
+                w->variant != NULL ? "mat_mul_tiled" : "mat_mul", &err);
+            CHECK_ERROR(err);
+            pthread_mutex_init(&w->lock, NULL);
+        }
+    }
+    if (multi->worker_n == 0) {
+        printf("No OpenCL device found\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void multi_release() {
+    for (int d = 0; d < multi->worker_n; ++d) {
+        struct worker *w = &multi->workers[d];
+        for (int s = 0; s < 2; ++s) {
+            if (w->panelA[s] != NULL)
+                clReleaseMemObject(w->panelA[s]);
+            if (w->panelB[s] != NULL)
+                clReleaseMemObject(w->panelB[s]);
+            if (w->memC[s] != NULL)
+                clReleaseMemObject(w->memC[s]);
+        }
+        stage_pool_release(w->pool);
+        pthread_mutex_destroy(&w->lock);
+        clReleaseKernel(w->kernel);
+        clReleaseProgram(w->program);
+        clReleaseCommandQueue(w->queueIO);
+        clReleaseCommandQueue(w->queueSM);
+        clReleaseContext(w->context);
+    }
+    free(multi);
+    multi = NULL;
+}
+
+// Make both buffers of a slot pair hold at least size bytes, and the pinned
+// staging too if given. Staging given back to the pool serves the larger
+// panels of later products if it is large enough.
+static void reserve_pair(struct worker *w, cl_mem *mem, void **stage, size_t *cap,
+    size_t size, cl_mem_flags flags) {
+    cl_int err;
+
+    if (size <= *cap)
+        return;
+    for (int s = 0; s < 2; ++s) {
+        if (mem[s] != NULL)
+            clReleaseMemObject(mem[s]);
+        mem[s] = clCreateBuffer(w->context, flags, size, NULL, &err);
+        CHECK_ERROR(err);
+        if (stage != NULL) {
+            stage_put(w->pool, stage[s]);
+            stage[s] = stage_get(w->pool, size);
+            if (stage[s] == NULL)
+                exit(EXIT_FAILURE);
+        }
+    }
+    *cap = size;
+}
+
+// Next tile for w: its own first, else the last of the device with the
+// most left. Returns 0 once no device has any left.
+static int claim_tile(struct worker *w, size_t *tile) {
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail) {
+        *tile = w->head++;
+        pthread_mutex_unlock(&w->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    for (;;) {
+        struct worker *victim = NULL;
+        size_t most = 0;
+        for (int d = 0; d < multi->worker_n; ++d) {
+            struct worker *v = &multi->workers[d];
+            pthread_mutex_lock(&v->lock);
+            if (v->tail - v->head > most) {
+                most = v->tail - v->head;
+                victim = v;
             }
+            pthread_mutex_unlock(&v->lock);
+        }
+        if (victim == NULL)
+            return 0;
+
+        // Another thief may have got there first
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            *tile = --victim->tail;
+            pthread_mutex_unlock(&victim->lock);
+            ++w->stolen_n;
+            return 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+}
+
+// Slot of panel index in cached, or -1 - slot if it is not there and has
+// to be uploaded into that slot
+static int find_panel(struct worker *w, size_t *cached, int *next, size_t index) {
+    for (int s = 0; s < 2; ++s) {
+        if (cached[s] == index) {
+            ++w->reuse_n;
+            return s;
+        }
+    }
+    int s = *next;
+    *next ^= 1;
+    cached[s] = index;
+    ++w->upload_n;
+    return -1 - s;
+}
+
+// Upload the rows x cols block at (sx, sy) of in into slot s of a panel
+// pair, after the kernel that last read the slot
+static void upload_panel(struct worker *w, cl_mem *panel,
+    void **stage, cl_event *used, int s, const float *in, size_t rows, size_t cols,
+    size_t ld, size_t sx, size_t sy, cl_event *event) {
+    cl_int err;
+
+    if (multi->staged) {
+        // The staging buffer of the slot is only refilled once the kernel
+        // that read the last upload from it is done
+        if (used[s] != NULL) {
+            err = clWaitForEvents(1, &used[s]);
+            CHECK_ERROR(err);
         }
+        err = write_staged_block(w->queueIO, panel[s], stage[s], in, rows, cols, ld, sx, sy,
+            multi->half, &w->overflow, event);
+    } else {
+        err = write_block(w->queueIO, panel[s], in, rows, cols, ld, sx, sy,
+            used[s] != NULL ? 1 : 0, used[s] != NULL ? &used[s] : NULL, event);
     }
+    CHECK_ERROR(err);
+}
 
-    if (num_events > 0) {
-        err = clWaitForEvents(num_events, event);
+// C tile number tile, over the whole depth K in one launch, into C slot sC
+static void run_tile(struct worker *w, const struct product *p, size_t tile, int sC) {
+    cl_int err;
+    cl_event wait[3];
+    cl_uint wait_n = 0;
+    size_t i = tile / p->grid_n * p->tile_m, j = tile % p->grid_n * p->tile_n;
+    cl_ulong rows = p->m - i < p->tile_m ? p->m - i : p->tile_m;
+    cl_ulong cols = p->n - j < p->tile_n ? p->n - j : p->tile_n;
+    cl_ulong depth = p->k;
+
+    int sA = find_panel(w, w->cachedA, &w->nextA, tile / p->grid_n);
+    if (sA < 0) {
+        sA = -1 - sA;
+        upload_panel(w, w->panelA, w->stageA, w->usedA, sA, p->A, rows, depth, p->lda,
+            i, 0, &wait[wait_n++]);
+    }
+    int sB = find_panel(w, w->cachedB, &w->nextB, tile % p->grid_n);
+    if (sB < 0) {
+        sB = -1 - sB;
+        upload_panel(w, w->panelB, w->stageB, w->usedB, sB, p->B, depth, cols, p->ldb,
+            0, j, &wait[wait_n++]);
+    }
+    if (p->beta != 0.0f) {
+        err = write_block(w->queueIO, w->memC[sC], p->C, rows, cols, p->ldc, i, j,
+            0, NULL, &wait[wait_n++]);
         CHECK_ERROR(err);
     }
+    clFlush(w->queueIO);
+
+    size_t shape[3] = { cols, rows, depth };
+    size_t kernel_global[2], kernel_local[2];
+    variant_range(w->variant, shape, w->local, kernel_global, kernel_local);
+
+    cl_float beta = p->beta;
+    err = clSetKernelArg(w->kernel, 0, sizeof(cl_mem), &w->panelA[sA]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(w->kernel, 1, sizeof(cl_mem), &w->panelB[sB]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(w->kernel, 2, sizeof(cl_mem), &w->memC[sC]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(w->kernel, 3, sizeof(cl_ulong), &rows);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(w->kernel, 4, sizeof(cl_ulong), &depth);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(w->kernel, 5, sizeof(cl_ulong), &cols);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(w->kernel, 6, sizeof(cl_float), &beta);
+    CHECK_ERROR(err);
+
+    // A panel that was already there was uploaded for an earlier kernel
+    // of the same in-order queue, so only fresh uploads are waited for
+    cl_event computed;
+    err = clEnqueueNDRangeKernel(w->queueSM, w->kernel, 2, NULL,
+        kernel_global, kernel_local, wait_n, wait_n > 0 ? wait : NULL, &computed);
+    CHECK_ERROR(err);
+    clFlush(w->queueSM);
+    for (cl_uint e = 0; e < wait_n; ++e)
+        clReleaseEvent(wait[e]);
+
+    err = read_block(w->queueIO, w->memC[sC], p->C, rows, cols, p->ldc, i, j,
+        1, &computed, &w->readC[sC]);
+    CHECK_ERROR(err);
+    clFlush(w->queueIO);
+
+    if (w->usedA[sA] != NULL)
+        clReleaseEvent(w->usedA[sA]);
+    if (w->usedB[sB] != NULL)
+        clReleaseEvent(w->usedB[sB]);
+    clRetainEvent(computed);
+    clRetainEvent(computed);
+    w->usedA[sA] = w->usedB[sB] = computed;
+    w->computed[sC] = computed;
+    ++w->tile_n;
+}
+
+// Wait for the C tile in slot s to be read back and count its kernel time
+static void retire_tile(struct worker *w, int s) {
+    cl_int err;
+
+    if (w->readC[s] == NULL)
+        return;
+    prof_begin("wait");
+    err = clWaitForEvents(1, &w->readC[s]);
+    CHECK_ERROR(err);
+    prof_end();
+    clReleaseEvent(w->readC[s]);
+    w->readC[s] = NULL;
+    w->kernel_time += event_time(w->computed[s]);
+    clReleaseEvent(w->computed[s]);
+    w->computed[s] = NULL;
+}
+
+static void *run_worker(void *arg) {
+    struct job *job = (struct job*)arg;
+    struct worker *w = job->w;
+    size_t tile;
+    int sC = 0;
+
+    prof_begin("worker");
 
-    if (xSM != -1) {
-        err = clEnqueueReadBuffer(queueIO, memC[swC], CL_FALSE, 0,
-            sizeof(float) * global_size[0] * global_size[1],
-            bufC, 0, NULL, &event[1]);
+    // A device has at most two tiles in flight, and only claims the next
+    // one once the tile before the last is back, so that the tiles it has
+    // not started stay free to be stolen
+    for (;;) {
+        retire_tile(w, sC);
+        if (!claim_tile(w, &tile))
+            break;
+        run_tile(w, job->p, tile, sC);
+        sC ^= 1;
+    }
+
+    retire_tile(w, 0);
+    retire_tile(w, 1);
+    for (int s = 0; s < 2; ++s) {
+        if (w->usedA[s] != NULL)
+            clReleaseEvent(w->usedA[s]);
+        if (w->usedB[s] != NULL)
+            clReleaseEvent(w->usedB[s]);
+        w->usedA[s] = w->usedB[s] = NULL;
+    }
+    prof_end();
+    return NULL;
+}
+
+// C = A * B + beta * C, like gemm_opencl, with the tiles of C spread over
+// every device that has room for two panels of A and B and two C tiles
+void gemm_multi(size_t m, size_t n, size_t k, const float *A, size_t lda,
+    const float *B, size_t ldb, float beta, float *C, size_t ldc) {
+    cl_int err;
+    struct product p = { m, n, k, A, B, C, lda, ldb, ldc, beta };
+
+    if (m == 0 || n == 0 || k == 0)
+        return;
+    p.tile_m = m < multi->block[1] ? m : multi->block[1];
+    p.tile_n = n < multi->block[0] ? n : multi->block[0];
+    p.grid_n = (n + p.tile_n - 1) / p.tile_n;
+    size_t tile_total = (m + p.tile_m - 1) / p.tile_m * p.grid_n;
+
+    size_t elem = multi->half ? sizeof(cl_half) : sizeof(float);
+    size_t a_size = elem * p.tile_m * k, b_size = elem * k * p.tile_n;
+    size_t c_size = sizeof(float) * p.tile_m * p.tile_n;
+    int active_n = 0;
+    for (int d = 0; d < multi->worker_n; ++d) {
+        struct worker *w = &multi->workers[d];
+        cl_ulong global_mem, max_alloc;
+        err = clGetDeviceInfo(w->device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
         CHECK_ERROR(err);
-        swC ^= 1;
-        err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &memC[swC]);
+        err = clGetDeviceInfo(w->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
         CHECK_ERROR(err);
-        xHost = xSM; yHost = ySM;
+        w->active = a_size <= max_alloc && b_size <= max_alloc
+            && 2 * (a_size + b_size + c_size) <= global_mem;
+        if (!w->active)
+            continue;
+        ++active_n;
+
+        reserve_pair(w, w->panelA, multi->staged ? w->stageA : NULL, &w->capA, a_size, CL_MEM_READ_ONLY);
+        reserve_pair(w, w->panelB, multi->staged ? w->stageB : NULL, &w->capB, b_size, CL_MEM_READ_ONLY);
+        reserve_pair(w, w->memC, NULL, &w->capC, c_size, CL_MEM_READ_WRITE);
+        // Panels of an earlier product are of other matrices
+        for (int s = 0; s < 2; ++s)
+            w->cachedA[s] = w->cachedB[s] = NO_PANEL;
+    }
+    if (active_n == 0) {
+        printf("No OpenCL device has room for %zu x %zu tiles over K = %zu\n", p.tile_m, p.tile_n, k);
+        exit(EXIT_FAILURE);
     }
 
-    num_events = 0;
-    if (xIO != -1) {
-        err = clEnqueueNDRangeKernel(queueSM, kernel, 2, NULL,
-            global_size, local_size, 0, NULL, &event[num_events++]);
-        CHECK_ERROR(err);
-        xSM = xIO; ySM = yIO;
+    // Contiguous runs of tiles, so that a device walks along rows of C
+    // and reuses its A panels
+    int a = 0;
+    for (int d = 0; d < multi->worker_n; ++d) {
+        struct worker *w = &multi->workers[d];
+        w->head = w->tail = 0;
+        if (!w->active)
+            continue;
+        w->head = tile_total * a / active_n;
+        w->tail = tile_total * (a + 1) / active_n;
+        ++a;
+    }
+
+    pthread_t threads[MAX_DEVICES];
+    struct job jobs[MAX_DEVICES];
+    prof_begin("gemm_multi");
+    for (int d = 0; d < multi->worker_n; ++d) {
+        jobs[d].w = &multi->workers[d];
+        jobs[d].p = &p;
+        if (multi->workers[d].active)
+            pthread_create(&threads[d], NULL, run_worker, &jobs[d]);
+    }
+    for (int d = 0; d < multi->worker_n; ++d) {
+        if (multi->workers[d].active)
+            pthread_join(threads[d], NULL);
+    }
+    multi->wall += prof_end();
+    multi->flop += 2.0 * m * n * k;
+}
+
+// Tiles, panel traffic and kernel utilization of each device over the run,
+// and with -n the rates of its pinned staging
+void multi_report() {
+    size_t overflow = 0;
+    printf("Devices : %.1lf GFLOPS over %lf sec\n", multi->flop / multi->wall * 1e-9, multi->wall);
+    for (int d = 0; d < multi->worker_n; ++d) {
+        struct worker *w = &multi->workers[d];
+        printf("  %s (%s) : %zu tiles, %zu stolen, %zu panel uploads, %zu reused, kernels %lf sec, %.1lf%% busy\n",
+            w->name, w->variant != NULL ? w->variant->name : "naive", w->tile_n, w->stolen_n,
+            w->upload_n, w->reuse_n, w->kernel_time, w->kernel_time / multi->wall * 100);
+        overflow += w->overflow;
+        if (compare_naive)
+            stage_pool_report(w->pool, w->name);
+    }
+    if (overflow > 0)
+        printf("%zu values of A and B are out of the range of half\n", overflow);
+}
+
+// C = A * B with gemm, where ld holds the leading dimensions of A, B and C.
+// Strassen-Winograd recurses down to the crossover given with -S, or to the
+// one tuned for device, and multiplies the leaves with gemm.
+void multiply(float *a, float *b, float *c, size_t *dim, size_t *ld, gemm_fn gemm,
+    cl_device_id device, int compare) {
+    if (use_strassen) {
+        size_t crossover = strassen_crossover;
+        char params[256];
+        if (crossover == 0 && (!tune_lookup(device, "strassen", params, sizeof(params))
+                || sscanf(params, "crossover=%zu", &crossover) != 1))
+            crossover = STRASSEN_CROSSOVER;
+        strassen_mul(dim[1], dim[0], dim[2], a, ld[0], b, ld[1], c, ld[2],
+            crossover, gemm, compare);
+    } else {
+        gemm(dim[1], dim[0], dim[2], a, ld[0], b, ld[1], 0.0f, c, ld[2]);
+    }
+}
+
+void mat_mul(float *a, float *b, float *c,
+    size_t *dim, size_t *ld, size_t *global_size, size_t *local_size) {
+    cl_int err;
+
+    // -H would turn values beyond the range of half into infinities
+    int half = half_storage;
+    if (half && (!fits_half(a, dim[1], dim[2], ld[0]) || !fits_half(b, dim[2], dim[0], ld[1]))) {
+        fprintf(stderr, "-H: A or B has values beyond the range of half, storing them as fp32\n");
+        half = 0;
+    }
+
+    // With -m the tiles go to every device instead of the first GPU
+    if (multi_device) {
+        multi_init(global_size, local_size, half);
+        multiply(a, b, c, dim, ld, gemm_multi, multi->workers[0].device, compare_naive);
+        multi_report();
+        multi_release();
+        return;
     }
 
-    if (xHost != -1) {
-        err = clWaitForEvents(1, &event[1]);
+    engine_init(global_size, local_size, half);
+    prof_begin("product");
+    multiply(a, b, c, dim, ld, gemm_opencl, engine->device, compare_naive);
+    double product_time = prof_end();
+
+    // Achieved rate of the kernel alone, without transfers
+    const struct variant *variant = engine->variant;
+    size_t *block = engine->last;
+    printf("Kernel %s : %lf sec, %.1lf GFLOPS\n", variant != NULL ? variant->name : "naive",
+        engine->kernel_time, engine->flop / engine->kernel_time * 1e-9);
+    engine_report_transfers();
+
+    // Time the naive kernel on one block for comparison
+    if (compare_naive && variant != NULL && engine->launch_n > 0) {
+        cl_kernel naive = engine->naive;
+        err = clSetKernelArg(naive, 0, sizeof(cl_mem), &engine->memA[0]);
+        CHECK_ERROR(err);
+        err = clSetKernelArg(naive, 1, sizeof(cl_mem), &engine->memB[0]);
         CHECK_ERROR(err);
-        for (int x = 0; x < global_size[1]; ++x) {
-            for (int y = 0; y < global_size[0]; ++y) {
-                c[(xHost + x) * dim[0] + (yHost + y)] += bufC[x * global_size[0] + y];
+        err = clSetKernelArg(naive, 2, sizeof(cl_mem), &engine->rowC[0]);
+        CHECK_ERROR(err);
+        err = clSetKernelArg(naive, 3, sizeof(cl_ulong), &block[1]);
+        CHECK_ERROR(err);
+        err = clSetKernelArg(naive, 4, sizeof(cl_ulong), &block[2]);
+        CHECK_ERROR(err);
+        err = clSetKernelArg(naive, 5, sizeof(cl_ulong), &block[0]);
+        CHECK_ERROR(err);
+        cl_float beta = 0.0f;
+        err = clSetKernelArg(naive, 6, sizeof(cl_float), &beta);
+        CHECK_ERROR(err);
+
+        size_t kernel_global[2], kernel_local[2];
+        variant_range(NULL, block, engine->local, kernel_global, kernel_local);
+        cl_event naive_event;
+        err = clEnqueueNDRangeKernel(engine->queueSM, naive, 2, NULL,
+            kernel_global, kernel_local, 0, NULL, &naive_event);
+        CHECK_ERROR(err);
+        err = clWaitForEvents(1, &naive_event);
+        CHECK_ERROR(err);
+        double naive_time = event_time(naive_event);
+        double block_flop = 2.0 * block[0] * block[1] * block[2];
+        printf("Kernel naive : %.1lf GFLOPS on one block, %s is %.2lfx faster\n",
+            block_flop / naive_time * 1e-9, variant->name,
+            (engine->flop / engine->kernel_time) / (block_flop / naive_time));
+        clReleaseEvent(naive_event);
+    }
+
+    // Host time the staging copies would have cost: the blocks of A and B
+    // the product uploads, each A block once per row, repacked one by one
+    if (compare_naive && engine->staged && engine->launch_n > 0) {
+        printf("Host time issuing blocks : %lf sec, staging included\n", engine->issue_time);
+    } else if (compare_naive && engine->launch_n > 0) {
+        size_t a_size = block[1] * block[2], b_size = block[2] * block[0];
+        float *buf = (float*)malloc(sizeof(float) * (a_size > b_size ? a_size : b_size));
+        prof_begin("repack");
+        for (size_t i = 0; i < dim[1]; i += block[1]) {
+            size_t rows = dim[1] - i < block[1] ? dim[1] - i : block[1];
+            for (size_t l = 0; l < dim[2]; l += block[2]) {
+                size_t depth = dim[2] - l < block[2] ? dim[2] - l : block[2];
+                in2buf(a, buf, rows, depth, ld[0], i, l);
+                for (size_t j = 0; j < dim[0]; j += block[0]) {
+                    size_t cols = dim[0] - j < block[0] ? dim[0] - j : block[0];
+                    in2buf(b, buf, depth, cols, ld[1], l, j);
+                }
             }
         }
+        double repack_time = prof_end();
+        free(buf);
+        printf("Host time issuing blocks : %lf sec, repacking them took %lf sec%s\n",
+            engine->issue_time, repack_time,
+            use_strassen ? " (blocks of the whole product, not of the Strassen leaves)" : "");
     }
+    if (compare_naive)
+        stage_pool_report(engine->pool, "engine");
 
-    if (num_events > 0) {
-        err = clWaitForEvents(num_events, event);
-        CHECK_ERROR(err);
+    double kernel_time = engine->kernel_time;
+    size_t overflow = engine->overflow;
+    engine_release();
+    if (overflow > 0)
+        printf("%zu values of A and B are out of the range of half\n", overflow);
+
+    // The same product with A and B stored as float, to weigh the
+    // transfers half storage saves against the error it adds
+    if (half && compare_naive) {
+        float *ref = (float*)malloc(sizeof(float) * dim[1] * dim[0]);
+        engine_init(global_size, local_size, 0);
+        prof_begin("fp32 storage");
+        size_t ref_ld[3] = { ld[0], ld[1], dim[0] };
+        multiply(a, b, ref, dim, ref_ld, gemm_opencl, engine->device, 0);
+        double ref_time = prof_end();
+        double ref_kernel_time = engine->kernel_time;
+        engine_release();
+
+        double norm, ref_norm;
+        double err = gemm_sample_error(dim[1], dim[0], dim[2], a, ld[0], b, ld[1], c, ld[2], &norm);
+        double ref_err = gemm_sample_error(dim[1], dim[0], dim[2], a, ld[0], b, ld[1], ref, dim[0], &ref_norm);
+        free(ref);
+        printf("fp32 storage : %lf sec, max relative error %.3e (normwise %.3e)\n",
+            ref_time, ref_err, ref_norm);
+        printf("Half storage : %lf sec, max relative error %.3e (normwise %.3e), %.2lfx faster (kernels %.2lfx)\n",
+            product_time, err, norm, ref_time / product_time, ref_kernel_time / kernel_time);
+    }
+}
+
+// C = A * B for matrices in files larger than host memory, streamed
+// through budget bytes of blocks that the engine multiplies, or every
+// device with -m. Returns 1 on success.
+int mat_mul_out_of_core(struct matfile *a, struct matfile *b, struct matfile *c, size_t budget,
+    size_t *global_size, size_t *local_size) {
+    int ok;
+
+    int half = half_storage;
+    if (half && (!stream_fits_half(a) || !stream_fits_half(b))) {
+        fprintf(stderr, "-H: A or B has values beyond the range of half, storing them as fp32\n");
+        half = 0;
     }
 
-    if (xSM != -1) {
-        err = clEnqueueReadBuffer(queueIO, memC[swC], CL_FALSE, 0,
-            sizeof(float) * global_size[0] * global_size[1],
-            bufC, 0, NULL, &event[1]);
+    if (multi_device) {
+        multi_init(global_size, local_size, half);
+        ok = gemm_out_of_core(gemm_multi, a, b, c, budget);
+        multi_report();
+        multi_release();
+        return ok;
+    }
+
+    engine_init(global_size, local_size, half);
+    ok = gemm_out_of_core(gemm_opencl, a, b, c, budget);
+    const struct variant *variant = engine->variant;
+    if (engine->launch_n > 0)
+        printf("Kernel %s : %lf sec, %.1lf GFLOPS\n", variant != NULL ? variant->name : "naive",
+            engine->kernel_time, engine->flop / engine->kernel_time * 1e-9);
+    engine_report_transfers();
+    if (engine->overflow > 0)
+        printf("%zu values of A and B are out of the range of half\n", engine->overflow);
+    engine_release();
+    return ok;
+}
+
+// Profiled time of one run of kernel, after a warm-up run
+double time_kernel(cl_command_queue queue, cl_kernel kernel, size_t *kernel_global, size_t *kernel_local) {
+    cl_int err;
+    cl_event event;
+    double t;
+
+    err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, kernel_global, kernel_local, 0, NULL, NULL);
+    CHECK_ERROR(err);
+    err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, kernel_global, kernel_local, 0, NULL, &event);
+    CHECK_ERROR(err);
+    err = clWaitForEvents(1, &event);
+    CHECK_ERROR(err);
+    t = event_time(event);
+    clReleaseEvent(event);
+    return t;
+}
+
+// Time variant t (naive if NULL) on a square block of size b. Returns the
+// GFLOPS of the kernel alone, or with transfer set the rate of the block
+// pipeline, where uploads of A and B and the read back of C overlap with
+// the kernel.
+double time_variant(cl_context context, cl_device_id device, cl_command_queue queue,
+    const struct variant *t, size_t *local_size, size_t b, float *host, int transfer) {
+    cl_int err;
+    size_t block[3] = { b, b, b };
+    char options[256];
+    size_t kernel_global[2], kernel_local[2];
+    cl_ulong col = b;
+
+    variant_options(t, options, sizeof(options));
+    variant_range(t, block, local_size, kernel_global, kernel_local);
+    cl_program program = build_program(context, device, options);
+    cl_kernel kernel = clCreateKernel(program, t != NULL ? "mat_mul_tiled" : "mat_mul", &err);
+    CHECK_ERROR(err);
+
+    cl_mem mem[3];
+    for (int m = 0; m < 3; ++m) {
+        mem[m] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * b * b, NULL, &err);
         CHECK_ERROR(err);
-        swC ^= 1;
-        err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &memC[swC]);
+        err = clSetKernelArg(kernel, m, sizeof(cl_mem), &mem[m]);
         CHECK_ERROR(err);
-        xHost = xSM; yHost = ySM;
     }
+    for (int d = 3; d < 6; ++d) {
+        err = clSetKernelArg(kernel, d, sizeof(cl_ulong), &col);
+        CHECK_ERROR(err);
+    }
+    cl_float beta = 1.0f;
+    err = clSetKernelArg(kernel, 6, sizeof(cl_float), &beta);
+    CHECK_ERROR(err);
 
-    if (xHost != -1) {
-        err = clWaitForEvents(1, &event[1]);
+    double io_time = 0.0;
+    for (int m = 0; m < 3; ++m) {
+        cl_event event;
+        if (m < 2)
+            err = clEnqueueWriteBuffer(queue, mem[m], CL_FALSE, 0, sizeof(float) * b * b,
+                host, 0, NULL, &event);
+        else
+            err = clEnqueueReadBuffer(queue, mem[m], CL_FALSE, 0, sizeof(float) * b * b,
+                host, 0, NULL, &event);
         CHECK_ERROR(err);
-        for (int x = 0; x < global_size[1]; ++x) {
-            for (int y = 0; y < global_size[0]; ++y) {
-                c[(xHost + x) * dim[0] + (yHost + y)] += bufC[x * global_size[0] + y];
-            }
-        }
+        err = clWaitForEvents(1, &event);
+        CHECK_ERROR(err);
+        io_time += event_time(event);
+        clReleaseEvent(event);
     }
 
-    free(bufA);
-    free(bufB);
-    free(bufC);
-    clReleaseMemObject(memA[0]);
-    clReleaseMemObject(memA[1]);
-    clReleaseMemObject(memB[0]);
-    clReleaseMemObject(memB[1]);
-    clReleaseMemObject(memC[0]);
-    clReleaseMemObject(memC[1]);
+    double kernel_time = time_kernel(queue, kernel, kernel_global, kernel_local);
+    double flop = 2.0 * b * b * b;
+    if (transfer && io_time > kernel_time)
+        kernel_time = io_time;
 
+    for (int m = 0; m < 3; ++m)
+        clReleaseMemObject(mem[m]);
     clReleaseKernel(kernel);
     clReleaseProgram(program);
-    clReleaseCommandQueue(queueIO);
-    clReleaseCommandQueue(queueSM);
+    return flop / kernel_time * 1e-9;
+}
+
+// Search kernel variants, work-group shapes and block sizes for the device
+// and store the fastest in the tuning database, then the Strassen-Winograd
+// crossover on top of them
+void mat_mul_tune(size_t *global_size, size_t *local_size) {
+    cl_int err;
+
+    cl_platform_id platform;
+    err = clGetPlatformIDs(1, &platform, NULL);
+    CHECK_ERROR(err);
+
+    cl_device_id device;
+    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
+    CHECK_ERROR(err);
+
+    cl_context context;
+    context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+    CHECK_ERROR(err);
+
+    cl_command_queue queue;
+    queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+    CHECK_ERROR(err);
+
+    cl_ulong global_mem, max_alloc;
+    size_t max_group;
+    err = clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+    CHECK_ERROR(err);
+    err = clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+    CHECK_ERROR(err);
+    err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+    CHECK_ERROR(err);
+
+    // Square blocks up to the caller's block size; the pipeline holds two
+    // of each of A, B and C
+    size_t blocks[8];
+    int block_n = 0;
+    for (size_t b = global_size[0]; b >= 256 && block_n < 8; b /= 2) {
+        if (sizeof(float) * b * b <= max_alloc && 6 * sizeof(float) * b * b <= global_mem)
+            blocks[block_n++] = b;
+    }
+    if (block_n == 0) {
+        printf("No block size fits the device\n");
+        return;
+    }
+
+    size_t b = blocks[0];
+    float *host = (float*)malloc(sizeof(float) * b * b);
+    for (size_t i = 0; i < b * b; ++i)
+        host[i] = 1.0f;
+
+    static const size_t locals[][2] = { { 8, 8 }, { 16, 8 }, { 16, 16 }, { 32, 8 }, { 32, 16 }, { 32, 32 } };
+    static const int tiles[] = { 32, 64, 128 }, steps[] = { 8, 16, 32 }, works[] = { 2, 4, 8 };
+    struct variant best = { "tuned", 0, 0, 0, 0, 0 };
+    size_t best_local[2] = { local_size[0], local_size[1] };
+    double best_rate = 0.0, rate;
+
+    printf("Kernels on %zu x %zu blocks:\n", b, b);
+    for (int l = 0; l < sizeof(locals) / sizeof(locals[0]); ++l) {
+        size_t local[2] = { locals[l][0], locals[l][1] };
+        if (local[0] * local[1] > max_group)
+            continue;
+        rate = time_variant(context, device, queue, NULL, local, b, host, 0);
+        printf("  naive %zux%zu : %.1lf GFLOPS\n", local[0], local[1], rate);
+        if (rate > best_rate) {
+            best_rate = rate;
+            best_local[0] = local[0];
+            best_local[1] = local[1];
+        }
+    }
+    for (int x = 0; x < sizeof(tiles) / sizeof(tiles[0]); ++x) {
+        for (int y = 0; y < sizeof(steps) / sizeof(steps[0]); ++y) {
+            for (int z = 0; z < sizeof(works) / sizeof(works[0]); ++z) {
+                struct variant t = { "tuned", tiles[x], tiles[x], steps[y], works[z], works[z] };
+                if (t.ts_m / t.wpt_m < 4 || !variant_fits(device, &t))
+                    continue;
+                rate = time_variant(context, device, queue, &t, best_local, b, host, 0);
+                printf("  tiled %d/%d/%d %dx%d : %.1lf GFLOPS\n", t.ts_m, t.ts_n, t.ts_k,
+                    t.wpt_m, t.wpt_n, rate);
+                if (rate > best_rate) {
+                    best_rate = rate;
+                    best = t;
+                }
+            }
+        }
+    }
+
+    // Block size for the fastest kernel, counting transfers
+    size_t best_block = b;
+    best_rate = 0.0;
+    printf("Block sizes:\n");
+    for (int i = 0; i < block_n; ++i) {
+        rate = time_variant(context, device, queue, best.ts_m > 0 ? &best : NULL,
+            best_local, blocks[i], host, 1);
+        printf("  %zu : %.1lf GFLOPS\n", blocks[i], rate);
+        if (rate > best_rate) {
+            best_rate = rate;
+            best_block = blocks[i];
+        }
+    }
+
+    char params[256];
+    snprintf(params, sizeof(params), "block=%zu,%zu,%zu local=%zu,%zu tile=%d,%d,%d,%d,%d",
+        best_block, best_block, best_block, best_local[0], best_local[1],
+        best.ts_m, best.ts_n, best.ts_k, best.wpt_m, best.wpt_n);
+    printf("Tuned: %s\n", params);
+    if (!tune_store(device, "mat_mul", params))
+        printf("Failed to store the tuning\n");
+
+    free(host);
+    clReleaseCommandQueue(queue);
     clReleaseContext(context);
+
+    // Strassen-Winograd crossover with the tuned kernel at the leaves
+    engine_init(global_size, local_size, 0);
+    size_t crossover = strassen_tune(gemm_opencl, 2 * best_block);
+    snprintf(params, sizeof(params), "crossover=%zu", crossover);
+    printf("Tuned: %s\n", params);
+    if (!tune_store(engine->device, "strassen", params))
+        printf("Failed to store the tuning\n");
+    engine_release();
+}
+
+// Kernels gemm_bench times on the engine's device: the naive one, every
+// variant that fits and the tuned one if the database has an entry. Each is
+// built once and kept until bench_release.
+#define BENCH_KERNELS (2 + sizeof(variants) / sizeof(variants[0]))
+#define PEAK_ITERS 4096
+
+struct bench {
+    int n;
+    const struct variant *variant[BENCH_KERNELS];   // NULL for naive
+    cl_program program[BENCH_KERNELS];
+    cl_kernel kernel[BENCH_KERNELS];
+};
+
+static struct bench *bench = NULL;
+
+// Set names to the kernels of the engine's device; returns their number
+int bench_kernels(const char **names) {
+    cl_int err;
+
+    if (bench == NULL) {
+        bench = (struct bench*)calloc(1, sizeof(struct bench));
+        bench->variant[bench->n++] = NULL;
+        for (int v = 0; v < sizeof(variants) / sizeof(variants[0]); ++v) {
+            if (variant_fits(engine->device, &variants[v]))
+                bench->variant[bench->n++] = &variants[v];
+        }
+        if (engine->variant == &engine->tuned)
+            bench->variant[bench->n++] = &engine->tuned;
+
+        for (int k = 0; k < bench->n; ++k) {
+            char options[256];
+            variant_options(bench->variant[k], options, sizeof(options));
+            bench->program[k] = build_program(engine->context, engine->device, options);
+            bench->kernel[k] = clCreateKernel(bench->program[k],
+                bench->variant[k] != NULL ? "mat_mul_tiled" : "mat_mul", &err);
+            CHECK_ERROR(err);
+        }
+    }
+    for (int k = 0; k < bench->n; ++k)
+        names[k] = bench->variant[k] != NULL ? bench->variant[k]->name : "naive";
+    return bench->n;
+}
+
+void bench_release() {
+    if (bench == NULL)
+        return;
+    for (int k = 0; k < bench->n; ++k) {
+        clReleaseKernel(bench->kernel[k]);
+        clReleaseProgram(bench->program[k]);
+    }
+    free(bench);
+    bench = NULL;
+}
+
+// Profiled seconds of reps runs of kernel on an m x k by k x n product held
+// in device memory, after warmup runs that are not counted. Returns 0 if
+// the matrices do not fit the device.
+int bench_kernel(int kernel, size_t m, size_t n, size_t k, int warmup, int reps, double *times) {
+    cl_int err;
+    cl_ulong global_mem, max_alloc;
+
+    err = clGetDeviceInfo(engine->device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+    CHECK_ERROR(err);
+    err = clGetDeviceInfo(engine->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+    CHECK_ERROR(err);
+    size_t size[3] = { sizeof(float) * m * k, sizeof(float) * k * n, sizeof(float) * m * n };
+    if (size[0] > max_alloc || size[1] > max_alloc || size[2] > max_alloc
+            || size[0] + size[1] + size[2] > global_mem)
+        return 0;
+
+    cl_kernel kern = bench->kernel[kernel];
+    cl_mem mem[3];
+    for (int i = 0; i < 3; ++i) {
+        // Filled, so no NaN or denormal garbage slows the kernel down
+        cl_float one = 1.0f;
+        mem[i] = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, size[i], NULL, &err);
+        CHECK_ERROR(err);
+        err = clEnqueueFillBuffer(engine->queueSM, mem[i], &one, sizeof(one), 0, size[i], 0, NULL, NULL);
+        CHECK_ERROR(err);
+        err = clSetKernelArg(kern, i, sizeof(cl_mem), &mem[i]);
+        CHECK_ERROR(err);
+    }
+    cl_ulong rows = m, depth = k, cols = n;
+    cl_float beta = 0.0f;
+    err = clSetKernelArg(kern, 3, sizeof(cl_ulong), &rows);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kern, 4, sizeof(cl_ulong), &depth);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kern, 5, sizeof(cl_ulong), &cols);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(kern, 6, sizeof(cl_float), &beta);
+    CHECK_ERROR(err);
+
+    size_t shape[3] = { n, m, k };
+    size_t kernel_global[2], kernel_local[2];
+    variant_range(bench->variant[kernel], shape, engine->local, kernel_global, kernel_local);
+    for (int r = 0; r < warmup + reps; ++r) {
+        cl_event event;
+        err = clEnqueueNDRangeKernel(engine->queueSM, kern, 2, NULL,
+            kernel_global, kernel_local, 0, NULL, &event);
+        CHECK_ERROR(err);
+        err = clWaitForEvents(1, &event);
+        CHECK_ERROR(err);
+        if (r >= warmup)
+            times[r - warmup] = event_time(event);
+        clReleaseEvent(event);
+    }
+
+    for (int i = 0; i < 3; ++i)
+        clReleaseMemObject(mem[i]);
+    return 1;
+}
+
+// Measured peaks of the engine's device: GFLOPS of mad chains, GB/s of a
+// device-to-device copy and of uploads from the host, each the best of
+// three runs after a warm-up
+void bench_peak(char *name, size_t name_len, double *gflops, double *device_gbps, double *link_gbps) {
+    cl_int err;
+    cl_uint units;
+    size_t max_group;
+    cl_ulong max_alloc;
+
+    err = clGetDeviceInfo(engine->device, CL_DEVICE_NAME, name_len, name, NULL);
+    CHECK_ERROR(err);
+    err = clGetDeviceInfo(engine->device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+    CHECK_ERROR(err);
+    err = clGetDeviceInfo(engine->device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+    CHECK_ERROR(err);
+    err = clGetDeviceInfo(engine->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+    CHECK_ERROR(err);
+
+    // Enough work-groups to fill every compute unit a few times over
+    size_t items = (size_t)units * max_group * 4;
+    size_t bytes = max_alloc < ((size_t)256 << 20) ? (size_t)max_alloc : (size_t)256 << 20;
+    bytes -= bytes % 16;
+    cl_mem out = clCreateBuffer(engine->context, CL_MEM_WRITE_ONLY, sizeof(float) * items, NULL, &err);
+    CHECK_ERROR(err);
+    cl_mem mem[2];
+    for (int i = 0; i < 2; ++i) {
+        mem[i] = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, bytes, NULL, &err);
+        CHECK_ERROR(err);
+    }
+    float *host = (float*)calloc(bytes, 1);
+
+    cl_kernel flops = clCreateKernel(engine->program, "peak_flops", &err);
+    CHECK_ERROR(err);
+    cl_kernel copy = clCreateKernel(engine->program, "peak_copy", &err);
+    CHECK_ERROR(err);
+    cl_float x = 1.0f;
+    cl_int iters = PEAK_ITERS;
+    err = clSetKernelArg(flops, 0, sizeof(cl_mem), &out);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(flops, 1, sizeof(cl_float), &x);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(flops, 2, sizeof(cl_int), &iters);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(copy, 0, sizeof(cl_mem), &mem[0]);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(copy, 1, sizeof(cl_mem), &mem[1]);
+    CHECK_ERROR(err);
+
+    double best[3] = { 1e30, 1e30, 1e30 };
+    for (int r = 0; r < 4; ++r) {
+        cl_event event[3];
+        size_t copy_items = bytes / 16;
+        err = clEnqueueNDRangeKernel(engine->queueSM, flops, 1, NULL, &items, NULL, 0, NULL, &event[0]);
+        CHECK_ERROR(err);
+        err = clEnqueueNDRangeKernel(engine->queueSM, copy, 1, NULL, &copy_items, NULL, 0, NULL, &event[1]);
+        CHECK_ERROR(err);
+        err = clEnqueueWriteBuffer(engine->queueSM, mem[0], CL_FALSE, 0, bytes, host, 0, NULL, &event[2]);
+        CHECK_ERROR(err);
+        err = clWaitForEvents(3, event);
+        CHECK_ERROR(err);
+        for (int i = 0; i < 3; ++i) {
+            double t = event_time(event[i]);
+            if (r > 0 && t < best[i])
+                best[i] = t;
+            clReleaseEvent(event[i]);
+        }
+    }
+    *gflops = (double)items * iters * 64 / best[0] * 1e-9;
+    *device_gbps = 2.0 * bytes / best[1] * 1e-9;
+    *link_gbps = (double)bytes / best[2] * 1e-9;
+
+    free(host);
+    clReleaseKernel(flops);
+    clReleaseKernel(copy);
+    clReleaseMemObject(out);
+    clReleaseMemObject(mem[0]);
+    clReleaseMemObject(mem[1]);
 }
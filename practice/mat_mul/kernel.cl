@@ -8,3 +8,21 @@ __kernel void mat_mul(__global float *A, __global float *B, __global float *C, i
         C[i + j * COL_B] = s;
     }
 }
+
+// One product of a batch per index of the third dimension. desc holds, for
+// each, ROW_A, COL_A, COL_B and the offsets of its A, B and C in the packed
+// buffers. The NDRange covers the largest product of the batch, so
+// work-items outside a smaller one do nothing.
+__kernel void mat_mul_batched(__global float *A, __global float *B, __global float *C, __global ulong *desc) {
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    __global ulong *d = desc + get_global_id(2) * 6;
+    int ROW_A = d[0], COL_A = d[1], COL_B = d[2];
+    float s = 0.0f;
+    if (i < COL_B && j < ROW_A) {
+        __global float *a = A + d[3], *b = B + d[4];
+        for (int k = 0; k < COL_A; ++k)
+            s += a[k + j * COL_A] * b[i + k * COL_B];
+        C[d[5] + i + j * COL_B] = s;
+    }
+}
@@ -3,11 +3,21 @@
 #include <math.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include "verify.h"
 
 static int ROW_A = 1000;
 static int COL_A = 1000;
 static int COL_B = 1000;
 
+// Freivalds' test, or the spot-check with verification option 1
+static int VERIFY_ROUNDS = 3;
+static int VERIFY_SAMPLES = 1000;
+static double VERIFY_TOL = 1e-4;
+
+// Products of up to BATCH_SIZE x BATCH_SIZE x BATCH_SIZE for option 3
+static int BATCH_COUNT = 4096;
+static int BATCH_SIZE = 32;
+
 double get_time() {
   struct timeval tv;
   gettimeofday(&tv, NULL);
@@ -18,16 +28,27 @@ void mat_mul_seq(float *A, float *B, float *C,
                  int ROW_A, int COL_A, int COL_B);
 void mat_mul_opencl(float *A, float *B, float *C,
                     int ROW_A, int COL_A, int COL_B);
+void mat_mul_cpu(float *A, float *B, float *C,
+                 int ROW_A, int COL_A, int COL_B);
+void mat_mul_batch_bench(int count, int size);
 void verify(float *A, float *B, float *C,
-            int ROW_A, int COL_A, int COL_B);
+            int ROW_A, int COL_A, int COL_B, int mode);
 
 int main(int argc, char *argv[]) {
   if (argc < 2) {
-    printf("Usage: %s <option>\n", argv[0]);
+    printf("Usage: %s <option> [verification]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
   int option = atoi(argv[1]);
+  int mode = argc > 2 ? atoi(argv[2]) : 0;
+
+  // Batches check every product themselves
+  if (option == 3) {
+    printf("Batched OpenCL version...\n");
+    mat_mul_batch_bench(BATCH_COUNT, BATCH_SIZE);
+    return 0;
+  }
 
   float *A = (float*)malloc(sizeof(float) * ROW_A * COL_A);
   float *B = (float*)malloc(sizeof(float) * COL_A * COL_B);
@@ -57,6 +78,9 @@ int main(int argc, char *argv[]) {
   } else if (option == 1) {
     printf("OpenCL version...\n");
     mat_mul_opencl(A, B, C, ROW_A, COL_A, COL_B);
+  } else if (option == 2) {
+    printf("CPU SGEMM version...\n");
+    mat_mul_cpu(A, B, C, ROW_A, COL_A, COL_B);
   } else {
     printf("Invalid option!\n");
     exit(EXIT_FAILURE);
@@ -65,7 +89,7 @@ int main(int argc, char *argv[]) {
   double end_time = get_time();
   printf("Elapsed time: %f sec\n", end_time - start_time);
 
-  verify(A, B, C, ROW_A, COL_A, COL_B);
+  verify(A, B, C, ROW_A, COL_A, COL_B, mode);
 
   free(A);
   free(B);
@@ -74,22 +98,22 @@ int main(int argc, char *argv[]) {
 }
 
 void verify(float *A, float *B, float *C,
-            int ROW_A, int COL_A, int COL_B) {
-  int i, j, k;
-  float sum;
+            int ROW_A, int COL_A, int COL_B, int mode) {
+  int passed;
+  double start_time = get_time();
 
-  for (i = 0; i < ROW_A; i++) {
-    for (j = 0; j < COL_B; j++) {
-      sum = 0.0f;
-      for (k = 0; k < COL_A; k++) {
-        sum += A[i * COL_A + k] * B[k * COL_B + j];
-      }
-      if (fabsf(C[i * COL_B + j] - sum) > 0.1) {
-        printf("Verification failed! C[%d][%d]: %f vs. %f\n",
-               i, j, C[i * COL_B + j], sum);
-        return;
-      }
-    }
+  if (mode == 1) {
+    passed = verify_sampled(ROW_A, COL_B, COL_A, A, COL_A, B, COL_B, C, COL_B,
+                            VERIFY_SAMPLES, VERIFY_TOL);
+  } else {
+    passed = verify_freivalds(ROW_A, COL_B, COL_A, A, COL_A, B, COL_B, C, COL_B,
+                              VERIFY_ROUNDS, VERIFY_TOL);
+  }
+  printf("Verification time: %f sec\n", get_time() - start_time);
+
+  if (passed) {
+    printf("Verification success!\n");
+  } else {
+    printf("Verification failed!\n");
   }
-  printf("Verification success!\n");
 }
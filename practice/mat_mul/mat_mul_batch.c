@@ -0,0 +1,395 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#define CHECK_ERROR(err) \
+  if (err != CL_SUCCESS) { \
+    printf("[%s:%d] OpenCL error %d\n", __FILE__, __LINE__, err); \
+    exit(EXIT_FAILURE); \
+  }
+
+// Entries of the descriptor of a product in the batch: ROW_A, COL_A, COL_B
+// and the offsets of A, B and C in the packed buffers; see kernel.cl
+#define DESC_LEN 6
+
+double get_time();
+char *get_source_code(const char *file_name, size_t *len);
+void mat_mul_seq(float *A, float *B, float *C,
+                 int ROW_A, int COL_A, int COL_B);
+
+// OpenCL state kept across batches, so that a batch only pays for packing,
+// transfers and one launch. Buffers grow to the largest batch seen.
+struct batch {
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem memA, memB, memC, memD;
+    size_t capA, capB, capC, capD;  // sizes of the buffers in bytes
+};
+
+static struct batch *batch = NULL;
+
+static void batch_init() {
+    cl_int err;
+
+    batch = (struct batch*)calloc(1, sizeof(struct batch));
+
+    cl_platform_id platform;
+    err = clGetPlatformIDs(1, &platform, NULL);
+    CHECK_ERROR(err);
+
+    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &batch->device, NULL);
+    CHECK_ERROR(err);
+
+    batch->context = clCreateContext(NULL, 1, &batch->device, NULL, NULL, &err);
+    CHECK_ERROR(err);
+
+    batch->queue = clCreateCommandQueue(batch->context, batch->device,
+        CL_QUEUE_PROFILING_ENABLE, &err);
+    CHECK_ERROR(err);
+
+    const char *source_code;
+    size_t source_size;
+    source_code = get_source_code("kernel.cl", &source_size);
+
+    batch->program = clCreateProgramWithSource(batch->context, 1, &source_code, &source_size, &err);
+    CHECK_ERROR(err);
+
+    err = clBuildProgram(batch->program, 1, &batch->device, "", NULL, NULL);
+    if (err == CL_BUILD_PROGRAM_FAILURE) {
+        char *log;
+        size_t log_size;
+        clGetProgramBuildInfo(batch->program, batch->device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+        log = (char*)malloc(log_size + 1);
+        clGetProgramBuildInfo(batch->program, batch->device, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+        log[log_size] = 0;
+        printf("Compile error:\n%s\n", log);
+        free(log);
+    }
+    CHECK_ERROR(err);
+    free((char*)source_code);
+
+    batch->kernel = clCreateKernel(batch->program, "mat_mul_batched", &err);
+    CHECK_ERROR(err);
+}
+
+void mat_mul_batch_release() {
+    if (batch == NULL)
+        return;
+    if (batch->memA != NULL)
+        clReleaseMemObject(batch->memA);
+    if (batch->memB != NULL)
+        clReleaseMemObject(batch->memB);
+    if (batch->memC != NULL)
+        clReleaseMemObject(batch->memC);
+    if (batch->memD != NULL)
+        clReleaseMemObject(batch->memD);
+    clReleaseKernel(batch->kernel);
+    clReleaseProgram(batch->program);
+    clReleaseCommandQueue(batch->queue);
+    clReleaseContext(batch->context);
+    free(batch);
+    batch = NULL;
+}
+
+// Make *mem hold at least size bytes
+static void reserve(cl_mem *mem, size_t *cap, size_t size, cl_mem_flags flags) {
+    cl_int err;
+
+    if (size <= *cap)
+        return;
+    if (*mem != NULL)
+        clReleaseMemObject(*mem);
+    *mem = clCreateBuffer(batch->context, flags, size, NULL, &err);
+    CHECK_ERROR(err);
+    *cap = size;
+}
+
+// Copy count matrices of rows[p] x cols[p] from M[p] into the mapped buffer
+// mem at the offsets in desc[p * DESC_LEN + entry], or back with unpack
+static void pack(cl_mem mem, size_t size, int count, float **M, const int *rows,
+    const int *cols, const cl_ulong *desc, int entry, int unpack) {
+    cl_int err;
+    float *mapped = (float*)clEnqueueMapBuffer(batch->queue, mem, CL_TRUE,
+        unpack ? CL_MAP_READ : CL_MAP_WRITE, 0, size, 0, NULL, NULL, &err);
+    CHECK_ERROR(err);
+
+    for (int p = 0; p < count; ++p) {
+        float *packed = mapped + desc[p * DESC_LEN + entry];
+        size_t bytes = sizeof(float) * rows[p] * cols[p];
+        if (unpack)
+            memcpy(M[p], packed, bytes);
+        else
+            memcpy(packed, M[p], bytes);
+    }
+
+    err = clEnqueueUnmapMemObject(batch->queue, mem, mapped, 0, NULL, NULL);
+    CHECK_ERROR(err);
+}
+
+// Matrices of elems floats, stride apart from one to the next in M, as one
+// strided batch passes them
+struct strided {
+    float *M;
+    size_t elems, stride;
+};
+
+// Distance between the matrices of s on the device: stride when they lie in
+// M as they may on the device, back to back when stride pads them
+static size_t strided_step(const struct strided *s) {
+    return s->stride <= s->elems ? s->stride : s->elems;
+}
+
+// Move the count matrices of s to or from mem in one transfer: a plain one
+// when they are laid out on the device as in M, and a rectangular one that
+// drops the padding between them otherwise. Reads block.
+static void transfer_strided(cl_mem mem, const struct strided *s, int count, int read) {
+    cl_int err;
+
+    if (s->elems == 0)
+        return;
+    if (strided_step(s) == s->stride) {
+        size_t bytes = sizeof(float) * ((count - 1) * s->stride + s->elems);
+        if (read)
+            err = clEnqueueReadBuffer(batch->queue, mem, CL_TRUE, 0, bytes, s->M, 0, NULL, NULL);
+        else
+            err = clEnqueueWriteBuffer(batch->queue, mem, CL_FALSE, 0, bytes, s->M, 0, NULL, NULL);
+        CHECK_ERROR(err);
+        return;
+    }
+    size_t origin[3] = {0, 0, 0};
+    size_t region[3] = {sizeof(float) * s->elems, count, 1};
+    if (read)
+        err = clEnqueueReadBufferRect(batch->queue, mem, CL_TRUE, origin, origin, region,
+            sizeof(float) * s->elems, 0, sizeof(float) * s->stride, 0, s->M, 0, NULL, NULL);
+    else
+        err = clEnqueueWriteBufferRect(batch->queue, mem, CL_FALSE, origin, origin, region,
+            sizeof(float) * s->elems, 0, sizeof(float) * s->stride, 0, s->M, 0, NULL, NULL);
+    CHECK_ERROR(err);
+}
+
+// C[p] = A[p] * B[p] for count products of ROW_A[p] x COL_A[p] and
+// COL_A[p] x COL_B[p] row-major matrices, packed back to back and computed
+// by one launch with the product index as the third dimension. With
+// strided, the matrices come from its three strided blocks instead of A, B
+// and C, one transfer each.
+static void run_batch(const char *name, int count, const int *ROW_A, const int *COL_A,
+    const int *COL_B, float **A, float **B, float **C, const struct strided *strided) {
+    cl_int err;
+
+    if (count <= 0)
+        return;
+    if (batch == NULL)
+        batch_init();
+
+    double start_time = get_time();
+
+    cl_ulong *desc = (cl_ulong*)malloc(sizeof(cl_ulong) * DESC_LEN * count);
+    size_t sizeA = 0, sizeB = 0, sizeC = 0;
+    int max_rows = 0, max_cols = 0;
+    double flop = 0.0;
+    for (int p = 0; p < count; ++p) {
+        cl_ulong *d = &desc[p * DESC_LEN];
+        d[0] = ROW_A[p];
+        d[1] = COL_A[p];
+        d[2] = COL_B[p];
+        d[3] = sizeA;
+        d[4] = sizeB;
+        d[5] = sizeC;
+        sizeA += (size_t)ROW_A[p] * COL_A[p];
+        sizeB += (size_t)COL_A[p] * COL_B[p];
+        sizeC += (size_t)ROW_A[p] * COL_B[p];
+        if (ROW_A[p] > max_rows)
+            max_rows = ROW_A[p];
+        if (COL_B[p] > max_cols)
+            max_cols = COL_B[p];
+        flop += 2.0 * ROW_A[p] * COL_A[p] * COL_B[p];
+    }
+    if (strided != NULL) {
+        size_t *size[3] = {&sizeA, &sizeB, &sizeC};
+        for (int m = 0; m < 3; ++m) {
+            size_t step = strided_step(&strided[m]);
+            for (int p = 0; p < count; ++p)
+                desc[p * DESC_LEN + 3 + m] = p * step;
+            *size[m] = (count - 1) * step + strided[m].elems;
+        }
+    }
+
+    // Empty matrices still get a buffer, which may not be of size 0
+    sizeA = sizeof(float) * (sizeA > 0 ? sizeA : 1);
+    sizeB = sizeof(float) * (sizeB > 0 ? sizeB : 1);
+    sizeC = sizeof(float) * (sizeC > 0 ? sizeC : 1);
+    reserve(&batch->memA, &batch->capA, sizeA, CL_MEM_READ_ONLY);
+    reserve(&batch->memB, &batch->capB, sizeB, CL_MEM_READ_ONLY);
+    reserve(&batch->memC, &batch->capC, sizeC, CL_MEM_READ_WRITE);
+    reserve(&batch->memD, &batch->capD, sizeof(cl_ulong) * DESC_LEN * count, CL_MEM_READ_ONLY);
+
+    // Matrices are packed straight into the mapped device buffers, or
+    // moved a strided block at a time
+    if (strided != NULL) {
+        transfer_strided(batch->memA, &strided[0], count, 0);
+        transfer_strided(batch->memB, &strided[1], count, 0);
+    } else {
+        pack(batch->memA, sizeA, count, A, ROW_A, COL_A, desc, 3, 0);
+        pack(batch->memB, sizeB, count, B, COL_A, COL_B, desc, 4, 0);
+    }
+    err = clEnqueueWriteBuffer(batch->queue, batch->memD, CL_FALSE, 0,
+        sizeof(cl_ulong) * DESC_LEN * count, desc, 0, NULL, NULL);
+    CHECK_ERROR(err);
+
+    err = clSetKernelArg(batch->kernel, 0, sizeof(cl_mem), &batch->memA);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(batch->kernel, 1, sizeof(cl_mem), &batch->memB);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(batch->kernel, 2, sizeof(cl_mem), &batch->memC);
+    CHECK_ERROR(err);
+    err = clSetKernelArg(batch->kernel, 3, sizeof(cl_mem), &batch->memD);
+    CHECK_ERROR(err);
+
+    // The NDRange covers the largest product; small products get a
+    // work-group no larger than themselves
+    size_t global_size[3] = {max_cols > 0 ? max_cols : 1, max_rows > 0 ? max_rows : 1, count};
+    size_t local_size[3] = {16, 16, 1};
+    for (int i = 0; i < 2; ++i) {
+        while (local_size[i] > 1 && local_size[i] / 2 >= global_size[i])
+            local_size[i] /= 2;
+        global_size[i] = (global_size[i] + local_size[i] - 1) / local_size[i]
+            * local_size[i];
+    }
+
+    cl_event kernel_event;
+    err = clEnqueueNDRangeKernel(batch->queue, batch->kernel, 3, NULL, global_size, local_size,
+        0, NULL, &kernel_event);
+    CHECK_ERROR(err);
+
+    if (strided != NULL)
+        transfer_strided(batch->memC, &strided[2], count, 1);
+    else
+        pack(batch->memC, sizeC, count, C, ROW_A, COL_B, desc, 5, 1);
+    free(desc);
+
+    double elapsed = get_time() - start_time;
+    cl_ulong kernel_start, kernel_end;
+    err = clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_START,
+        sizeof(kernel_start), &kernel_start, NULL);
+    CHECK_ERROR(err);
+    err = clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_END,
+        sizeof(kernel_end), &kernel_end, NULL);
+    CHECK_ERROR(err);
+    clReleaseEvent(kernel_event);
+    double kernel_time = (kernel_end - kernel_start) * 1e-9;
+
+    printf("%s batch of %d: %f sec, %.2f GFLOPS (kernel %.2f GFLOPS)\n", name, count,
+        elapsed, flop / elapsed * 1e-9, flop / kernel_time * 1e-9);
+}
+
+// C[p] = A[p] * B[p] for count products of the same shape
+void mat_mul_batched(int count, int ROW_A, int COL_A, int COL_B,
+                     float **A, float **B, float **C) {
+    int *dims = (int*)malloc(sizeof(int) * 3 * count);
+    for (int p = 0; p < count; ++p) {
+        dims[p] = ROW_A;
+        dims[count + p] = COL_A;
+        dims[2 * count + p] = COL_B;
+    }
+    run_batch("Pointer", count, dims, dims + count, dims + 2 * count, A, B, C, NULL);
+    free(dims);
+}
+
+// C + p * stride_c = (A + p * stride_a) * (B + p * stride_b) for count
+// products of the same shape. A and B may overlap from one product to the
+// next, down to stride 0 for one matrix shared by all; the matrices of C
+// may not.
+void mat_mul_strided_batched(int count, int ROW_A, int COL_A, int COL_B,
+                             float *A, size_t stride_a, float *B, size_t stride_b,
+                             float *C, size_t stride_c) {
+    struct strided strided[3] = {
+        {A, (size_t)ROW_A * COL_A, stride_a},
+        {B, (size_t)COL_A * COL_B, stride_b},
+        {C, (size_t)ROW_A * COL_B, stride_c},
+    };
+    int *dims = (int*)malloc(sizeof(int) * 3 * count);
+    for (int p = 0; p < count; ++p) {
+        dims[p] = ROW_A;
+        dims[count + p] = COL_A;
+        dims[2 * count + p] = COL_B;
+    }
+    run_batch("Strided", count, dims, dims + count, dims + 2 * count, NULL, NULL, NULL, strided);
+    free(dims);
+}
+
+// C[p] = A[p] * B[p] for count products of shapes of their own
+void mat_mul_vbatched(int count, const int *ROW_A, const int *COL_A, const int *COL_B,
+                      float **A, float **B, float **C) {
+    run_batch("Variable-size", count, ROW_A, COL_A, COL_B, A, B, C, NULL);
+}
+
+// Largest difference of C from mat_mul_seq over the batch, relative to the
+// magnitude of the entries
+static double batch_error(int count, const int *ROW_A, const int *COL_A, const int *COL_B,
+    float **A, float **B, float **C) {
+    double worst = 0.0;
+    for (int p = 0; p < count; ++p) {
+        float *ref = (float*)malloc(sizeof(float) * ROW_A[p] * COL_B[p]);
+        mat_mul_seq(A[p], B[p], ref, ROW_A[p], COL_A[p], COL_B[p]);
+        for (int i = 0; i < ROW_A[p] * COL_B[p]; ++i) {
+            double diff = fabs(C[p][i] - ref[i]) / (fabs(ref[i]) + 1.0);
+            if (!(diff <= worst))
+                worst = diff;
+        }
+        free(ref);
+    }
+    return worst;
+}
+
+// Run count products of up to size x size x size through each entry point
+// and check them against the sequential version
+void mat_mul_batch_bench(int count, int size) {
+    int *dims = (int*)malloc(sizeof(int) * 3 * count);
+    int *ROW_A = dims, *COL_A = dims + count, *COL_B = dims + 2 * count;
+    float **M = (float**)malloc(sizeof(float*) * 3 * count);
+    float **A = M, **B = M + count, **C = M + 2 * count;
+    size_t stride_a = (size_t)size * size, stride_b = stride_a, stride_c = stride_a;
+    float *packedA = (float*)malloc(sizeof(float) * stride_a * count);
+    float *packedB = (float*)malloc(sizeof(float) * stride_b * count);
+    float *packedC = (float*)malloc(sizeof(float) * stride_c * count);
+
+    for (size_t i = 0; i < stride_a * count; ++i) {
+        packedA[i] = (float)(rand() % 1000) / 100.0f;
+        packedB[i] = (float)(rand() % 1000) / 100.0f;
+    }
+    for (int p = 0; p < count; ++p) {
+        ROW_A[p] = COL_A[p] = COL_B[p] = size;
+        A[p] = packedA + p * stride_a;
+        B[p] = packedB + p * stride_b;
+        C[p] = packedC + p * stride_c;
+    }
+
+    mat_mul_batched(count, size, size, size, A, B, C);
+    printf("Max relative error: %.3e\n", batch_error(count, ROW_A, COL_A, COL_B, A, B, C));
+
+    memset(packedC, 0, sizeof(float) * stride_c * count);
+    mat_mul_strided_batched(count, size, size, size, packedA, stride_a,
+        packedB, stride_b, packedC, stride_c);
+    printf("Max relative error: %.3e\n", batch_error(count, ROW_A, COL_A, COL_B, A, B, C));
+
+    for (int p = 0; p < count; ++p) {
+        ROW_A[p] = 1 + rand() % size;
+        COL_A[p] = 1 + rand() % size;
+        COL_B[p] = 1 + rand() % size;
+    }
+    memset(packedC, 0, sizeof(float) * stride_c * count);
+    mat_mul_vbatched(count, ROW_A, COL_A, COL_B, A, B, C);
+    printf("Max relative error: %.3e\n", batch_error(count, ROW_A, COL_A, COL_B, A, B, C));
+
+    mat_mul_batch_release();
+    free(dims);
+    free(M);
+    free(packedA);
+    free(packedB);
+    free(packedC);
+}
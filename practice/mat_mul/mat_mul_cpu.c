@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <sys/time.h>
+#include "sgemm.h"
+
+double get_time();
+
+void mat_mul_cpu(float *A, float *B, float *C,
+                 int ROW_A, int COL_A, int COL_B) {
+  double start_time = get_time();
+  sgemm_cpu(ROW_A, COL_B, COL_A, A, COL_A, B, COL_B, 0.0f, C, COL_B);
+  double gflops = 2.0 * ROW_A * COL_A * COL_B / (get_time() - start_time) * 1e-9;
+
+  double peak = sgemm_cpu_peak();
+  printf("%s, %d threads: %.2f GFLOPS", sgemm_cpu_isa(), sgemm_cpu_threads(), gflops);
+  if (peak > 0) {
+    printf(" (%.1f%% of %.1f GFLOPS peak)", gflops / peak * 100, peak);
+  }
+  printf("\n");
+}